@@ -13,6 +13,7 @@
 
 #include "application.h"
 #include "battery-test.h"
+#include "power-fit.h"
 #include "power-graphs.h"
 #include "test-runner.h"
 #include "util.h"
@@ -27,6 +28,7 @@ struct _GbbApplication {
 
     GbbPowerState *current_state;
     GbbPowerState *previous_state;
+    GbbPowerFit *power_fit;
 
     GtkBuilder *builder;
     GtkWidget *window;
@@ -49,6 +51,10 @@ struct _GbbApplication {
 
     GbbBatteryTest *test;
     GbbTestRun *run;
+
+    /* Last progress reported by the player of the test loop */
+    GbbPlaybackProgress progress;
+    gboolean have_progress;
 };
 
 struct _GbbApplicationClass {
@@ -62,6 +68,11 @@ G_DEFINE_TYPE(GbbApplication, gbb_application, GTK_TYPE_APPLICATION)
 static void
 gbb_application_finalize(GObject *object)
 {
+    GbbApplication *application = GBB_APPLICATION(object);
+
+    g_clear_pointer(&application->power_fit, gbb_power_fit_free);
+
+    G_OBJECT_CLASS(gbb_application_parent_class)->finalize(object);
 }
 
 static void
@@ -122,7 +133,19 @@ update_labels(GbbApplication *application)
         int h, m, s;
         const GbbPowerState *start_state = gbb_test_run_get_start_state(application->run);
         break_time((current_state->time_us - start_state->time_us) / 1000000, &h, &m, &s);
-        title = g_strdup_printf("GNOME Battery Bench - running (%d:%02d:%02d)", h, m, s);
+        double relative_error = gbb_test_run_get_relative_error(application->run);
+        double loop_time = gbb_test_run_get_loop_time(application->run);
+        char *loop = NULL;
+        if (application->have_progress && loop_time > 0)
+            loop = g_strdup_printf(", loop %u at %.0f%%", application->progress.iteration + 1,
+                                   MIN(100, application->progress.position_ms / (10 * loop_time)));
+        if (gbb_test_run_get_duration_type(application->run) == GBB_DURATION_CONVERGED && relative_error >= 0)
+            title = g_strdup_printf("GNOME Battery Bench - running (%d:%02d:%02d, ±%.1f%%%s)", h, m, s,
+                                    100 * relative_error, loop ? loop : "");
+        else
+            title = g_strdup_printf("GNOME Battery Bench - running (%d:%02d:%02d%s)", h, m, s,
+                                    loop ? loop : "");
+        g_free(loop);
         break;
     }
     case GBB_TEST_PHASE_STOPPING:
@@ -160,15 +183,21 @@ update_labels(GbbApplication *application)
     else
         clear_label(application, "percentage-design");
 
+    /* Between firmware updates of the energy counter, only the
+     * instantaneous power gives a meaningful interval reading */
+    double fit_power, fit_error;
+    gboolean have_fit = gbb_power_fit_get_power(application->power_fit, &fit_power, &fit_error);
     GbbPowerStatistics *interval_statistics = NULL;
     if (application->previous_state)
-        interval_statistics = gbb_power_statistics_compute(application->previous_state, current_state);
+        interval_statistics = gbb_power_statistics_compute_with_estimator(application->previous_state, current_state,
+                                                                          GBB_POWER_ESTIMATOR_INTEGRATED);
 
     GbbPowerStatistics *overall_statistics = NULL;
     if (application->run) {
         const GbbPowerState *start_state = gbb_test_run_get_start_state(application->run);
         if (start_state)
-            overall_statistics = gbb_power_statistics_compute(start_state, current_state);
+            overall_statistics = gbb_power_statistics_compute_with_estimator(start_state, current_state,
+                                                                             gbb_test_run_get_estimator(application->run));
     }
 
     if (overall_statistics && overall_statistics->power >= 0)
@@ -176,7 +205,9 @@ update_labels(GbbApplication *application)
     else
         clear_label(application, "power-average");
 
-    if (interval_statistics && interval_statistics->power >= 0) {
+    if (have_fit && fit_power >= 0) {
+        set_label(application, "power-instant", "%.1f ± %.1fW", fit_power, fit_error);
+    } else if (interval_statistics && interval_statistics->power >= 0) {
         set_label(application, "power-instant", "%.1fW", interval_statistics->power);
     } else {
         clear_label(application, "power-instant");
@@ -242,6 +273,9 @@ on_power_monitor_changed(GbbPowerMonitor *monitor,
 
     application->previous_state = application->current_state;
     application->current_state = gbb_power_state_copy(gbb_power_monitor_get_state(monitor));
+    /* The fit only takes points at fuel gauge updates */
+    if (application->current_state->have_energy_time)
+        gbb_power_fit_add_state(application->power_fit, application->current_state);
 
     update_labels(application);
 }
@@ -376,6 +410,8 @@ make_duration_string(GbbTestRun *run)
         return g_strdup_printf("%.0f Minutes", gbb_test_run_get_duration_time(run) / 60);
     case GBB_DURATION_PERCENT:
         return g_strdup_printf("Until %.0f%% battery", gbb_test_run_get_duration_percent(run));
+    case GBB_DURATION_CONVERGED:
+        return g_strdup_printf("Until ±%.0f%% power", 100 * gbb_test_run_get_duration_relative_error(run));
     default:
         g_assert_not_reached();
     }
@@ -479,6 +515,8 @@ application_start(GbbApplication *application)
         gbb_test_run_set_duration_time(application->run, 30 * 60);
     } else if (strcmp(duration_id, "until-percent-5") == 0) {
         gbb_test_run_set_duration_percent(application->run, 5);
+    } else if (strcmp(duration_id, "until-converged-2") == 0) {
+        gbb_test_run_set_duration_converged(application->run, 0.02, 3, 60 * 60);
     }
 
     const char *backlight_id = gtk_combo_box_get_active_id(GTK_COMBO_BOX(application->backlight_combo));
@@ -602,10 +640,9 @@ fill_log_from_run(GbbApplication *application,
     g_free(duration);
     set_label(application, "backlight-log", "%d%%",
               gbb_test_run_get_screen_brightness(run));
-    const GbbPowerState *start_state = gbb_test_run_get_start_state(run);
     const GbbPowerState *last_state = gbb_test_run_get_last_state(run);
-    if (last_state != start_state) {
-        GbbPowerStatistics *statistics = gbb_power_statistics_compute(start_state, last_state);
+    GbbPowerStatistics *statistics = gbb_test_run_compute_statistics(run);
+    if (statistics) {
         if (statistics->power >= 0)
             set_label(application, "power-average-log", "%.1fW", statistics->power);
         else
@@ -636,6 +673,8 @@ fill_log_from_run(GbbApplication *application,
         } else {
             clear_label(application, "estimated-life-design-log");
         }
+
+        gbb_power_statistics_free(statistics);
     }
 
     gbb_power_graphs_set_test_run(GBB_POWER_GRAPHS(application->log_graphs), run);
@@ -845,10 +884,30 @@ gbb_application_class_init(GbbApplicationClass *class)
     gobject_class->finalize = gbb_application_finalize;
 }
 
+/* Signalled by the player at most once a second, so the title can
+ * follow the loop without polling */
+static void
+on_player_progress(GbbEventPlayer            *player,
+                   const GbbPlaybackProgress *progress,
+                   GbbApplication            *application)
+{
+    if (gbb_test_runner_get_phase(application->runner) != GBB_TEST_PHASE_RUNNING)
+        return;
+
+    application->progress = *progress;
+    application->have_progress = TRUE;
+
+    if (application->current_state)
+        update_labels(application);
+}
+
 static void
 on_runner_phase_changed(GbbTestRunner  *runner,
                         GbbApplication *application)
 {
+    if (gbb_test_runner_get_phase(runner) != GBB_TEST_PHASE_RUNNING)
+        application->have_progress = FALSE;
+
     if (gbb_test_runner_get_phase(runner) == GBB_TEST_PHASE_STOPPED) {
         const GbbPowerState *start_state = gbb_test_run_get_start_state(application->run);
         const GbbPowerState *last_state = gbb_test_run_get_last_state(application->run);
@@ -879,6 +938,8 @@ gbb_application_init(GbbApplication *application)
                      G_CALLBACK(on_runner_phase_changed), application);
 
     application->monitor = gbb_test_runner_get_power_monitor(application->runner);
+    /* The recent trend, for the live power reading */
+    application->power_fit = gbb_power_fit_new(300);
 
     char *folder_path = g_build_filename(g_get_user_data_dir(), PACKAGE_NAME, "logs", NULL);
     application->log_folder = g_file_new_for_path(folder_path);
@@ -887,6 +948,8 @@ gbb_application_init(GbbApplication *application)
     application->player = gbb_test_runner_get_event_player(application->runner);
     g_signal_connect(application->player, "ready",
                      G_CALLBACK(on_player_ready), application);
+    g_signal_connect(application->player, "progress",
+                     G_CALLBACK(on_player_progress), application);
 }
 
 GbbApplication *
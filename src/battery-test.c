@@ -11,6 +11,28 @@
 static GList *all_tests;
 static GHashTable *tests_by_id;
 
+/* Missing keys leave @value alone */
+static gboolean
+get_optional_double(GKeyFile   *key_file,
+                    const char *key,
+                    double     *value)
+{
+    GError *error = NULL;
+
+    if (!g_key_file_has_key(key_file, "batterytest", key, NULL))
+        return TRUE;
+
+    double v = g_key_file_get_double(key_file, "batterytest", key, &error);
+    if (error) {
+        g_warning("Bad value for %s key: %s", key, error->message);
+        g_clear_error(&error);
+        return FALSE;
+    }
+
+    *value = v;
+    return TRUE;
+}
+
 static void
 load_test(GFile *filename)
 {
@@ -44,6 +66,24 @@ load_test(GFile *filename)
         goto out;
     }
 
+    gbb_event_transform_init(&test->transform);
+    double max_idle = 0;
+    if (!get_optional_double(key_file, "speed", &test->transform.speed) ||
+        !get_optional_double(key_file, "motion-rate", &test->transform.motion_rate) ||
+        !get_optional_double(key_file, "max-idle", &max_idle))
+        goto out;
+
+    if (test->transform.speed <= 0 || test->transform.motion_rate < 0) {
+        g_warning("speed must be positive, and motion-rate can't be negative");
+        goto out;
+    }
+
+    if (g_key_file_has_key(key_file, "batterytest", "max-idle", NULL) &&
+        !gbb_event_transform_set_max_idle(&test->transform, max_idle)) {
+        g_warning("max-idle must be a positive number of seconds, of at least a millisecond");
+        goto out;
+    }
+
     test->loop_file = g_strconcat(base_path, ".loop", NULL);
     if (!g_file_test(test->loop_file, G_FILE_TEST_EXISTS)) {
         g_warning("%s doesn't exist", test->loop_file);
@@ -176,3 +216,50 @@ gbb_battery_test_list_all(void)
 
     return all_tests;
 }
+
+static gboolean
+load_log(const char   *filename,
+         GbbEventLog **log,
+         GError      **error)
+{
+    if (filename == NULL || *log != NULL)
+        return TRUE;
+
+    *log = gbb_event_log_new_from_file(filename, error);
+
+    return *log != NULL;
+}
+
+/**
+ * gbb_battery_test_load_logs:
+ * @test: a #GbbBatteryTest
+ * @error: location to store error
+ *
+ * Loads the event logs for each phase of the test that has one. They are
+ * kept for the life of the test, so each is only read and parsed once,
+ * however many times it is played. The test's transform is applied to
+ * the loop; the prologue and epilogue set things up and tear them down,
+ * so they are always played as recorded.
+ *
+ * Return value: %TRUE if all the logs were loaded
+ */
+gboolean
+gbb_battery_test_load_logs(GbbBatteryTest *test,
+                           GError        **error)
+{
+    if (!load_log(test->prologue_file, &test->prologue_log, error))
+        return FALSE;
+
+    /* Transformed as soon as it's loaded, so that a retry after another
+     * log failed to load doesn't find it loaded but not transformed */
+    if (test->loop_log == NULL) {
+        if (!load_log(test->loop_file, &test->loop_log, error))
+            return FALSE;
+
+        GbbEventLog *transformed = gbb_event_log_transform(test->loop_log, &test->transform);
+        gbb_event_log_unref(test->loop_log);
+        test->loop_log = transformed;
+    }
+
+    return load_log(test->epilogue_file, &test->epilogue_log, error);
+}
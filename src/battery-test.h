@@ -3,6 +3,8 @@
 
 #include <glib-object.h>
 
+#include "event-log.h"
+
 typedef struct _GbbBatteryTest GbbBatteryTest;
 
 struct _GbbBatteryTest {
@@ -13,9 +15,20 @@ struct _GbbBatteryTest {
     char *prologue_file;
     char *loop_file;
     char *epilogue_file;
+
+    /* Applied to the loop; from the speed, motion-rate and max-idle keys */
+    GbbEventTransform transform;
+
+    /* Loaded by gbb_battery_test_load_logs() */
+    GbbEventLog *prologue_log;
+    GbbEventLog *loop_log;
+    GbbEventLog *epilogue_log;
 };
 
 GbbBatteryTest *gbb_battery_test_get_for_id(const char *id);
 GList          *gbb_battery_test_list_all  (void);
 
+gboolean gbb_battery_test_load_logs (GbbBatteryTest *test,
+                                     GError        **error);
+
 #endif /* __BATTERY_TEST_H__ */
@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/poll.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <X11/Xlib.h>
@@ -15,16 +16,21 @@
 #include <glib.h>
 #include <glib-unix.h>
 #include <gio/gio.h>
+#include <gio/gunixoutputstream.h>
 
 #include "evdev-player.h"
+#include "event-log.h"
 #include "remote-player.h"
 #include "event-recorder.h"
+#include "power-fit.h"
 #include "power-monitor.h"
+#include "power-simulator.h"
 #include "test-runner.h"
 #include "xinput-wait.h"
 #include "util.h"
 
 static GbbPowerState *start_state;
+static GbbPowerFit *monitor_fit;
 
 static void
 on_power_monitor_changed(GbbPowerMonitor *monitor,
@@ -40,12 +46,51 @@ on_power_monitor_changed(GbbPowerMonitor *monitor,
     else if (state->capacity_now >= 0)
         g_print("Capacity: %.2f%%\n", gbb_power_state_get_percent(state));
 
+    int i;
+    for (i = 0; i < state->n_batteries; i++) {
+        const GbbBatteryState *battery = &state->batteries[i];
+        if (state->n_batteries > 1) {
+            double energy = gbb_battery_state_get_energy(battery);
+            if (energy >= 0)
+                g_print("  %s: %.2f WH\n", battery->name, energy);
+            else if (battery->capacity_now >= 0)
+                g_print("  %s: %.2f%%\n", battery->name, 100 * battery->capacity_now);
+        }
+        if (battery->status != GBB_BATTERY_STATUS_UNKNOWN)
+            g_print("  %s status: %s\n", battery->name, gbb_battery_status_get_name(battery->status));
+        if (battery->cycle_count >= 0)
+            g_print("  %s cycle count: %d\n", battery->name, battery->cycle_count);
+    }
+
+    double syscalls_per_sample, usec_per_sample;
+    guint64 dropped_samples;
+    gbb_power_monitor_get_sampling_cost(monitor, &syscalls_per_sample, &usec_per_sample, &dropped_samples);
+    g_print("Sampling cost: %.1f syscalls, %.1f us per sample\n",
+            syscalls_per_sample, usec_per_sample);
+    if (dropped_samples > 0)
+        g_print("Samples dropped: %" G_GUINT64_FORMAT "\n", dropped_samples);
+    double update_period = gbb_power_monitor_get_update_period(monitor);
+    if (update_period >= 0)
+        g_print("Battery updates every %.1fs\n", update_period);
+    if (gbb_power_monitor_get_sampling_mode(monitor) == GBB_SAMPLING_MODE_UEVENT)
+        g_print("Wakeups saved by waiting for uevents: %" G_GINT64_FORMAT "\n",
+                gbb_power_monitor_get_saved_wakeups(monitor));
+
+    double fit_power = -1, fit_error;
     if (runner != NULL) {
         GbbTestRun *run = gbb_test_runner_get_run(runner);
         const GbbPowerState *tmp = gbb_test_run_get_start_state(run);
         if (tmp)
             start_state = gbb_power_state_copy(tmp);
+        if (!gbb_test_run_get_power_fit(run, &fit_power, &fit_error))
+            fit_power = -1;
     } else {
+        if (monitor_fit == NULL)
+            monitor_fit = gbb_power_fit_new(0);
+        gbb_power_fit_add_state(monitor_fit, state);
+        if (!gbb_power_fit_get_power(monitor_fit, &fit_power, &fit_error))
+            fit_power = -1;
+
         if (start_state == NULL) {
             if (!state->online)
                 start_state = gbb_power_state_copy(state);
@@ -63,6 +108,13 @@ on_power_monitor_changed(GbbPowerMonitor *monitor,
         g_print("Average power: %.2f W\n", statistics->power);
     if (statistics->current >= 0)
         g_print("Average current: %.2f A\n", statistics->current);
+    if (statistics->power_integrated >= 0)
+        g_print("Average power (integrated power_now): %.2f W\n", statistics->power_integrated);
+    if (fit_power > 0)
+        g_print("Fitted power: %.2f ± %.2f W (±%.1f%% at 95%% confidence)\n",
+                fit_power, fit_error, 100 * 1.96 * fit_error / fit_power);
+    else if (fit_power == 0)
+        g_print("Fitted power: %.2f ± %.2f W\n", fit_power, fit_error);
     if (statistics->battery_life >= 0) {
         int h, m, s;
         break_time(statistics->battery_life, &h, &m, &s);
@@ -76,12 +128,40 @@ on_power_monitor_changed(GbbPowerMonitor *monitor,
                 statistics->battery_life_design, h, m, s);
     }
 
+    if (start_state->n_batteries > 1) {
+        for (i = 0; i < start_state->n_batteries; i++) {
+            if (statistics->battery_power[i] >= 0)
+                g_print("Average power of %s: %.2f W\n",
+                        start_state->batteries[i].name, statistics->battery_power[i]);
+        }
+    }
+
+    for (i = 0; i < GBB_RAPL_N_DOMAINS; i++) {
+        if (statistics->rapl_power[i] >= 0)
+            g_print("Average RAPL %s power: %.2f W\n",
+                    gbb_rapl_domain_get_name(i), statistics->rapl_power[i]);
+    }
+
     gbb_power_statistics_free(statistics);
 
 }
 
+static void
+on_power_supplies_changed(GbbPowerMonitor *monitor,
+                          gint64           time_us,
+                          const char      *description,
+                          gpointer         data)
+{
+    g_print("%s\n", description);
+}
+
+static gboolean monitor_uevents;
+static gboolean monitor_uevent_files;
+
 static GOptionEntry monitor_options[] =
 {
+    { "uevents", 0, 0, G_OPTION_ARG_NONE, &monitor_uevents, "Read the battery only when the kernel reports a change" },
+    { "uevent-files", 0, 0, G_OPTION_ARG_NONE, &monitor_uevent_files, "Read all battery values from the uevent file in one read" },
     { NULL }
 };
 
@@ -92,9 +172,15 @@ monitor(int argc, char **argv)
     GMainLoop *loop;
 
     monitor = gbb_power_monitor_new();
+    if (monitor_uevents)
+        gbb_power_monitor_set_sampling_mode(monitor, GBB_SAMPLING_MODE_UEVENT);
+    if (monitor_uevent_files)
+        gbb_power_monitor_set_read_uevent_files(monitor, TRUE);
 
     g_signal_connect(monitor, "changed",
                      G_CALLBACK(on_power_monitor_changed), NULL);
+    g_signal_connect(monitor, "supplies-changed",
+                     G_CALLBACK(on_power_supplies_changed), NULL);
 
     loop = g_main_loop_new (NULL, FALSE);
     g_main_loop_run (loop);
@@ -126,27 +212,126 @@ on_player_ready(GObject      *source_object,
     g_main_loop_quit(loop);
 }
 
+static gboolean play_realtime;
+static double play_speed = 1.0;
+static double play_motion_rate;
+static guint play_max_idle; /* ms, or 0 for no limit */
+static double play_start;
+static double play_end = -1;
+
+static void
+print_playback_timing(const GbbPlaybackTiming *timing)
+{
+    if (timing->n_events == 0)
+        return;
+
+    fprintf(stderr,
+            "Event lateness: median %.2f ms, 99%% %.2f ms, max %.2f ms; %"
+            G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " events over 5 ms late\n",
+            gbb_playback_timing_get_percentile(timing, 0.5) / 1000.,
+            gbb_playback_timing_get_percentile(timing, 0.99) / 1000.,
+            timing->max_lateness_us / 1000.,
+            timing->n_late_5ms, timing->n_events);
+
+    if (timing->elapsed_us > 0)
+        fprintf(stderr, "Player wakeups: %.1f/s, write syscalls: %.1f/s, %.2f events per write\n",
+                timing->n_wakeups * 1000000. / timing->elapsed_us,
+                timing->n_writes * 1000000. / timing->elapsed_us,
+                timing->n_writes > 0 ? (double)timing->n_events / timing->n_writes : 0.);
+}
+
 static int
 do_play(GbbEventPlayer *player,
         int             argc,
         char          **argv)
 {
+    if (play_speed <= 0)
+        die("--speed must be greater than zero");
+    if (play_motion_rate < 0)
+        die("--motion-rate can't be negative");
+    if (play_start < 0)
+        die("--start can't be negative");
+    if (play_end >= 0 && play_end <= play_start)
+        die("--end must be after --start");
+
+    GbbEventTransform transform;
+    gbb_event_transform_init(&transform);
+    transform.speed = play_speed;
+    transform.motion_rate = play_motion_rate;
+    transform.max_idle = play_max_idle;
+
+    GError *error = NULL;
+    GbbEventLog *log = gbb_event_log_new_from_file(argv[1], &error);
+    if (!log)
+        die("Can't load event log: %s", error->message);
+
+    /* The range is in the time of the recording, before it's transformed */
+    if (play_start > 0 || play_end >= 0) {
+        GbbEventLog *range = gbb_event_log_new_range(log, play_start * 1000,
+                                                     play_end >= 0 ? play_end * 1000 : G_MAXUINT);
+        gbb_event_log_unref(log);
+        log = range;
+    }
+
+    GbbEventLog *transformed = gbb_event_log_transform(log, &transform);
+    gbb_event_log_unref(log);
+
     GMainLoop *loop = g_main_loop_new (NULL, FALSE);
 
+    gint64 wait_start = g_get_monotonic_time();
     gbb_xinput_wait(player, NULL,
                     NULL, on_player_ready, loop);
     g_main_loop_run (loop);
 
+    fprintf(stderr, "Player startup: devices ready in %.1fms, then waited %.1fms for X to see them\n",
+            gbb_event_player_get_startup_time(player) / 1000.,
+            (g_get_monotonic_time() - MAX(wait_start, gbb_event_player_get_ready_time(player))) / 1000.);
+
     g_signal_connect(player, "finished",
                      G_CALLBACK(on_player_finished), loop);
-    gbb_event_player_play_file(player, argv[1]);
+    gbb_event_player_set_realtime(player, play_realtime);
+    gbb_event_player_play_log(player, transformed);
+    gbb_event_log_unref(transformed);
     g_main_loop_run (loop);
 
+    GbbPlaybackTiming timing;
+    gbb_event_player_get_timing(player, &timing);
+    print_playback_timing(&timing);
+
     return 0;
 }
 
+static gboolean
+parse_max_idle(const char *option_name,
+               const char *value,
+               gpointer    data,
+               GError    **error)
+{
+    GbbEventTransform transform;
+    char *end;
+
+    gbb_event_transform_init(&transform);
+    double seconds = g_ascii_strtod(value, &end);
+    if (end == value || *end != '\0' ||
+        !gbb_event_transform_set_max_idle(&transform, seconds)) {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                    "%s must be a positive number of seconds, of at least a millisecond",
+                    option_name);
+        return FALSE;
+    }
+
+    play_max_idle = transform.max_idle;
+    return TRUE;
+}
+
 static GOptionEntry play_options[] =
 {
+    { "realtime", 'r', 0, G_OPTION_ARG_NONE, &play_realtime, "Play events from a thread with realtime priority" },
+    { "speed", 's', 0, G_OPTION_ARG_DOUBLE, &play_speed, "Play this many times faster than recorded (default 1)", "FACTOR" },
+    { "motion-rate", 0, 0, G_OPTION_ARG_DOUBLE, &play_motion_rate, "Resample pointer motion to this rate", "HZ" },
+    { "max-idle", 0, 0, G_OPTION_ARG_CALLBACK, parse_max_idle, "Shorten gaps between events to at most this long", "SECONDS" },
+    { "start", 0, 0, G_OPTION_ARG_DOUBLE, &play_start, "Start this far into the log", "SECONDS" },
+    { "end", 0, 0, G_OPTION_ARG_DOUBLE, &play_end, "Stop this far into the log", "SECONDS" },
     { NULL }
 };
 
@@ -164,6 +349,293 @@ play_local(int argc, char **argv)
     return do_play(player, argc, argv);
 }
 
+static int bench_events = 1000000;
+
+static GOptionEntry bench_options[] =
+{
+    { "events", 'n', 0, G_OPTION_ARG_INT, &bench_events, "Scale the event log up to, or play, this many events (default 1000000)", "COUNT" },
+    { NULL }
+};
+
+/* The text parser as it was before lines were tokenized in place, for
+ * comparison: it allocates a line, a strv and a name for each event.
+ */
+static int
+bench_parse_legacy(const char *filename,
+                   GError    **error)
+{
+    GFile *file = g_file_new_for_path(filename);
+    GFileInputStream *input_raw = g_file_read(file, NULL, error);
+    g_object_unref(file);
+    if (!input_raw)
+        return -1;
+
+    GDataInputStream *input = g_data_input_stream_new(G_INPUT_STREAM(input_raw));
+    g_object_unref(input_raw);
+
+    GError *local_error = NULL;
+    int n_events = 0;
+    char *line;
+    while ((line = g_data_input_stream_read_line(input, NULL, NULL, &local_error)) != NULL) {
+        char *hash = index(line, '#');
+        if (hash)
+            *hash = '\0';
+        g_strstrip(line);
+
+        char **fields = g_strsplit(line, ",", -1);
+        unsigned time;
+        /* Lines with a bad time are skipped */
+        if (*line && g_strv_length(fields) == 5 && sscanf(fields[1], "%u", &time) == 1) {
+            char *name = g_strdup(fields[0]);
+            int x_root = atoi(fields[2]);
+            int y_root = atoi(fields[3]);
+            int detail = atoi(fields[4]);
+            if (time + x_root + y_root + detail != 0 || name[0] != '\0')
+                n_events++;
+            g_free(name);
+        }
+
+        g_strfreev(fields);
+        g_free(line);
+    }
+
+    g_object_unref(input);
+
+    if (local_error) {
+        g_propagate_error(error, local_error);
+        return -1;
+    }
+
+    return n_events;
+}
+
+static int
+bench_parse(const char *filename,
+            GError    **error)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        die_errno("Can't open '%s'", filename);
+
+    GbbEventLogReader *reader = gbb_event_log_reader_new(fd, error);
+    if (!reader)
+        return -1;
+
+    GError *local_error = NULL;
+    GbbEvent event;
+    int n_events = 0;
+    while (gbb_event_log_reader_next(reader, &event, &local_error))
+        n_events++;
+
+    gbb_event_log_reader_free(reader);
+
+    if (local_error) {
+        g_propagate_error(error, local_error);
+        return -1;
+    }
+
+    return n_events;
+}
+
+static void
+bench_time_parse(const char *label,
+                 int       (*parse) (const char *filename, GError **error),
+                 const char *filename)
+{
+    GError *error = NULL;
+
+    gint64 start_time = g_get_monotonic_time();
+    int n_events = parse(filename, &error);
+    double elapsed = (g_get_monotonic_time() - start_time) / 1000000.;
+
+    if (n_events < 0)
+        die("Error parsing event log: %s", error->message);
+
+    g_print("%-24s %8.1f ms %12.0f events/s\n", label, elapsed * 1000, n_events / elapsed);
+}
+
+/* Times parsing @filename, repeated until it has bench_events events */
+static int
+bench_parser(const char *filename)
+{
+    GError *error = NULL;
+
+    GbbEventLog *log = gbb_event_log_new_from_file(filename, &error);
+    if (!log)
+        die("Can't read event log: %s", error->message);
+
+    guint n_events;
+    const GbbEvent *events = gbb_event_log_get_events(log, &n_events);
+    if (n_events == 0)
+        die("Event log '%s' has no events", filename);
+
+    unsigned duration = gbb_event_log_get_duration(log) + 1;
+
+    char *text_path, *binary_path;
+    int text_fd = g_file_open_tmp("gbb-bench-XXXXXX.loop", &text_path, &error);
+    if (text_fd < 0)
+        die("Can't create temporary file: %s", error->message);
+
+    GOutputStream *unix_output = g_unix_output_stream_new(text_fd, TRUE);
+    GOutputStream *output = g_buffered_output_stream_new(unix_output);
+    g_object_unref(unix_output);
+
+    int i;
+    for (i = 0; i < bench_events; i++) {
+        GbbEvent event = events[i % n_events];
+        event.time += (i / n_events) * duration;
+        if (!gbb_event_write(output, &event, NULL, &error))
+            die("Can't write event log: %s", error->message);
+    }
+    if (!g_output_stream_close(output, NULL, &error))
+        die("Can't write event log: %s", error->message);
+    g_object_unref(output);
+
+    binary_path = g_strconcat(text_path, ".bin", NULL);
+    if (!gbb_event_log_convert(text_path, binary_path, GBB_EVENT_LOG_FORMAT_BINARY, &error))
+        die("Can't convert event log: %s", error->message);
+
+    g_print("%d events (%s repeated)\n", bench_events, filename);
+    bench_time_parse("text, line by line", bench_parse_legacy, text_path);
+    bench_time_parse("text, in place", bench_parse, text_path);
+    bench_time_parse("binary, mapped", bench_parse, binary_path);
+
+    unlink(text_path);
+    unlink(binary_path);
+    g_free(text_path);
+    g_free(binary_path);
+    gbb_event_log_unref(log);
+
+    return 0;
+}
+
+static gint64
+get_cpu_time(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0)
+        die_errno("Can't get CPU time");
+
+    return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Times playing @filename, looped until bench_events events have been
+ * played, on a virtual clock and into /dev/null, so it measures what
+ * the player itself costs, and doesn't need to be root */
+static int
+bench_player(const char *filename)
+{
+    GError *error = NULL;
+
+    gint64 start_time = g_get_monotonic_time();
+    GbbEventLog *log = gbb_event_log_new_from_file(filename, &error);
+    if (!log)
+        die("Can't read event log: %s", error->message);
+    double load_elapsed = (g_get_monotonic_time() - start_time) / 1000000.;
+
+    guint n_events;
+    gbb_event_log_get_events(log, &n_events);
+    if (n_events == 0)
+        die("Event log '%s' has no events", filename);
+
+    int sink_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (sink_fd < 0)
+        die_errno("Can't open /dev/null");
+
+    GbbEvdevDevices *devices = gbb_evdev_devices_new_for_fds(sink_fd, sink_fd);
+    GbbEvdevPlayer *player = gbb_evdev_player_new_for_devices(devices);
+    gbb_evdev_player_set_virtual_time(player, TRUE);
+
+    GMainLoop *loop = g_main_loop_new (NULL, FALSE);
+    g_signal_connect(player, "finished",
+                     G_CALLBACK(on_player_finished), loop);
+
+    guint n_iterations = (bench_events + n_events - 1) / n_events;
+
+    start_time = g_get_monotonic_time();
+    gint64 start_cpu = get_cpu_time();
+    gbb_event_player_play_loop(GBB_EVENT_PLAYER(player), log, 0, n_iterations, 0);
+    g_main_loop_run (loop);
+    double elapsed = (g_get_monotonic_time() - start_time) / 1000000.;
+    gint64 cpu = get_cpu_time() - start_cpu;
+
+    GbbPlaybackTiming timing;
+    gbb_event_player_get_timing(GBB_EVENT_PLAYER(player), &timing);
+    if (timing.n_events == 0)
+        die("No events were played");
+
+    g_print("%" G_GUINT64_FORMAT " events (%s, %u times)\n", timing.n_events, filename, n_iterations);
+    g_print("%-24s %8.1f ms\n", "load", load_elapsed * 1000);
+    g_print("%-24s %8.1f ms %12.0f events/s\n", "play", elapsed * 1000, timing.n_events / elapsed);
+    g_print("%-24s %8.0f ns/event\n", "CPU", (double)cpu / timing.n_events);
+    g_print("%-24s %8.3f wakeups/event %8.3f writes/event\n", "",
+            (double)timing.n_wakeups / timing.n_events,
+            (double)timing.n_writes / timing.n_events);
+
+    g_main_loop_unref(loop);
+    g_object_unref(player);
+    gbb_evdev_devices_free(devices);
+    close(sink_fd);
+    gbb_event_log_unref(log);
+
+    return 0;
+}
+
+static int
+bench(int argc, char **argv)
+{
+    if (bench_events <= 0)
+        die("--events argument must be positive");
+
+    if (strcmp(argv[1], "parser") == 0)
+        return bench_parser(argv[2]);
+    else if (strcmp(argv[1], "player") == 0)
+        return bench_player(argv[2]);
+
+    die("Unknown benchmark '%s'; available benchmarks: parser, player", argv[1]);
+}
+
+static gboolean convert_binary;
+static gboolean convert_text;
+
+static GOptionEntry convert_options[] =
+{
+    { "binary", 'b', 0, G_OPTION_ARG_NONE, &convert_binary, "Write a binary event log (default for text input)" },
+    { "text", 't', 0, G_OPTION_ARG_NONE, &convert_text, "Write a text event log (default for binary input)" },
+    { NULL }
+};
+
+static int
+convert(int argc, char **argv)
+{
+    GbbEventLogFormat format;
+    GError *error = NULL;
+
+    if (convert_binary && convert_text)
+        die("Only one of --binary and --text can be specified");
+
+    if (convert_binary) {
+        format = GBB_EVENT_LOG_FORMAT_BINARY;
+    } else if (convert_text) {
+        format = GBB_EVENT_LOG_FORMAT_TEXT;
+    } else {
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            die_errno("Can't open '%s'", argv[1]);
+        if (gbb_event_log_get_format(fd) == GBB_EVENT_LOG_FORMAT_BINARY)
+            format = GBB_EVENT_LOG_FORMAT_TEXT;
+        else
+            format = GBB_EVENT_LOG_FORMAT_BINARY;
+        close(fd);
+    }
+
+    if (!gbb_event_log_convert(argv[1], argv[2], format, &error))
+        die("Can't convert event log: %s", error->message);
+
+    return 0;
+}
+
 static char *record_output;
 
 static GOptionEntry record_options[] =
@@ -190,20 +662,47 @@ record(int argc, char **argv)
 
 static char *test_duration;
 static int test_min_battery = -42;
+static double test_converge = -1;
+static int test_min_iterations = 3;
 static int test_screen_brightness = 50;
 static char *test_output;
 static gboolean test_verbose;
+static gboolean test_uevents;
+static gboolean test_uevent_files;
+static char *test_estimator;
+static gboolean test_realtime;
+static char *test_resume;
+static double test_progress_interval = -1;
 
 static GOptionEntry test_options[] =
 {
     { "duration", 'd', 0, G_OPTION_ARG_STRING, &test_duration, "Duration (1h, 10m, etc.)", "DURATION" },
     { "min-battery", 'm', 0, G_OPTION_ARG_INT, &test_duration, "", "PERCENT" },
+    { "converge", 'c', 0, G_OPTION_ARG_DOUBLE, &test_converge, "Run until power is known within this relative error (e.g. 2 for ±2%)", "PERCENT" },
+    { "min-iterations", 0, 0, G_OPTION_ARG_INT, &test_min_iterations, "With --converge, run at least this many loops (default 3)", "N" },
     { "screen-brightness", 0, 0, G_OPTION_ARG_INT, &test_screen_brightness, "screen backlight brightness (0-100)", "PERCENT" },
     { "output", 'o', 0, G_OPTION_ARG_FILENAME, &test_output, "Output filename", "FILENAME" },
     { "verbose", 'v', 0, G_OPTION_ARG_NONE, &test_verbose, "Show verbose statistics" },
+    { "uevents", 0, 0, G_OPTION_ARG_NONE, &test_uevents, "Read the battery only when the kernel reports a change" },
+    { "uevent-files", 0, 0, G_OPTION_ARG_NONE, &test_uevent_files, "Read all battery values from the uevent file in one read" },
+    { "estimator", 0, 0, G_OPTION_ARG_STRING, &test_estimator, "How to compute power: energy (default) or integrated", "ESTIMATOR" },
+    { "realtime", 'r', 0, G_OPTION_ARG_NONE, &test_realtime, "Play events from a thread with realtime priority" },
+    { "resume", 0, 0, G_OPTION_ARG_FILENAME, &test_resume, "Start the loop where the run saved in FILENAME stopped", "FILENAME" },
+    { "progress-interval", 0, 0, G_OPTION_ARG_DOUBLE, &test_progress_interval, "How often the player reports its position (default 1, 0 for never)", "SECONDS" },
     { NULL }
 };
 
+static GbbPowerEstimator
+parse_estimator(const char *estimator_name)
+{
+    GbbPowerEstimator estimator;
+
+    if (!gbb_power_estimator_from_name(estimator_name, &estimator))
+        die("--estimator argument must be 'energy' or 'integrated'");
+
+    return estimator;
+}
+
 static void
 test_on_player_ready(GbbEventPlayer *player,
                      GbbTestRunner  *runner)
@@ -244,6 +743,11 @@ on_runner_phase_changed(GbbTestRunner *runner,
     case GBB_TEST_PHASE_STOPPED: {
         GbbTestRun *run = gbb_test_runner_get_run(runner);
         GError *error = NULL;
+
+        const GbbPlaybackTiming *timing = gbb_test_run_get_playback_timing(run);
+        if (timing)
+            print_playback_timing(timing);
+
         if (!gbb_test_run_write_to_file(run, test_output, &error))
             die("Can't write test run to disk: %s", error->message);
         g_main_loop_quit(loop);
@@ -339,10 +843,18 @@ test(int argc, char **argv)
 {
     if (test_duration != NULL && test_min_battery != -42)
         die("Only one of --min-battery and --duration can be specified");
+    if (test_converge != -1 && test_min_battery != -42)
+        die("Only one of --min-battery and --converge can be specified");
+    if (test_converge != -1 && test_converge <= 0)
+        die("--converge argument must be positive");
+    if (test_min_iterations < 0)
+        die("--min-iterations argument must not be negative");
     if (test_min_battery != -42 && (test_min_battery < 0 || test_min_battery > 100))
         die("--min-battery argument must be between 0 and 100");
     if (test_screen_brightness < 0 || test_screen_brightness > 100)
         die("--screen-brightness argument must be between 0 and 100");
+    if (test_progress_interval != -1 && test_progress_interval < 0)
+        die("--progress-interval argument must not be negative");
 
     const char *test_id = argv[1];
     GbbBatteryTest *test = gbb_battery_test_get_for_id(test_id);
@@ -354,7 +866,27 @@ test(int argc, char **argv)
 
     GbbTestRun *run = gbb_test_run_new(test);
 
+    if (test_resume) {
+        GError *error = NULL;
+        GbbTestRun *previous = gbb_test_run_new_from_file(test_resume, &error);
+        if (!previous)
+            die("Can't load %s: %s", test_resume, error->message);
+
+        guint position;
+        if (g_strcmp0(gbb_test_run_get_name(previous), gbb_test_run_get_name(run)) != 0)
+            die("%s is a run of a different test", test_resume);
+        if (!test->loop_log || !gbb_test_run_get_loop_stop(previous, &position))
+            die("%s doesn't record where the test loop stopped", test_resume);
+
+        gbb_test_run_set_loop_start(run, position);
+        g_object_unref(previous);
+    }
+
     if (test_min_battery != -42) {
+    } else if (test_converge != -1) {
+        /* --duration is then the most we're willing to wait */
+        int max_seconds = test_duration ? parse_duration(test_duration) : 0;
+        gbb_test_run_set_duration_converged(run, test_converge / 100., test_min_iterations, max_seconds);
     } else if (test_duration != NULL) {
         int seconds = parse_duration(test_duration);
         gbb_test_run_set_duration_time(run, seconds);
@@ -363,11 +895,22 @@ test(int argc, char **argv)
     }
 
     gbb_test_run_set_screen_brightness(run, test_screen_brightness);
+    if (test_estimator)
+        gbb_test_run_set_estimator(run, parse_estimator(test_estimator));
 
     GbbTestRunner *runner = gbb_test_runner_new();
     gbb_test_runner_set_run(runner, run);
 
+    if (test_uevents)
+        gbb_power_monitor_set_sampling_mode(gbb_test_runner_get_power_monitor(runner),
+                                            GBB_SAMPLING_MODE_UEVENT);
+    if (test_uevent_files)
+        gbb_power_monitor_set_read_uevent_files(gbb_test_runner_get_power_monitor(runner), TRUE);
+
     GbbEventPlayer *player = gbb_test_runner_get_event_player(runner);
+    gbb_event_player_set_realtime(player, test_realtime);
+    if (test_progress_interval != -1)
+        gbb_event_player_set_progress_interval(player, test_progress_interval * 1000);
     if (gbb_event_player_is_ready(player)) {
         test_on_player_ready(player, runner);
     } else {
@@ -379,6 +922,8 @@ test(int argc, char **argv)
         GbbPowerMonitor *monitor = gbb_test_runner_get_power_monitor(runner);
         g_signal_connect(monitor, "changed",
                          G_CALLBACK(on_power_monitor_changed), runner);
+        g_signal_connect(monitor, "supplies-changed",
+                         G_CALLBACK(on_power_supplies_changed), NULL);
         on_power_monitor_changed(monitor, runner);
     }
 
@@ -393,6 +938,172 @@ test(int argc, char **argv)
     return 0;
 }
 
+static double simulate_time_scale = 100;
+static char *simulate_duration;
+static double simulate_converge = -1;
+static char *simulate_output;
+static gboolean simulate_uevents;
+static gboolean simulate_uevent_files;
+static char *simulate_estimator;
+
+static GOptionEntry simulate_options[] =
+{
+    { "time-scale", 's', 0, G_OPTION_ARG_DOUBLE, &simulate_time_scale, "Run this many times faster than real time (default 100)", "FACTOR" },
+    { "duration", 'd', 0, G_OPTION_ARG_STRING, &simulate_duration, "Simulated duration (default: until the end of the script)", "DURATION" },
+    { "converge", 'c', 0, G_OPTION_ARG_DOUBLE, &simulate_converge, "Stop early once power is known within this relative error (e.g. 2 for ±2%)", "PERCENT" },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &simulate_output, "Output filename", "FILENAME" },
+    { "uevents", 0, 0, G_OPTION_ARG_NONE, &simulate_uevents, "Read the battery only when the kernel reports a change" },
+    { "uevent-files", 0, 0, G_OPTION_ARG_NONE, &simulate_uevent_files, "Read all battery values from the uevent file in one read" },
+    { "estimator", 0, 0, G_OPTION_ARG_STRING, &simulate_estimator, "How to compute power: energy (default) or integrated", "ESTIMATOR" },
+    { NULL }
+};
+
+static GbbBatteryTest simulate_test = {
+    .id = "simulate",
+    .name = "Simulated battery",
+    .transform = { .speed = 1.0 },
+};
+
+static int simulate_n_samples;
+/* Give up if the battery doesn't update before this time (sample clock) */
+static gint64 simulate_start_deadline;
+
+/* Like a real test, the run starts on the first fuel gauge update */
+static void
+on_simulate_monitor_changed(GbbPowerMonitor *monitor,
+                            GbbTestRun      *run)
+{
+    const GbbPowerState *state = gbb_power_monitor_get_state(monitor);
+
+    if (!gbb_test_run_get_start_state(run) && !state->have_energy_time)
+        return;
+
+    gbb_test_run_add(run, state);
+    simulate_n_samples++;
+}
+
+static void
+on_simulate_supplies_changed(GbbPowerMonitor *monitor,
+                             gint64           time_us,
+                             const char      *description,
+                             GbbTestRun      *run)
+{
+    gbb_test_run_add_event(run, time_us, description);
+}
+
+static gboolean
+on_simulate_check_done(gpointer data)
+{
+    GbbTestRun *run = data;
+    GMainLoop *loop = g_object_get_data(G_OBJECT(run), "loop");
+    GbbPowerMonitor *monitor = g_object_get_data(G_OBJECT(run), "monitor");
+
+    if (!gbb_test_run_get_start_state(run)) {
+        if (gbb_power_monitor_get_state(monitor)->time_us > simulate_start_deadline)
+            die("The simulated battery never reported an update");
+        return G_SOURCE_CONTINUE;
+    }
+
+    if (gbb_test_run_is_done(run)) {
+        g_main_loop_quit(loop);
+        return G_SOURCE_REMOVE;
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/* Drives the whole sampling -> test run -> JSON pipeline from a scripted
+ * battery in a temporary sysfs tree, at accelerated speed.
+ */
+static int
+simulate(int argc, char **argv)
+{
+    GError *error = NULL;
+
+    if (simulate_time_scale <= 0)
+        die("--time-scale argument must be positive");
+
+    GbbPowerSimulator *simulator = gbb_power_simulator_new(argv[1], simulate_time_scale, &error);
+    if (!simulator)
+        die("Can't start simulation: %s", error->message);
+
+    double duration;
+    if (simulate_duration != NULL)
+        duration = parse_duration(simulate_duration);
+    else
+        duration = gbb_power_simulator_get_duration(simulator);
+    if (duration <= 0)
+        die("Script has no duration; add an 'end' command or use --duration");
+
+    simulate_test.description = argv[1];
+
+    GbbPowerMonitor *monitor = gbb_power_monitor_new_for_root(gbb_power_simulator_get_sysfs_root(simulator));
+    gbb_power_monitor_set_time_scale(monitor, simulate_time_scale);
+    if (simulate_uevents)
+        gbb_power_monitor_set_sampling_mode(monitor, GBB_SAMPLING_MODE_UEVENT);
+    if (simulate_uevent_files)
+        gbb_power_monitor_set_read_uevent_files(monitor, TRUE);
+
+    GbbTestRun *run = gbb_test_run_new(&simulate_test);
+    if (simulate_converge > 0)
+        gbb_test_run_set_duration_converged(run, simulate_converge / 100., 0, duration);
+    else
+        gbb_test_run_set_duration_time(run, duration);
+    gbb_test_run_set_start_time(run, time(NULL));
+    if (simulate_estimator)
+        gbb_test_run_set_estimator(run, parse_estimator(simulate_estimator));
+    simulate_start_deadline = gbb_power_monitor_get_state(monitor)->time_us + duration * 1000000.;
+
+    GMainLoop *loop = g_main_loop_new (NULL, FALSE);
+    g_object_set_data(G_OBJECT(run), "loop", loop);
+    g_object_set_data(G_OBJECT(run), "monitor", monitor);
+
+    g_signal_connect(monitor, "changed",
+                     G_CALLBACK(on_simulate_monitor_changed), run);
+    g_signal_connect(monitor, "supplies-changed",
+                     G_CALLBACK(on_simulate_supplies_changed), run);
+    g_timeout_add(10, on_simulate_check_done, run);
+
+    gint64 start_time = g_get_monotonic_time();
+    g_main_loop_run (loop);
+    double elapsed = (g_get_monotonic_time() - start_time) / 1000000.;
+
+    g_signal_handlers_disconnect_by_func(monitor, (gpointer)on_simulate_monitor_changed, run);
+    g_signal_handlers_disconnect_by_func(monitor, (gpointer)on_simulate_supplies_changed, run);
+
+    GbbPowerStatistics *statistics = gbb_test_run_compute_statistics(run);
+
+    const GbbPowerState *first_state = gbb_test_run_get_start_state(run);
+    const GbbPowerState *last_state = gbb_test_run_get_last_state(run);
+    g_print("Simulated %.0fs in %.2fs\n", (last_state->time_us - first_state->time_us) / 1000000., elapsed);
+    g_print("Samples: %d (%.1f per second)\n", simulate_n_samples, simulate_n_samples / elapsed);
+    if (statistics == NULL)
+        die("Not enough samples to compute statistics");
+    if (statistics->power >= 0)
+        g_print("Average power: %.2f W\n", statistics->power);
+    if (statistics->power_integrated >= 0)
+        g_print("Average power (integrated power_now): %.2f W\n", statistics->power_integrated);
+    double fit_power, fit_error;
+    if (gbb_test_run_get_power_fit(run, &fit_power, &fit_error))
+        g_print("Fitted power: %.2f ± %.2f W\n", fit_power, fit_error);
+    if (statistics->battery_life >= 0)
+        g_print("Predicted battery life: %.0fs\n", statistics->battery_life);
+
+    gbb_power_statistics_free(statistics);
+
+    if (simulate_output != NULL) {
+        if (!gbb_test_run_write_to_file(run, simulate_output, &error))
+            die("Can't write test run to disk: %s", error->message);
+    }
+
+    g_object_unref(monitor);
+    g_object_unref(run);
+    g_main_loop_unref(loop);
+    gbb_power_simulator_free(simulator);
+
+    return 0;
+}
+
 typedef struct {
     const char *command;
     const GOptionEntry *options;
@@ -404,10 +1115,13 @@ typedef struct {
 } Subcommand;
 
 Subcommand subcommands[] = {
+    { "bench",        bench_options, NULL, bench, 2, 2, "BENCHMARK FILENAME" },
+    { "convert",      convert_options, NULL, convert, 2, 2, "INPUT OUTPUT" },
     { "monitor",      monitor_options, NULL, monitor, 0, 0 },
     { "play",         play_options, NULL, play, 1, 1, "FILENAME" },
     { "play-local",   play_options, NULL, play_local, 1, 1, "FILENAME" },
     { "record",       record_options, NULL, record, 0, 0 },
+    { "simulate",     simulate_options, NULL, simulate, 1, 1, "SCRIPT" },
     { "test",         test_options, test_prepare_context, test, 1, 1, "TEST_ID" },
     { NULL }
 };
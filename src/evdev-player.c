@@ -1,12 +1,18 @@
 /* -*- mode: C; c-file-style: "stroustrup"; indent-tabs-mode: nil; -*- */
 
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #include <gio/gio.h>
-#include <gio/gunixinputstream.h>
+#include <glib-unix.h>
 
 #include <libevdev/libevdev.h>
 #include <libevdev/libevdev-uinput.h>
@@ -17,22 +23,71 @@
 
 typedef struct _GbbEvdevPlayerClass GbbEvdevPlayerClass;
 
-static void queue_event(GbbEvdevPlayer *player);
+#define MAX_FRAME_EVENTS 64
+
+/* Input events for one device, written with a single write() */
+typedef struct {
+    int fd;
+    struct input_event events[MAX_FRAME_EVENTS];
+    guint n_events;
+    guint sync_start; /* First event since the last SYN_REPORT */
+} Frame;
+
+/* Without uinput devices, events are written straight to the file
+ * descriptors, which belong to the caller */
+struct _GbbEvdevDevices {
+    struct libevdev_uinput *keyboard;
+    struct libevdev_uinput *mouse;
+    int keyboard_fd;
+    int mouse_fd;
+};
 
 struct _GbbEvdevPlayer {
     GbbEventPlayer parent;
 
     char *filename;
     gint64 start_time;
-    struct libevdev_uinput *uidev_keyboard;
-    struct libevdev_uinput *uidev_mouse;
-    GDataInputStream *input;
+    GbbEvdevDevices *devices;
+    gboolean owns_devices;
+    GbbEventLog *log;
+    guint position;
+    guint start_offset; /* ms into the log that playback started at */
+    guint iteration;
+    guint n_iterations;
+    guint max_duration;
 
     guint ready_timeout;
     gboolean ready;
 
-    GbbEvent *next_event;
-    guint next_event_timeout;
+    /* Play events as fast as possible, on a clock that jumps to each
+     * event's scheduled time */
+    gboolean virtual_time;
+    gint64 virtual_now;
+
+    const GbbEvent *next_event;
+    gint64 next_event_time;
+    int timer_fd;
+    guint timer_source;
+
+    /* For realtime playback */
+    GThread *thread;
+    int stop_fd;
+    guint play_serial;
+
+    /* Written by the playback thread when there is one */
+    GMutex timing_lock;
+    GbbPlaybackTiming timing;
+    GbbPlaybackProgress progress;
+
+    /* Progress is reported when playing events, at most once per
+     * interval, rather than from a timer of its own */
+    gint64 progress_interval_us; /* 0 for no progress reports */
+    gint64 progress_time; /* When progress was last due */
+    guint64 progress_reported; /* n_events at the last progress signal */
+
+    Frame keyboard_frame;
+    Frame mouse_frame;
+    guint n_frame_writes;
 };
 
 struct _GbbEvdevPlayerClass {
@@ -44,86 +99,464 @@ struct _GbbEvdevPlayerClass {
 G_DEFINE_TYPE(GbbEvdevPlayer, gbb_evdev_player, GBB_TYPE_EVENT_PLAYER)
 
 static void
-write_event(const struct libevdev_uinput *uinput_dev,
-            unsigned int type,
-            unsigned int code,
-            int value)
+frame_sync(Frame *frame)
 {
-    int rc = libevdev_uinput_write_event(uinput_dev, type, code, value);
-    if (rc != 0)
-        die("Can't write event (%u %u %i): %s", type, code, value, strerror(-rc));
+    struct input_event *ev = &frame->events[frame->n_events++];
+
+    memset(ev, 0, sizeof(*ev));
+    ev->type = EV_SYN;
+    ev->code = SYN_REPORT;
+
+    frame->sync_start = frame->n_events;
+}
+
+static void
+frame_flush(GbbEvdevPlayer *player,
+            Frame          *frame)
+{
+    if (frame->n_events > frame->sync_start)
+        frame_sync(frame);
+    if (frame->n_events == 0)
+        return;
+
+    gsize size = frame->n_events * sizeof(struct input_event);
+    ssize_t written;
+    do {
+        written = write(frame->fd, frame->events, size);
+    } while (written < 0 && errno == EINTR);
+
+    if (written < 0)
+        die_errno("Can't write events");
+    else if ((gsize)written != size)
+        die("Short write of events");
+
+    player->n_frame_writes++;
+    frame->n_events = 0;
+    frame->sync_start = 0;
+}
+
+static void
+frame_add(GbbEvdevPlayer *player,
+          Frame          *frame,
+          unsigned int    type,
+          unsigned int    code,
+          int             value)
+{
+    guint i;
+
+    /* A second value for the same code would replace the first within
+     * a report, so start a new report */
+    for (i = frame->sync_start; i < frame->n_events; i++) {
+        if (frame->events[i].type == type && frame->events[i].code == code) {
+            frame_sync(frame);
+            break;
+        }
+    }
+
+    /* Leave room for the final SYN_REPORT */
+    if (frame->n_events + 2 > MAX_FRAME_EVENTS)
+        frame_flush(player, frame);
+
+    struct input_event *ev = &frame->events[frame->n_events++];
+    memset(ev, 0, sizeof(*ev));
+    ev->type = type;
+    ev->code = code;
+    ev->value = value;
+}
+
+static int
+get_button(const GbbEvent *event)
+{
+    return event->detail == 1 ? BTN_LEFT : (event->detail == 2 ? BTN_MIDDLE : BTN_RIGHT);
+}
+
+static void
+play_key_press(GbbEvdevPlayer *player,
+               const GbbEvent *event)
+{
+    frame_add(player, &player->keyboard_frame, EV_KEY, event->detail, 1);
+}
+
+static void
+play_key_release(GbbEvdevPlayer *player,
+                 const GbbEvent *event)
+{
+    frame_add(player, &player->keyboard_frame, EV_KEY, event->detail, 0);
+}
+
+static void
+play_button_press(GbbEvdevPlayer *player,
+                  const GbbEvent *event)
+{
+    frame_add(player, &player->mouse_frame, EV_KEY, get_button(event), 1);
+}
+
+static void
+play_button_release(GbbEvdevPlayer *player,
+                    const GbbEvent *event)
+{
+    frame_add(player, &player->mouse_frame, EV_KEY, get_button(event), 0);
+}
+
+static void
+play_wheel(GbbEvdevPlayer *player,
+           const GbbEvent *event)
+{
+    frame_add(player, &player->mouse_frame, EV_REL, REL_WHEEL, event->detail);
+}
+
+static void
+play_motion_notify(GbbEvdevPlayer *player,
+                   const GbbEvent *event)
+{
+    frame_add(player, &player->mouse_frame, EV_ABS, ABS_X, event->x_root);
+    frame_add(player, &player->mouse_frame, EV_ABS, ABS_Y, event->y_root);
 }
 
+typedef void (*EventHandler) (GbbEvdevPlayer *player,
+                              const GbbEvent *event);
+
+static const EventHandler event_handlers[GBB_EVENT_N_TYPES] = {
+    [GBB_EVENT_KEY_PRESS] = play_key_press,
+    [GBB_EVENT_KEY_RELEASE] = play_key_release,
+    [GBB_EVENT_BUTTON_PRESS] = play_button_press,
+    [GBB_EVENT_BUTTON_RELEASE] = play_button_release,
+    [GBB_EVENT_WHEEL] = play_wheel,
+    [GBB_EVENT_MOTION_NOTIFY] = play_motion_notify
+};
+
+/* Moves on to the next event, going back to the start of the log for
+ * the next iteration if there is one. Returns %FALSE at the end of the
+ * last iteration.
+ */
 static gboolean
-next_event_timeout(void *data)
+advance(GbbEvdevPlayer *player,
+        gboolean       *iteration_finished)
 {
-    GbbEvdevPlayer *player = data;
-    GbbEvent *event = player->next_event;
+    guint n_events;
+    const GbbEvent *events = gbb_event_log_get_events(player->log, &n_events);
+    /* Iterations follow each other on one timeline, so timer jitter
+     * doesn't accumulate from one to the next */
+    guint period = MAX(gbb_event_log_get_duration(player->log), 1);
 
+    *iteration_finished = FALSE;
     player->next_event = NULL;
-    player->next_event_timeout = 0;
 
-    if (!event) {
-        gbb_event_player_stop(GBB_EVENT_PLAYER(player));
+    if (player->position == n_events && n_events > 0) {
+        player->iteration++;
+        *iteration_finished = TRUE;
+
+        if ((player->n_iterations == 0 || player->iteration < player->n_iterations) &&
+            (player->max_duration == 0 ||
+             (guint64)player->iteration * period - player->start_offset < player->max_duration))
+            player->position = 0;
+    }
+
+    if (player->position >= n_events)
         return FALSE;
+
+    player->next_event = &events[player->position++];
+    player->next_event_time = (player->start_time +
+                               1000 * ((gint64)player->iteration * period + player->next_event->time -
+                                       player->start_offset));
+
+    return TRUE;
+}
+
+/* Deadlines are absolute CLOCK_MONOTONIC times in microseconds, the
+ * same clock as g_get_monotonic_time() */
+static void
+arm_timer(int    timer_fd,
+          gint64 deadline)
+{
+    struct itimerspec spec = { { 0, 0 }, { 0, 0 } };
+
+    spec.it_value.tv_sec = deadline / 1000000;
+    spec.it_value.tv_nsec = (deadline % 1000000) * 1000;
+    /* All zeros would disarm the timer */
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+        spec.it_value.tv_nsec = 1;
+
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) != 0)
+        die_errno("Can't set timer");
+}
+
+static void
+disarm_timer(int timer_fd)
+{
+    struct itimerspec spec = { { 0, 0 }, { 0, 0 } };
+
+    if (timerfd_settime(timer_fd, 0, &spec, NULL) != 0)
+        die_errno("Can't set timer");
+}
+
+static void
+clear_timer(int timer_fd)
+{
+    guint64 expirations;
+
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        die_errno("Can't read timer");
+}
+
+static gint64
+player_now(GbbEvdevPlayer *player)
+{
+    return player->virtual_time ? player->virtual_now : g_get_monotonic_time();
+}
+
+static void
+queue_event(GbbEvdevPlayer *player)
+{
+    gboolean iteration_finished;
+
+    g_return_if_fail(player->next_event == NULL);
+
+    gboolean have_event = advance(player, &iteration_finished);
+
+    if (iteration_finished) {
+        /* A handler might stop us */
+        gbb_event_player_iteration_finished(GBB_EVENT_PLAYER(player), player->iteration);
+        if (!player->log)
+            return;
     }
 
-    if (strcmp (event->name, "KeyPress") == 0) {
-        write_event(player->uidev_keyboard, EV_KEY, event->detail, 1);
-        write_event(player->uidev_keyboard, EV_SYN, SYN_REPORT, 0);
-    } else if (strcmp (event->name, "KeyRelease") == 0) {
-        write_event(player->uidev_keyboard, EV_KEY, event->detail, 0);
-        write_event(player->uidev_keyboard, EV_SYN, SYN_REPORT, 0);
-    } else if (strcmp (event->name, "ButtonPress") == 0) {
-        int button = event->detail == 1 ? BTN_LEFT : (event->detail == 2 ? BTN_MIDDLE : BTN_RIGHT);
-
-        write_event(player->uidev_mouse, EV_KEY, button, 1);
-        write_event(player->uidev_mouse, EV_SYN, SYN_REPORT, 0);
-    } else if (strcmp (event->name, "ButtonRelease") == 0) {
-        int button = event->detail == 1 ? BTN_LEFT : (event->detail == 2 ? BTN_MIDDLE : BTN_RIGHT);
-
-        write_event(player->uidev_mouse, EV_KEY, button, 0);
-        write_event(player->uidev_mouse, EV_SYN, SYN_REPORT, 0);
-    } else if (strcmp (event->name, "Wheel") == 0) {
-        write_event(player->uidev_mouse, EV_REL, REL_WHEEL, event->detail);
-        write_event(player->uidev_mouse, EV_SYN, SYN_REPORT, 0);
-    } else if (strcmp (event->name, "MotionNotify") == 0) {
-        write_event(player->uidev_mouse, EV_ABS, ABS_X, event->x_root);
-        write_event(player->uidev_mouse, EV_ABS, ABS_Y, event->y_root);
-        write_event(player->uidev_mouse, EV_SYN, SYN_REPORT, 0);
+    /* With virtual time, the timer still fires, so playback takes the
+     * same path through the main loop, just without waiting */
+    if (player->virtual_time) {
+        if (have_event)
+            player->virtual_now = MAX(player->virtual_now, player->next_event_time);
+        arm_timer(player->timer_fd, 0);
+        return;
     }
 
-    gbb_event_free(event);
+    /* At the end, fire straight away to finish */
+    arm_timer(player->timer_fd, have_event ? player->next_event_time : g_get_monotonic_time());
+}
+
+/* Plays the next event, along with the events after it in the same
+ * iteration that are due at the same time, as one frame for each
+ * device. Leaves next_event pointing to the first of them. Returns
+ * %TRUE if progress should be reported.
+ */
+static gboolean
+play_events(GbbEvdevPlayer *player)
+{
+    guint n_events;
+    const GbbEvent *events = gbb_event_log_get_events(player->log, &n_events);
+    const GbbEvent *event = player->next_event;
+    guint n_played = 1;
+    guint i;
+
+    event_handlers[event->type](player, event);
+    while (player->position < n_events && events[player->position].time == event->time) {
+        event_handlers[events[player->position].type](player, &events[player->position]);
+        player->position++;
+        n_played++;
+    }
+
+    player->n_frame_writes = 0;
+    frame_flush(player, &player->keyboard_frame);
+    frame_flush(player, &player->mouse_frame);
+
+    gint64 now = player_now(player);
+    gint64 lateness = now - player->next_event_time;
+
+    g_mutex_lock(&player->timing_lock);
+    for (i = 0; i < n_played; i++)
+        gbb_playback_timing_add(&player->timing, lateness);
+    player->timing.n_wakeups++;
+    player->timing.n_writes += player->n_frame_writes;
+    player->timing.elapsed_us = now - player->start_time;
+    /* Everything due at this time has been played; after the last
+     * events of the log, the next iteration starts from the top */
+    player->timing.position_ms = event->time < gbb_event_log_get_duration(player->log) ? event->time + 1 : 0;
+
+    player->progress.time_us = now;
+    player->progress.iteration = player->iteration;
+    player->progress.position_ms = event->time;
+    player->progress.n_events = player->timing.n_events;
+    player->progress.max_lateness_us = player->timing.max_lateness_us;
+    g_mutex_unlock(&player->timing_lock);
+
+    if (player->progress_interval_us == 0 ||
+        now - player->progress_time < player->progress_interval_us)
+        return FALSE;
+
+    player->progress_time = now;
+    return TRUE;
+}
+
+static void
+report_progress(GbbEvdevPlayer *player)
+{
+    GbbPlaybackProgress progress;
+
+    g_mutex_lock(&player->timing_lock);
+    progress = player->progress;
+    g_mutex_unlock(&player->timing_lock);
+
+    if (progress.n_events == player->progress_reported)
+        return;
+
+    player->progress_reported = progress.n_events;
+    gbb_event_player_progress(GBB_EVENT_PLAYER(player), &progress);
+}
+
+static gboolean
+on_timer(int          fd,
+         GIOCondition condition,
+         gpointer     data)
+{
+    GbbEvdevPlayer *player = data;
+
+    clear_timer(fd);
+
+    /* Stopped after the timer fired, or playing in a thread */
+    if (!player->log || player->thread)
+        return G_SOURCE_CONTINUE;
+
+    if (!player->next_event) {
+        gbb_event_player_stop(GBB_EVENT_PLAYER(player));
+        return G_SOURCE_CONTINUE;
+    }
+
+    if (play_events(player))
+        report_progress(player);
+    player->next_event = NULL;
 
     queue_event(player);
 
-    return FALSE;
+    return G_SOURCE_CONTINUE;
+}
+
+/* Notifications from the playback thread to the main thread */
+typedef struct {
+    GbbEvdevPlayer *player;
+    guint serial;
+    gboolean progress; /* Progress is due; iteration is unused */
+    guint iteration; /* 0 when playback has finished */
+} ThreadNotify;
+
+static gboolean
+on_thread_notify(gpointer data)
+{
+    ThreadNotify *notify = data;
+    GbbEvdevPlayer *player = notify->player;
+
+    /* Ignore anything from a previous play that was stopped */
+    if (notify->serial == player->play_serial) {
+        if (notify->progress)
+            report_progress(player);
+        else if (notify->iteration > 0)
+            gbb_event_player_iteration_finished(GBB_EVENT_PLAYER(player), notify->iteration);
+        else
+            gbb_event_player_stop(GBB_EVENT_PLAYER(player));
+    }
+
+    g_object_unref(player);
+    g_slice_free(ThreadNotify, notify);
+
+    return G_SOURCE_REMOVE;
 }
 
 static void
-queue_event(GbbEvdevPlayer *player)
+thread_notify(GbbEvdevPlayer *player,
+              guint           serial,
+              gboolean        progress,
+              guint           iteration)
 {
-    GError *error = NULL;
+    ThreadNotify *notify = g_slice_new(ThreadNotify);
 
-    g_return_if_fail(player->next_event == NULL);
+    notify->player = g_object_ref(player);
+    notify->serial = serial;
+    notify->progress = progress;
+    notify->iteration = iteration;
 
-    player->next_event = gbb_event_read(player->input,
-                                        NULL, &error);
-    if (error)
-        die("Error reading event log: %s\n", error->message);
-
-    gint64 remaining;
-    if (player->next_event) {
-        gint64 now = g_get_monotonic_time();
-        gint64 next_event_time = player->start_time + 1000 * player->next_event->time;
-        remaining = (next_event_time - now) / 1000;
-    } else {
-        remaining = 0;
+    g_main_context_invoke(NULL, on_thread_notify, notify);
+}
+
+/* Plays events from a thread with realtime priority, so that they go
+ * out on time even when the main loop is busy. The main thread doesn't
+ * touch the playback state until it has joined the thread.
+ */
+static gpointer
+playback_thread(gpointer data)
+{
+    GbbEvdevPlayer *player = data;
+    guint serial = player->play_serial;
+    gboolean stopped = FALSE;
+
+    struct sched_param param = { 0 };
+    param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+    int rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (rc != 0)
+        g_warning("Can't use realtime scheduling for playback: %s", strerror(rc));
+
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (timer_fd < 0)
+        die_errno("Can't create timer");
+
+    while (!stopped) {
+        gboolean iteration_finished;
+        gboolean have_event = advance(player, &iteration_finished);
+
+        if (iteration_finished)
+            thread_notify(player, serial, FALSE, player->iteration);
+        if (!have_event)
+            break;
+
+        arm_timer(timer_fd, player->next_event_time);
+
+        while (TRUE) {
+            struct pollfd fds[2] = {
+                { timer_fd, POLLIN, 0 },
+                { player->stop_fd, POLLIN, 0 }
+            };
+
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR)
+                    continue;
+                die_errno("Can't wait for timer");
+            }
+
+            if (fds[1].revents & POLLIN) {
+                stopped = TRUE;
+            } else if (fds[0].revents & POLLIN) {
+                clear_timer(timer_fd);
+                if (play_events(player))
+                    thread_notify(player, serial, TRUE, 0);
+            } else {
+                continue;
+            }
+
+            break;
+        }
     }
 
-    player->next_event_timeout = g_timeout_add(remaining > 0 ? remaining : 0,
-                                               next_event_timeout,
-                                               player);
+    close(timer_fd);
+
+    if (!stopped)
+        thread_notify(player, serial, FALSE, 0);
+
+    return NULL;
+}
+
+static void
+stop_thread(GbbEvdevPlayer *player)
+{
+    if (!player->thread)
+        return;
+
+    guint64 value = 1;
+    if (write(player->stop_fd, &value, sizeof(value)) < 0)
+        die_errno("Can't stop playback thread");
+
+    g_thread_join(player->thread);
+    player->thread = NULL;
+
+    if (read(player->stop_fd, &value, sizeof(value)) < 0)
+        die_errno("Can't stop playback thread");
 }
 
 static void
@@ -131,10 +564,17 @@ gbb_evdev_player_finalize(GObject *object)
 {
     GbbEvdevPlayer *player = GBB_EVDEV_PLAYER(object);
 
-    libevdev_uinput_destroy(player->uidev_keyboard);
-    libevdev_uinput_destroy(player->uidev_mouse);
+    stop_thread(player);
 
-    g_clear_object(&player->input);
+    if (player->owns_devices)
+        gbb_evdev_devices_free(player->devices);
+
+    g_clear_pointer(&player->log, gbb_event_log_unref);
+
+    g_source_remove(player->timer_source);
+    close(player->timer_fd);
+    close(player->stop_fd);
+    g_mutex_clear(&player->timing_lock);
 
     if (player->ready_timeout) {
         g_source_remove(player->ready_timeout);
@@ -146,44 +586,86 @@ gbb_evdev_player_finalize(GObject *object)
 
 
 static void
-gbb_evdev_player_play_fd(GbbEventPlayer *event_player,
-                         int             fd)
+gbb_evdev_player_play_log(GbbEventPlayer *event_player,
+                          GbbEventLog    *log,
+                          guint           start,
+                          guint           n_iterations,
+                          guint           max_duration)
 {
     GbbEvdevPlayer *player = GBB_EVDEV_PLAYER(event_player);
-    GInputStream *input_raw;
-
-    input_raw = g_unix_input_stream_new (fd, TRUE);
-    player->input = g_data_input_stream_new (input_raw);
-    g_object_unref(input_raw);
 
-    player->start_time = g_get_monotonic_time ();
-    queue_event(player);
+    player->log = gbb_event_log_ref(log);
+    player->start_offset = MIN(start, gbb_event_log_get_duration(log));
+    player->position = gbb_event_log_find_time(log, player->start_offset);
+    player->iteration = 0;
+    player->n_iterations = n_iterations;
+    player->max_duration = max_duration;
+
+    g_mutex_lock(&player->timing_lock);
+    gbb_playback_timing_reset(&player->timing);
+    player->timing.position_ms = player->start_offset;
+    memset(&player->progress, 0, sizeof(player->progress));
+    g_mutex_unlock(&player->timing_lock);
+
+    player->virtual_now = 0;
+    player->start_time = player_now(player);
+
+    player->progress_interval_us = gbb_event_player_get_progress_interval(event_player) * (gint64)1000;
+    player->progress_time = player->start_time;
+    player->progress_reported = 0;
+
+    if (event_player->realtime && !player->virtual_time)
+        player->thread = g_thread_new("playback", playback_thread, player);
+    else
+        queue_event(player);
 }
 
 static void
 gbb_evdev_player_stop(GbbEventPlayer *event_player)
 {
     GbbEvdevPlayer *player = GBB_EVDEV_PLAYER(event_player);
-    GError *error = NULL;
 
-    g_clear_pointer(&player->next_event, gbb_event_free);
+    stop_thread(player);
+    disarm_timer(player->timer_fd);
+    player->play_serial++;
 
-    if (player->next_event_timeout) {
-        g_source_remove(player->next_event_timeout);
-        player->next_event_timeout = 0;
-    }
+    player->next_event = NULL;
 
-    if (!g_input_stream_close(G_INPUT_STREAM(player->input), NULL, &error))
-        die("Error closing input: %s\n", error->message);
+    /* Whatever was played since the last report */
+    if (player->progress_interval_us != 0) {
+        player->progress_interval_us = 0;
+        report_progress(player);
+    }
 
-    g_clear_object(&player->input);
+    g_clear_pointer(&player->log, gbb_event_log_unref);
 
     gbb_event_player_finished(GBB_EVENT_PLAYER(player));
 }
 
+static void
+gbb_evdev_player_get_timing(GbbEventPlayer    *event_player,
+                            GbbPlaybackTiming *timing)
+{
+    GbbEvdevPlayer *player = GBB_EVDEV_PLAYER(event_player);
+
+    g_mutex_lock(&player->timing_lock);
+    *timing = player->timing;
+    g_mutex_unlock(&player->timing_lock);
+}
+
 static void
 gbb_evdev_player_init(GbbEvdevPlayer *player)
 {
+    player->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (player->timer_fd < 0)
+        die_errno("Can't create timer");
+    player->timer_source = g_unix_fd_add(player->timer_fd, G_IO_IN, on_timer, player);
+
+    g_mutex_init(&player->timing_lock);
+
+    player->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (player->stop_fd < 0)
+        die_errno("Can't create eventfd");
 }
 
 static void
@@ -193,20 +675,27 @@ gbb_evdev_player_class_init(GbbEvdevPlayerClass *player_class)
     gobject_class->finalize = gbb_evdev_player_finalize;
 
     GbbEventPlayerClass *event_player_class = GBB_EVENT_PLAYER_CLASS (player_class);
-    event_player_class->play_fd = gbb_evdev_player_play_fd;
+    event_player_class->play_log = gbb_evdev_player_play_log;
     event_player_class->stop = gbb_evdev_player_stop;
+    event_player_class->get_timing = gbb_evdev_player_get_timing;
 }
 
-GbbEvdevPlayer *
-gbb_evdev_player_new(const char *name)
+/**
+ * gbb_evdev_devices_new:
+ * @name: prefix for the names of the devices
+ *
+ * Creates a simulated keyboard and mouse. It takes a while for the
+ * X server to pick up new devices, so the helper keeps them to hand
+ * from one player to the next.
+ */
+GbbEvdevDevices *
+gbb_evdev_devices_new(const char *name)
 {
-    GbbEvdevPlayer *player;
+    GbbEvdevDevices *devices = g_slice_new0(GbbEvdevDevices);
     int rc;
     struct libevdev *dev;
     int i;
 
-    player = g_object_new(GBB_TYPE_EVDEV_PLAYER, NULL);
-
     struct input_absinfo absinfo;
     absinfo.value = 0;
     absinfo.minimum = 0;
@@ -222,10 +711,9 @@ gbb_evdev_player_new(const char *name)
     for (i = 1; i <= 255 - 8; i++)
         libevdev_enable_event_code(dev, EV_KEY, i, NULL);
     libevdev_enable_event_type(dev, EV_KEY);
-    open("/about to create", O_RDONLY);
     rc = libevdev_uinput_create_from_device(dev,
                                             LIBEVDEV_UINPUT_OPEN_MANAGED,
-                                            &player->uidev_keyboard);
+                                            &devices->keyboard);
     if (rc != 0) {
         if (rc == -EBADF)
             die("Need to be root to simulate events");
@@ -252,14 +740,136 @@ gbb_evdev_player_new(const char *name)
 
     rc = libevdev_uinput_create_from_device(dev,
                                             LIBEVDEV_UINPUT_OPEN_MANAGED,
-                                            &player->uidev_mouse);
+                                            &devices->mouse);
     if (rc != 0)
         die("Can't create uinput: %s\n", strerror(-rc));
     libevdev_free(dev);
 
+    devices->keyboard_fd = libevdev_uinput_get_fd(devices->keyboard);
+    devices->mouse_fd = libevdev_uinput_get_fd(devices->mouse);
+
+    return devices;
+}
+
+/**
+ * gbb_evdev_devices_new_for_fds:
+ * @keyboard_fd: where to write keyboard events
+ * @mouse_fd: where to write mouse events
+ *
+ * Creates devices that write the same input events as simulated
+ * devices would, but to plain file descriptors, such as a pipe or
+ * /dev/null. This doesn't need any privileges, so the playback path
+ * can be measured on its own. The descriptors must be kept open until
+ * the devices are freed, and are not closed by them.
+ */
+GbbEvdevDevices *
+gbb_evdev_devices_new_for_fds(int keyboard_fd,
+                              int mouse_fd)
+{
+    GbbEvdevDevices *devices = g_slice_new0(GbbEvdevDevices);
+    devices->keyboard_fd = keyboard_fd;
+    devices->mouse_fd = mouse_fd;
+
+    return devices;
+}
+
+static void
+release_keys(struct libevdev_uinput *uidev,
+             const int              *codes,
+             guint                   n_codes)
+{
+    guint i;
+
+    for (i = 0; i < n_codes; i++)
+        libevdev_uinput_write_event(uidev, EV_KEY, codes[i], 0);
+    libevdev_uinput_write_event(uidev, EV_SYN, SYN_REPORT, 0);
+}
+
+/**
+ * gbb_evdev_devices_reset:
+ * @devices: a #GbbEvdevDevices
+ *
+ * Releases any keys and buttons that a player left pressed, so that
+ * the next player starts from a clean state. The kernel drops releases
+ * for keys that aren't down, so nothing else sees them.
+ */
+void
+gbb_evdev_devices_reset(GbbEvdevDevices *devices)
+{
+    static const int buttons[] = { BTN_LEFT, BTN_MIDDLE, BTN_RIGHT };
+    int keys[255 - 8];
+    guint i;
+
+    if (!devices->keyboard)
+        return;
+
+    for (i = 0; i < G_N_ELEMENTS(keys); i++)
+        keys[i] = i + 1;
+
+    release_keys(devices->keyboard, keys, G_N_ELEMENTS(keys));
+    release_keys(devices->mouse, buttons, G_N_ELEMENTS(buttons));
+}
+
+void
+gbb_evdev_devices_free(GbbEvdevDevices *devices)
+{
+    if (devices->keyboard) {
+        libevdev_uinput_destroy(devices->keyboard);
+        libevdev_uinput_destroy(devices->mouse);
+    }
+    g_slice_free(GbbEvdevDevices, devices);
+}
+
+/**
+ * gbb_evdev_player_new_for_devices:
+ * @devices: the devices to play events on. They must outlive the
+ *   player, and should be reset after it is done with them.
+ *
+ * Creates a player that is ready straight away, without creating
+ * devices of its own.
+ */
+GbbEvdevPlayer *
+gbb_evdev_player_new_for_devices(GbbEvdevDevices *devices)
+{
+    GbbEvdevPlayer *player = g_object_new(GBB_TYPE_EVDEV_PLAYER, NULL);
+
+    player->devices = devices;
+    player->keyboard_frame.fd = devices->keyboard_fd;
+    player->mouse_frame.fd = devices->mouse_fd;
+
     gbb_event_player_set_ready (GBB_EVENT_PLAYER(player),
-                                libevdev_uinput_get_devnode(player->uidev_keyboard),
-                                libevdev_uinput_get_devnode(player->uidev_mouse));
+                                devices->keyboard ? libevdev_uinput_get_devnode(devices->keyboard) : NULL,
+                                devices->mouse ? libevdev_uinput_get_devnode(devices->mouse) : NULL);
+
+    return player;
+}
+
+/**
+ * gbb_evdev_player_set_virtual_time:
+ * @player: a #GbbEvdevPlayer
+ * @virtual_time: whether to play on a virtual clock
+ *
+ * With a virtual clock, each event is played as soon as the previous
+ * one is done, and the clock jumps forward to its scheduled time, so
+ * a log plays the same way however long it takes. This is for
+ * measuring the cost of playback itself; realtime playback is ignored.
+ * Takes effect from the next play.
+ */
+void
+gbb_evdev_player_set_virtual_time(GbbEvdevPlayer *player,
+                                  gboolean        virtual_time)
+{
+    player->virtual_time = virtual_time != FALSE;
+}
+
+GbbEvdevPlayer *
+gbb_evdev_player_new(const char *name)
+{
+    /* Creating the devices is part of starting up */
+    gint64 create_time = g_get_monotonic_time();
+    GbbEvdevPlayer *player = gbb_evdev_player_new_for_devices(gbb_evdev_devices_new(name));
+    player->owns_devices = TRUE;
+    GBB_EVENT_PLAYER(player)->create_time = create_time;
 
     return player;
 }
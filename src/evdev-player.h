@@ -5,6 +5,9 @@
 
 typedef struct _GbbEvdevPlayer GbbEvdevPlayer;
 
+/* A simulated keyboard and mouse */
+typedef struct _GbbEvdevDevices GbbEvdevDevices;
+
 #define GBB_TYPE_EVDEV_PLAYER         (gbb_evdev_player_get_type ())
 #define GBB_EVDEV_PLAYER(o)           (G_TYPE_CHECK_INSTANCE_CAST ((o), GBB_TYPE_EVDEV_PLAYER, GbbEvdevPlayer))
 #define GBB_EVDEV_PLAYER_CLASS(k)     (G_TYPE_CHECK_CLASS_CAST((k), GBB_TYPE_EVDEV_PLAYER, GbbEvdevPlayerClass))
@@ -12,7 +15,17 @@ typedef struct _GbbEvdevPlayer GbbEvdevPlayer;
 #define GBB_IS_EVDEV_PLAYER_CLASS(k)  (G_TYPE_CHECK_CLASS_TYPE ((k), GBB_TYPE_EVDEV_PLAYER))
 #define GBB_EVDEV_PLAYER_GET_CLASS(o) (G_TYPE_INSTANCE_GET_CLASS ((o), GBB_TYPE_EVDEV_PLAYER, GbbEvdevPlayerClass))
 
-GbbEvdevPlayer *gbb_evdev_player_new(const char *name);
+GbbEvdevDevices *gbb_evdev_devices_new   (const char      *name);
+GbbEvdevDevices *gbb_evdev_devices_new_for_fds (int keyboard_fd,
+                                                int mouse_fd);
+void             gbb_evdev_devices_reset (GbbEvdevDevices *devices);
+void             gbb_evdev_devices_free  (GbbEvdevDevices *devices);
+
+GbbEvdevPlayer *gbb_evdev_player_new            (const char      *name);
+GbbEvdevPlayer *gbb_evdev_player_new_for_devices(GbbEvdevDevices *devices);
+
+void gbb_evdev_player_set_virtual_time(GbbEvdevPlayer *player,
+                                       gboolean        virtual_time);
 
 GType gbb_evdev_player_get_type(void);
 
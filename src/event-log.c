@@ -1,109 +1,1182 @@
 /* -*- mode: C; c-file-style: "stroustrup"; indent-tabs-mode: nil; -*- */
 
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gio/gunixoutputstream.h>
+#include <libevdev/libevdev.h>
+
 #include "event-log.h"
 
+/* Binary event logs are a header, a table of event type names, and
+ * then fixed size records referring to the types by index. All
+ * values are little-endian. A log can be mapped and walked without
+ * parsing or allocation.
+ */
+#define BINARY_MAGIC "GBBEVLOG"
+#define BINARY_VERSION 1
+#define BINARY_TYPE_NAME_SIZE 32
+
+typedef struct {
+    char magic[8];
+    guint32 version;
+    guint32 n_types;
+    guint32 n_events;
+    guint32 reserved;
+} BinaryHeader;
+
+typedef struct {
+    char name[BINARY_TYPE_NAME_SIZE]; /* nul-padded */
+} BinaryType;
+
+typedef struct {
+    guint32 time;
+    guint32 type;
+    gint32 x_root;
+    gint32 y_root;
+    gint32 detail;
+} BinaryRecord;
+
+struct _GbbEventLogMap {
+    void *data;
+    gsize size;
+    GbbEventType *types;
+    const BinaryRecord *records;
+    guint n_events;
+};
+
+struct _GbbEventLogReader {
+    /* Binary logs */
+    GbbEventLogMap *map;
+    guint position;
+
+    /* Text logs are read into memory in one go, then parsed in place */
+    char *text;
+    gsize text_len;
+    gsize text_pos;
+    int line_number;
+};
+
+#define INDEX_INTERVAL 1000 /* ms */
+
+struct _GbbEventLog {
+    int ref_count;
+
+    GbbEvent *events;
+    guint n_events;
+    guint n_events_by_type[GBB_EVENT_N_TYPES];
+    guint duration;
+
+    /* index[i] is the first event played at or after i * INDEX_INTERVAL ms */
+    guint *index;
+    guint n_index;
+
+    /* Sealed memfd, or without memfds an unlinked temporary file,
+     * holding the log in binary format */
+    int binary_fd;
+};
+
+static const char * const event_type_names[GBB_EVENT_N_TYPES] = {
+    "KeyPress",
+    "KeyRelease",
+    "ButtonPress",
+    "ButtonRelease",
+    "Wheel",
+    "MotionNotify"
+};
+
+const char *
+gbb_event_type_get_name (GbbEventType type)
+{
+    g_return_val_if_fail(type < GBB_EVENT_N_TYPES, NULL);
+
+    return event_type_names[type];
+}
+
+/* @name need not be nul-terminated */
+gboolean
+gbb_event_type_from_name (const char   *name,
+                          gsize         len,
+                          GbbEventType *type)
+{
+    guint i;
+
+    for (i = 0; i < GBB_EVENT_N_TYPES; i++) {
+        if (strlen(event_type_names[i]) == len && memcmp(name, event_type_names[i], len) == 0) {
+            *type = i;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static gboolean
+is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+/* Parses an integer field up to the next ',' or @end, without copying */
+static gboolean
+parse_field(const char **pos,
+            const char  *end,
+            gint64       min,
+            gint64       max,
+            gint64      *value)
+{
+    const char *p = *pos;
+    gboolean negative = FALSE;
+    gint64 v = 0;
+
+    while (p < end && is_blank(*p))
+        p++;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+
+    const char *digits = p;
+    while (p < end && *p >= '0' && *p <= '9') {
+        v = 10 * v + (*p - '0');
+        if (v > G_MAXUINT32)
+            return FALSE;
+        p++;
+    }
+    if (p == digits)
+        return FALSE;
+
+    while (p < end && is_blank(*p))
+        p++;
+    if (p < end && *p != ',')
+        return FALSE;
+
+    if (negative)
+        v = -v;
+    if (v < min || v > max)
+        return FALSE;
+
+    *value = v;
+    *pos = p < end ? p + 1 : p;
+
+    return TRUE;
+}
+
+/* Parses a line 'NAME,TIME,X,Y,DETAIL # comment' into @event. Blank and
+ * comment-only lines are fine, but set @have_event to %FALSE.
+ */
+static gboolean
+parse_text_event(const char *line,
+                 const char *end,
+                 GbbEvent   *event,
+                 gboolean   *have_event,
+                 GError    **error)
+{
+    const char *p;
+    int n_commas = 0;
+    gint64 time, x_root, y_root, detail;
+
+    *have_event = FALSE;
+
+    const char *hash = memchr(line, '#', end - line);
+    if (hash)
+        end = hash;
+    while (line < end && g_ascii_isspace(*line))
+        line++;
+    while (end > line && g_ascii_isspace(end[-1]))
+        end--;
+
+    if (line == end)
+        return TRUE;
+
+    for (p = line; p < end; p++)
+        if (*p == ',')
+            n_commas++;
+
+    if (n_commas != 4) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                    "Bad field count in '%.*s'", (int)(end - line), line);
+        return FALSE;
+    }
+
+    const char *name_end = memchr(line, ',', end - line);
+    if (!gbb_event_type_from_name(line, name_end - line, &event->type)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                    "Unknown event type '%.*s'", (int)(name_end - line), line);
+        return FALSE;
+    }
+
+    p = name_end + 1;
+    if (!parse_field(&p, end, 0, G_MAXUINT32, &time) ||
+        !parse_field(&p, end, G_MININT32, G_MAXINT32, &x_root) ||
+        !parse_field(&p, end, G_MININT32, G_MAXINT32, &y_root) ||
+        !parse_field(&p, end, G_MININT32, G_MAXINT32, &detail)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                    "Bad value in '%.*s'", (int)(end - line), line);
+        return FALSE;
+    }
+
+    event->time = time;
+    event->x_root = x_root;
+    event->y_root = y_root;
+    event->detail = detail;
+    *have_event = TRUE;
+
+    return TRUE;
+}
+
+/* Writes @event as a line of a text log, in the same format as
+ * 'gbb record'.
+ */
+gboolean
+gbb_event_write (GOutputStream  *output_stream,
+                 const GbbEvent *event,
+                 GCancellable   *cancellable,
+                 GError        **error)
+{
+    const char *comment = NULL;
+    if (event->type == GBB_EVENT_KEY_PRESS || event->type == GBB_EVENT_KEY_RELEASE)
+        comment = libevdev_event_code_get_name(EV_KEY, event->detail);
+
+    char *line = g_strdup_printf("%s,%u,%d,%d,%d%s%s\n",
+                                 gbb_event_type_get_name(event->type),
+                                 event->time,
+                                 event->x_root,
+                                 event->y_root,
+                                 event->detail,
+                                 comment ? " # " : "",
+                                 comment ? comment : "");
+    gboolean result = g_output_stream_write_all(output_stream, line, strlen(line), NULL,
+                                                cancellable, error);
+    g_free(line);
+
+    return result;
+}
+
+GbbEventLogFormat
+gbb_event_log_get_format (int fd)
+{
+    char magic[sizeof(BINARY_MAGIC) - 1];
+
+    if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+        memcmp(magic, BINARY_MAGIC, sizeof(magic)) == 0)
+        return GBB_EVENT_LOG_FORMAT_BINARY;
+    else
+        return GBB_EVENT_LOG_FORMAT_TEXT;
+}
+
+/**
+ * gbb_event_log_map_new:
+ * @fd: file descriptor of a binary event log. It isn't needed after
+ *   this returns, and can be closed by the caller.
+ * @error: location to store error
+ *
+ * Maps a binary event log into memory, checking that it is well-formed,
+ * so that the events can then be accessed without further checks.
+ *
+ * Return value: the mapped log, or %NULL if it couldn't be mapped
+ *   or isn't a valid binary log.
+ */
+GbbEventLogMap *
+gbb_event_log_map_new (int      fd,
+                       GError **error)
+{
+    struct stat st;
+    guint i;
+
+    if (fstat(fd, &st) != 0) {
+        int errsv = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+                    "Can't stat event log: %s", g_strerror(errsv));
+        return NULL;
+    }
+
+    if (st.st_size < (goffset)sizeof(BinaryHeader)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "Event log is too short");
+        return NULL;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        int errsv = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+                    "Can't map event log: %s", g_strerror(errsv));
+        return NULL;
+    }
+
+    const BinaryHeader *header = data;
+    guint32 n_types = GUINT32_FROM_LE(header->n_types);
+    guint32 n_events = GUINT32_FROM_LE(header->n_events);
+
+    if (memcmp(header->magic, BINARY_MAGIC, sizeof(header->magic)) != 0 ||
+        GUINT32_FROM_LE(header->version) != BINARY_VERSION) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "Not a binary event log, or unknown version");
+        goto fail;
+    }
+
+    /* Computed in 64 bits, so that huge counts can't wrap around */
+    if (sizeof(BinaryHeader) + (guint64)n_types * sizeof(BinaryType) +
+        (guint64)n_events * sizeof(BinaryRecord) != (guint64)st.st_size) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "Size of binary event log doesn't match its header");
+        goto fail;
+    }
+
+    const BinaryType *types = (const BinaryType *)(header + 1);
+    const BinaryRecord *records = (const BinaryRecord *)(types + n_types);
+    GbbEventType *event_types = g_new(GbbEventType, n_types);
+
+    for (i = 0; i < n_types; i++) {
+        const char *name_end = memchr(types[i].name, '\0', BINARY_TYPE_NAME_SIZE);
+        if (name_end == NULL ||
+            !gbb_event_type_from_name(types[i].name, name_end - types[i].name, &event_types[i])) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                        "Bad event type in binary event log");
+            g_free(event_types);
+            goto fail;
+        }
+    }
+
+    for (i = 0; i < n_events; i++) {
+        if (GUINT32_FROM_LE(records[i].type) >= n_types) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                        "Bad event type in binary event log");
+            g_free(event_types);
+            goto fail;
+        }
+    }
+
+    GbbEventLogMap *map = g_slice_new(GbbEventLogMap);
+    map->data = data;
+    map->size = st.st_size;
+    map->records = records;
+    map->n_events = n_events;
+    map->types = event_types;
+
+    return map;
+
+fail:
+    munmap(data, st.st_size);
+    return NULL;
+}
+
+guint
+gbb_event_log_map_get_n_events (GbbEventLogMap *map)
+{
+    return map->n_events;
+}
+
+/* Fills in @event, which is owned by the caller */
 void
-gbb_event_free(GbbEvent *event)
+gbb_event_log_map_get_event (GbbEventLogMap *map,
+                             guint           index,
+                             GbbEvent       *event)
 {
-    g_free(event->name);
-    g_slice_free(GbbEvent, event);
+    const BinaryRecord *record;
+
+    g_return_if_fail(index < map->n_events);
+
+    record = &map->records[index];
+    event->type = map->types[GUINT32_FROM_LE(record->type)];
+    event->time = GUINT32_FROM_LE(record->time);
+    event->x_root = GINT32_FROM_LE(record->x_root);
+    event->y_root = GINT32_FROM_LE(record->y_root);
+    event->detail = GINT32_FROM_LE(record->detail);
 }
 
-GbbEvent *
-gbb_event_read (GDataInputStream *input_stream,
-                GCancellable     *cancellable,
-                GError          **error)
+void
+gbb_event_log_map_free (GbbEventLogMap *map)
 {
-    GbbEvent *event = NULL;
-    gboolean have_error = FALSE;
+    munmap(map->data, map->size);
+    g_free(map->types);
+    g_slice_free(GbbEventLogMap, map);
+}
+
+static gboolean
+read_fd_contents(int      fd,
+                 char   **contents,
+                 gsize   *length,
+                 GError **error)
+{
+    struct stat st;
+    gsize size = 0;
+    gsize allocated = 4096;
 
-    while (event == NULL && !have_error) {
-        GError *local_error = NULL;
-        char **fields = NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        allocated = st.st_size + 1;
 
-        char *line = g_data_input_stream_read_line (input_stream, NULL, NULL, &local_error);
-        if (local_error) {
-            g_propagate_error(error, local_error);
-            have_error = TRUE;
-            goto next;
+    char *buffer = g_malloc(allocated);
+    while (TRUE) {
+        if (size == allocated) {
+            allocated *= 2;
+            buffer = g_realloc(buffer, allocated);
         }
 
-        if (!line)
-            return NULL;
-
-        char *hash = index(line, '#');
-        if (hash)
-            *hash = '\0';
-        g_strstrip(line);
-
-        fields = g_strsplit (line, ",", -1);
-
-        if (!*line)
-            goto next;
-        if (g_strv_length (fields) != 5) {
-            g_set_error(error,
-                        G_IO_ERROR,
-                        G_IO_ERROR_FAILED,
-                        "Bad field count in '%s'", line);
-            have_error = TRUE;
-            goto next;
+        ssize_t count = read(fd, buffer + size, allocated - size);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+
+            int errsv = errno;
+            g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+                        "Error reading event log: %s", g_strerror(errsv));
+            g_free(buffer);
+            return FALSE;
+        } else if (count == 0) {
+            break;
         }
 
-        event = g_slice_new(GbbEvent);
+        size += count;
+    }
 
-        event->name = g_strdup(fields[0]);
-        sscanf(fields[1], "%u", &event->time);
-        event->x_root = atoi(fields[2]);
-        event->y_root = atoi(fields[3]);
-        event->detail = atoi(fields[4]);
+    *contents = buffer;
+    *length = size;
+
+    return TRUE;
+}
 
-    next:
-        if (fields)
-            g_strfreev(fields);
-        g_free(line);
+/**
+ * gbb_event_log_reader_new:
+ * @fd: file descriptor of an event log in either format; the reader
+ *   takes ownership of it
+ * @error: location to store error
+ *
+ * Creates a reader for an event log. Events are then read without
+ * allocating: binary logs are mapped, and text logs are read into
+ * memory once and parsed in place.
+ *
+ * Return value: the new reader, or %NULL if the log couldn't be read
+ */
+GbbEventLogReader *
+gbb_event_log_reader_new (int      fd,
+                          GError **error)
+{
+    GbbEventLogReader *reader = g_slice_new0(GbbEventLogReader);
+    gboolean success;
+
+    if (gbb_event_log_get_format(fd) == GBB_EVENT_LOG_FORMAT_BINARY) {
+        reader->map = gbb_event_log_map_new(fd, error);
+        success = reader->map != NULL;
+    } else {
+        success = read_fd_contents(fd, &reader->text, &reader->text_len, error);
     }
 
-    if (have_error) {
-        if (event)
-            gbb_event_free(event);
+    close(fd);
+
+    if (!success) {
+        g_slice_free(GbbEventLogReader, reader);
         return NULL;
-    } else {
-        return event;
     }
+
+    return reader;
 }
 
-int
-gbb_event_log_duration (GFile        *event_log,
-                        GCancellable *cancellable,
-                        GError      **error)
+/**
+ * gbb_event_log_reader_next:
+ * @reader: a #GbbEventLogReader
+ * @event: location to store the next event
+ * @error: location to store error
+ *
+ * Return value: %TRUE if an event was read; %FALSE at the end of the
+ *   log, or if there was an error, in which case @error is set.
+ */
+gboolean
+gbb_event_log_reader_next (GbbEventLogReader *reader,
+                           GbbEvent          *event,
+                           GError           **error)
 {
-    GFileInputStream *input_raw = g_file_read(event_log, cancellable, error);
-    GDataInputStream *input = g_data_input_stream_new (G_INPUT_STREAM (input_raw));
-    g_object_unref(input_raw);
-    int duration = 0;
+    if (reader->map) {
+        if (reader->position >= reader->map->n_events)
+            return FALSE;
 
-    while (TRUE) {
-        GError *local_error = NULL;
-        GbbEvent *event = gbb_event_read(input, cancellable, &local_error);
-        if (local_error) {
-            g_propagate_error(error, local_error);
-            duration = -1;
+        gbb_event_log_map_get_event(reader->map, reader->position++, event);
+        return TRUE;
+    }
+
+    const char *text_end = reader->text + reader->text_len;
+    while (reader->text_pos < reader->text_len) {
+        const char *line = reader->text + reader->text_pos;
+        const char *line_end = memchr(line, '\n', text_end - line);
+        if (!line_end)
+            line_end = text_end;
+
+        reader->text_pos = MIN(reader->text_len, (gsize)(line_end - reader->text) + 1);
+        reader->line_number++;
+
+        gboolean have_event;
+        if (!parse_text_event(line, line_end, event, &have_event, error)) {
+            g_prefix_error(error, "Line %d: ", reader->line_number);
+            return FALSE;
         }
 
-        if (!event)
+        if (have_event)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+void
+gbb_event_log_reader_free (GbbEventLogReader *reader)
+{
+    if (reader->map)
+        gbb_event_log_map_free(reader->map);
+    g_free(reader->text);
+    g_slice_free(GbbEventLogReader, reader);
+}
+
+static GbbEventLogReader *
+open_event_log (const char *filename,
+                GError    **error)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        int errsv = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+                    "Can't open '%s': %s", filename, g_strerror(errsv));
+        return NULL;
+    }
+
+    return gbb_event_log_reader_new(fd, error);
+}
+
+/* Takes ownership of @events */
+static GbbEventLog *
+event_log_new_from_array (GArray *events)
+{
+    GbbEventLog *log = g_slice_new0(GbbEventLog);
+    log->ref_count = 1;
+    log->n_events = events->len;
+    log->events = (GbbEvent *)g_array_free(events, FALSE);
+    log->binary_fd = -1;
+
+    guint i;
+    for (i = 0; i < log->n_events; i++) {
+        log->n_events_by_type[log->events[i].type]++;
+        log->duration = MAX(log->duration, log->events[i].time);
+    }
+
+    /* An event that is logged out of order is played as soon as it
+     * comes up, so playback time is the running maximum of the event
+     * times, and never goes backwards */
+    log->n_index = log->n_events > 0 ? log->duration / INDEX_INTERVAL + 1 : 0;
+    log->index = g_new(guint, log->n_index);
+
+    guint played_time = 0;
+    guint n_index = 0;
+    for (i = 0; i < log->n_events; i++) {
+        played_time = MAX(played_time, log->events[i].time);
+        while (n_index < log->n_index && played_time >= n_index * INDEX_INTERVAL)
+            log->index[n_index++] = i;
+    }
+
+    return log;
+}
+
+static GbbEventLog *
+event_log_new_from_reader (GbbEventLogReader *reader,
+                           GError           **error)
+{
+    guint reserved = reader->map ? reader->map->n_events : 0;
+    GArray *events = g_array_sized_new(FALSE, FALSE, sizeof(GbbEvent), reserved);
+    GError *local_error = NULL;
+    GbbEvent event;
+
+    while (gbb_event_log_reader_next(reader, &event, &local_error))
+        g_array_append_val(events, event);
+
+    gbb_event_log_reader_free(reader);
+
+    if (local_error) {
+        g_propagate_error(error, local_error);
+        g_array_free(events, TRUE);
+        return NULL;
+    }
+
+    return event_log_new_from_array(events);
+}
+
+/**
+ * gbb_event_log_new_from_fd:
+ * @fd: file descriptor of an event log in either format; the log takes
+ *   ownership of it
+ * @error: location to store error
+ *
+ * Reads all the events of a log into memory, so that it can be played
+ * any number of times without further reading or parsing.
+ *
+ * Return value: the new log, free with gbb_event_log_unref(), or %NULL
+ *   if the log couldn't be read
+ */
+GbbEventLog *
+gbb_event_log_new_from_fd (int      fd,
+                           GError **error)
+{
+    GbbEventLogReader *reader = gbb_event_log_reader_new(fd, error);
+    if (!reader)
+        return NULL;
+
+    return event_log_new_from_reader(reader, error);
+}
+
+GbbEventLog *
+gbb_event_log_new_from_file (const char *filename,
+                             GError    **error)
+{
+    GbbEventLogReader *reader = open_event_log(filename, error);
+    if (!reader)
+        return NULL;
+
+    return event_log_new_from_reader(reader, error);
+}
+
+#ifdef HAVE_MEMFD_CREATE
+/* What the sender of a log can't undo, for it to be checked only once */
+#define REQUIRED_SEALS (F_SEAL_SHRINK | F_SEAL_WRITE)
+#else
+/* Copies a log that the sender could still change to a file that only
+ * we can write. Takes ownership of @fd. */
+static int
+copy_to_private_file (int      fd,
+                      GError **error)
+{
+    char *contents;
+    gsize length;
+
+    /* The file offset is shared with the sender */
+    if (lseek(fd, 0, SEEK_SET) != 0) {
+        int errsv = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+                    "Can't seek event log: %s", g_strerror(errsv));
+        close(fd);
+        return -1;
+    }
+
+    gboolean result = read_fd_contents(fd, &contents, &length, error);
+    close(fd);
+    if (!result)
+        return -1;
+
+    char *path;
+    int copy_fd = g_file_open_tmp("gbb-event-log-XXXXXX", &path, error);
+    if (copy_fd != -1) {
+        unlink(path);
+        g_free(path);
+
+        GOutputStream *output = g_unix_output_stream_new(copy_fd, FALSE);
+        result = g_output_stream_write_all(output, contents, length, NULL, NULL, error);
+        g_object_unref(output);
+
+        if (!result) {
+            close(copy_fd);
+            copy_fd = -1;
+        }
+    }
+
+    g_free(contents);
+
+    return copy_fd;
+}
+#endif
+
+/**
+ * gbb_event_log_new_from_sealed_fd:
+ * @fd: memfd holding a binary event log, sealed against writing and
+ *   shrinking, as from gbb_event_log_get_binary_fd(); the log takes
+ *   ownership of it
+ * @error: location to store error
+ *
+ * Like gbb_event_log_new_from_fd(), but for a log passed by a less
+ * trusted process. Text logs are refused, so nothing is parsed, and
+ * since the sender can't change the contents once they are sealed,
+ * the events that are checked are the events that are read. When
+ * built without memfds, @fd is instead an ordinary file, and it is
+ * copied before it is checked, for the same reason.
+ *
+ * Return value: the new log, free with gbb_event_log_unref(), or %NULL
+ *   if @fd isn't a sealed binary log
+ */
+GbbEventLog *
+gbb_event_log_new_from_sealed_fd (int      fd,
+                                  GError **error)
+{
+#ifdef HAVE_MEMFD_CREATE
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals == -1 || (seals & REQUIRED_SEALS) != REQUIRED_SEALS) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                    "Event log must be passed as a sealed memfd");
+        close(fd);
+        return NULL;
+    }
+#else
+    fd = copy_to_private_file(fd, error);
+    if (fd == -1)
+        return NULL;
+#endif
+
+    if (gbb_event_log_get_format(fd) != GBB_EVENT_LOG_FORMAT_BINARY) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "Event log must be in binary format");
+        close(fd);
+        return NULL;
+    }
+
+    return gbb_event_log_new_from_fd(fd, error);
+}
+
+GbbEventLog *
+gbb_event_log_ref (GbbEventLog *log)
+{
+    log->ref_count++;
+
+    return log;
+}
+
+void
+gbb_event_log_unref (GbbEventLog *log)
+{
+    if (--log->ref_count > 0)
+        return;
+
+    if (log->binary_fd != -1)
+        close(log->binary_fd);
+    g_free(log->index);
+    g_free(log->events);
+    g_slice_free(GbbEventLog, log);
+}
+
+/* The events are in the order they were logged, and owned by @log */
+const GbbEvent *
+gbb_event_log_get_events (GbbEventLog *log,
+                          guint       *n_events)
+{
+    if (n_events)
+        *n_events = log->n_events;
+
+    return log->events;
+}
+
+guint
+gbb_event_log_get_n_events (GbbEventLog *log)
+{
+    return log->n_events;
+}
+
+guint
+gbb_event_log_get_n_events_of_type (GbbEventLog  *log,
+                                    GbbEventType  type)
+{
+    g_return_val_if_fail(type < GBB_EVENT_N_TYPES, 0);
+
+    return log->n_events_by_type[type];
+}
+
+/* Time of the last event, in milliseconds */
+guint
+gbb_event_log_get_duration (GbbEventLog *log)
+{
+    return log->duration;
+}
+
+/**
+ * gbb_event_log_find_time:
+ * @log: a #GbbEventLog
+ * @time: time offset into the log, in milliseconds
+ *
+ * Finds where to start playing @log to pick up at @time. Since the
+ * events of binary logs are fixed-size records, this is also the
+ * record to seek to in the file.
+ *
+ * Return value: the index of the first event played at or after @time,
+ *   or the number of events if @time is past the end of the log
+ */
+guint
+gbb_event_log_find_time (GbbEventLog *log,
+                         guint        time)
+{
+    guint slot = time / INDEX_INTERVAL;
+    if (slot >= log->n_index)
+        return log->n_events;
+
+    /* The indexed event is the one that took playback time into this
+     * slot, so it is also the running maximum up to that point */
+    guint i = log->index[slot];
+    guint played_time = log->events[i].time;
+    while (played_time < time) {
+        if (++i == log->n_events)
             break;
+        played_time = MAX(played_time, log->events[i].time);
+    }
+
+    return i;
+}
 
-        duration = MAX(duration, event->time);
+/**
+ * gbb_event_log_new_range:
+ * @log: a #GbbEventLog
+ * @start: time offset to start at, in milliseconds
+ * @end: time offset to end at, in milliseconds, or %G_MAXUINT for the
+ *   end of the log
+ *
+ * Creates a log holding the events of @log that are played from @start
+ * up to, but not including, @end, with their times moved so that
+ * @start is at zero.
+ *
+ * Return value: the new log, free with gbb_event_log_unref()
+ */
+GbbEventLog *
+gbb_event_log_new_range (GbbEventLog *log,
+                         guint        start,
+                         guint        end)
+{
+    guint first = gbb_event_log_find_time(log, start);
+    guint last = end > start ? gbb_event_log_find_time(log, end) : first;
+    GArray *events = g_array_sized_new(FALSE, FALSE, sizeof(GbbEvent), last - first);
+    guint i;
 
-        gbb_event_free(event);
+    for (i = first; i < last; i++) {
+        GbbEvent event = log->events[i];
+        event.time = event.time > start ? event.time - start : 0;
+        g_array_append_val(events, event);
     }
 
-    g_input_stream_close(G_INPUT_STREAM(input), cancellable,
-                         !(error && *error) ? error : NULL);
-    g_object_unref(input);
+    return event_log_new_from_array(events);
+}
+
+static gboolean
+write_binary(GOutputStream  *output,
+             const GbbEvent *events,
+             guint           n_events,
+             GError        **error)
+{
+    int type_indices[GBB_EVENT_N_TYPES];
+    BinaryType types[GBB_EVENT_N_TYPES];
+    BinaryRecord *records = g_new(BinaryRecord, n_events);
+    guint n_types = 0;
+    guint i;
+
+    /* Only the types that are used go in the table, in order of first use */
+    for (i = 0; i < GBB_EVENT_N_TYPES; i++)
+        type_indices[i] = -1;
+
+    for (i = 0; i < n_events; i++) {
+        const GbbEvent *event = &events[i];
+
+        if (type_indices[event->type] < 0) {
+            memset(&types[n_types], 0, sizeof(BinaryType));
+            strcpy(types[n_types].name, gbb_event_type_get_name(event->type));
+            type_indices[event->type] = n_types++;
+        }
+
+        records[i].time = GUINT32_TO_LE(event->time);
+        records[i].type = GUINT32_TO_LE(type_indices[event->type]);
+        records[i].x_root = GINT32_TO_LE(event->x_root);
+        records[i].y_root = GINT32_TO_LE(event->y_root);
+        records[i].detail = GINT32_TO_LE(event->detail);
+    }
+
+    BinaryHeader header = { { 0 } };
+    memcpy(header.magic, BINARY_MAGIC, sizeof(header.magic));
+    header.version = GUINT32_TO_LE(BINARY_VERSION);
+    header.n_types = GUINT32_TO_LE(n_types);
+    header.n_events = GUINT32_TO_LE(n_events);
+
+    gboolean result = (g_output_stream_write_all(output, &header, sizeof(header), NULL, NULL, error) &&
+                       g_output_stream_write_all(output, types, n_types * sizeof(BinaryType),
+                                                 NULL, NULL, error) &&
+                       g_output_stream_write_all(output, records, n_events * sizeof(BinaryRecord),
+                                                 NULL, NULL, error));
+
+    g_free(records);
+
+    return result;
+}
+
+/**
+ * gbb_event_log_get_binary_fd:
+ * @log: a #GbbEventLog
+ * @error: location to store error
+ *
+ * Gets a file descriptor for the log in binary format, to pass to
+ * another process. The binary log is written to a memfd the first
+ * time this is called, and sealed so that it can't be changed
+ * afterwards; later calls just duplicate the descriptor. When built
+ * without memfds, an unlinked temporary file is used instead. Readers
+ * must not depend on the file offset, since it is shared.
+ *
+ * Return value: a new file descriptor, owned by the caller, or -1 on error
+ */
+int
+gbb_event_log_get_binary_fd (GbbEventLog *log,
+                             GError     **error)
+{
+    if (log->binary_fd == -1) {
+#ifdef HAVE_MEMFD_CREATE
+        int fd = memfd_create("gbb-event-log", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (fd == -1) {
+            int errsv = errno;
+            g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+                        "Can't create memfd: %s", g_strerror(errsv));
+            return -1;
+        }
+#else
+        char *path;
+        int fd = g_file_open_tmp("gbb-event-log-XXXXXX", &path, error);
+        if (fd == -1)
+            return -1;
+
+        unlink(path);
+        g_free(path);
+#endif
+
+        GOutputStream *output = g_unix_output_stream_new(fd, FALSE);
+        gboolean result = write_binary(output, log->events, log->n_events, error);
+        g_object_unref(output);
+
+#ifdef HAVE_MEMFD_CREATE
+        if (result &&
+            fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+            int errsv = errno;
+            g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+                        "Can't seal memfd: %s", g_strerror(errsv));
+            result = FALSE;
+        }
+#endif
+
+        if (!result) {
+            close(fd);
+            return -1;
+        }
+
+        log->binary_fd = fd;
+    }
+
+    int fd = fcntl(log->binary_fd, F_DUPFD_CLOEXEC, 0);
+    if (fd == -1) {
+        int errsv = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+                    "Can't duplicate file descriptor: %s", g_strerror(errsv));
+    }
+
+    return fd;
+}
+
+void
+gbb_event_transform_init (GbbEventTransform *transform)
+{
+    transform->speed = 1.0;
+    transform->motion_rate = 0;
+    transform->max_idle = 0;
+}
+
+/**
+ * gbb_event_transform_set_max_idle:
+ * @transform: a #GbbEventTransform
+ * @seconds: longest gap to leave between events
+ *
+ * Sets the longest gap between events, rounded to whole milliseconds.
+ *
+ * Return value: %FALSE, leaving @transform unchanged, if @seconds
+ *   isn't positive or is out of range, including when it rounds to 0,
+ *   which would mean no limit at all
+ */
+gboolean
+gbb_event_transform_set_max_idle (GbbEventTransform *transform,
+                                  double             seconds)
+{
+    double ms = seconds * 1000;
+
+    if (!(ms >= 0.5 && ms < G_MAXUINT))
+        return FALSE;
+
+    transform->max_idle = lround(ms);
+    return TRUE;
+}
+
+gboolean
+gbb_event_transform_is_identity (const GbbEventTransform *transform)
+{
+    return transform->speed == 1.0 && transform->motion_rate == 0 && transform->max_idle == 0;
+}
+
+/* Motion events further apart than this (ms) are separate movements,
+ * and aren't interpolated between */
+#define MOTION_RUN_MAX_GAP 100.
+
+static void
+append_event (GArray         *events,
+              const GbbEvent *event,
+              double          time)
+{
+    GbbEvent new_event = *event;
+
+    new_event.time = (guint)(time + 0.5);
+    g_array_append_val(events, new_event);
+}
+
+/* Replaces a run of motion events with samples at @rate Hz, placing
+ * the pointer where it would have been on a straight line between the
+ * recorded positions. The run always ends at the last recorded position.
+ */
+static void
+resample_motion_run (GArray         *out,
+                     const GbbEvent *events,
+                     const double   *times,
+                     guint           n_events,
+                     double          rate)
+{
+    double period = 1000. / rate;
+    double end = times[n_events - 1];
+    const GbbEvent *last = NULL;
+    GbbEvent sample;
+    guint k = 0;
+    int step;
+
+    for (step = 0; times[0] + step * period < end; step++) {
+        double t = times[0] + step * period;
+        while (k + 1 < n_events && times[k + 1] <= t)
+            k++;
+
+        sample = events[k];
+        if (k + 1 < n_events && times[k + 1] > times[k]) {
+            double f = (t - times[k]) / (times[k + 1] - times[k]);
+            sample.x_root = lround(events[k].x_root + f * (events[k + 1].x_root - events[k].x_root));
+            sample.y_root = lround(events[k].y_root + f * (events[k + 1].y_root - events[k].y_root));
+        }
+
+        /* The pointer didn't move, so a device wouldn't report anything */
+        if (last && last->x_root == sample.x_root && last->y_root == sample.y_root)
+            continue;
+
+        append_event(out, &sample, t);
+        last = &g_array_index(out, GbbEvent, out->len - 1);
+    }
+
+    if (!last || last->x_root != events[n_events - 1].x_root ||
+        last->y_root != events[n_events - 1].y_root)
+        append_event(out, &events[n_events - 1], end);
+}
+
+/**
+ * gbb_event_log_transform:
+ * @log: a #GbbEventLog
+ * @transform: the changes to make
+ *
+ * Makes a copy of @log for playing differently from how it was
+ * recorded. Times are first divided by the speed. Then any gap between
+ * events, including before the first, that is longer than the maximum
+ * idle time is shortened to it. Finally, runs of motion events are
+ * resampled to the motion rate, which both decimates and interpolates.
+ * These are all in played time.
+ *
+ * Return value: the transformed log, or a new reference to @log if
+ *   @transform doesn't change anything
+ */
+GbbEventLog *
+gbb_event_log_transform (GbbEventLog             *log,
+                         const GbbEventTransform *transform)
+{
+    guint i, j;
+
+    g_return_val_if_fail(transform->speed > 0, NULL);
+
+    if (gbb_event_transform_is_identity(transform))
+        return gbb_event_log_ref(log);
+
+    double *times = g_new(double, log->n_events);
+    double last_time = 0;
+    double removed = 0;
+
+    for (i = 0; i < log->n_events; i++) {
+        double t = log->events[i].time / transform->speed;
+        if (transform->max_idle > 0 && t - last_time > transform->max_idle)
+            removed += t - last_time - transform->max_idle;
+        last_time = t;
+        times[i] = t - removed;
+    }
+
+    GArray *events = g_array_sized_new(FALSE, FALSE, sizeof(GbbEvent), log->n_events);
+
+    for (i = 0; i < log->n_events; i = j) {
+        j = i + 1;
+        if (transform->motion_rate > 0 && log->events[i].type == GBB_EVENT_MOTION_NOTIFY) {
+            while (j < log->n_events &&
+                   log->events[j].type == GBB_EVENT_MOTION_NOTIFY &&
+                   times[j] - times[j - 1] <= MOTION_RUN_MAX_GAP)
+                j++;
+
+            resample_motion_run(events, &log->events[i], &times[i], j - i, transform->motion_rate);
+        } else {
+            append_event(events, &log->events[i], times[i]);
+        }
+    }
+
+    g_free(times);
+
+    return event_log_new_from_array(events);
+}
+
+/**
+ * gbb_event_log_convert:
+ * @input_filename: an event log, in either format
+ * @output_filename: file to write
+ * @format: format to write
+ * @error: location to store error
+ *
+ * Converts an event log between the text and binary formats. The events
+ * are preserved exactly; comments in text logs are not, though the
+ * names of keys are added back as comments when writing text.
+ */
+gboolean
+gbb_event_log_convert (const char        *input_filename,
+                       const char        *output_filename,
+                       GbbEventLogFormat  format,
+                       GError           **error)
+{
+    GbbEventLog *log = gbb_event_log_new_from_file(input_filename, error);
+    gboolean result = FALSE;
+    guint i;
+
+    if (!log)
+        return FALSE;
+
+    GFile *output_file = g_file_new_for_path(output_filename);
+    GFileOutputStream *output = g_file_replace(output_file, NULL, FALSE,
+                                               G_FILE_CREATE_REPLACE_DESTINATION,
+                                               NULL, error);
+    g_object_unref(output_file);
+    if (!output)
+        goto out;
+
+    /* Buffer the small writes of the text format */
+    GOutputStream *buffered = g_buffered_output_stream_new(G_OUTPUT_STREAM(output));
+    g_object_unref(output);
+
+    if (format == GBB_EVENT_LOG_FORMAT_BINARY) {
+        result = write_binary(buffered, log->events, log->n_events, error);
+    } else {
+        result = TRUE;
+        for (i = 0; i < log->n_events && result; i++)
+            result = gbb_event_write(buffered, &log->events[i], NULL, error);
+    }
+
+    if (!g_output_stream_close(buffered, NULL, result ? error : NULL))
+        result = FALSE;
+    g_object_unref(buffered);
+
+out:
+    gbb_event_log_unref(log);
 
-    return duration;
+    return result;
 }
@@ -3,22 +3,103 @@
 
 #include <gio/gio.h>
 
+typedef enum {
+    GBB_EVENT_KEY_PRESS,
+    GBB_EVENT_KEY_RELEASE,
+    GBB_EVENT_BUTTON_PRESS,
+    GBB_EVENT_BUTTON_RELEASE,
+    GBB_EVENT_WHEEL,
+    GBB_EVENT_MOTION_NOTIFY,
+    GBB_EVENT_N_TYPES
+} GbbEventType;
+
 typedef struct {
-    char *name;
+    GbbEventType type;
     unsigned time;
     int x_root, y_root;
     int detail;
 } GbbEvent;
 
-void gbb_event_free(GbbEvent *event);
+/* Changes to how a log is played, applied by gbb_event_log_transform() */
+typedef struct {
+    double speed;       /* 2 plays twice as fast as recorded */
+    double motion_rate; /* Resample pointer motion to this many Hz, or 0 */
+    guint max_idle;     /* Shorten longer gaps between events to this (ms), or 0 */
+} GbbEventTransform;
+
+typedef enum {
+    GBB_EVENT_LOG_FORMAT_TEXT,
+    GBB_EVENT_LOG_FORMAT_BINARY
+} GbbEventLogFormat;
 
-GbbEvent *gbb_event_read (GDataInputStream *input_stream,
-                          GCancellable     *cancellable,
-                          GError          **error);
+/* A binary event log mapped into memory */
+typedef struct _GbbEventLogMap GbbEventLogMap;
 
-int gbb_event_log_duration (GFile        *event_log,
-                            GCancellable *cancellable,
-                            GError      **error);
+/* Reads the events of a log in either format */
+typedef struct _GbbEventLogReader GbbEventLogReader;
 
-#endif /* __EVENT_H__ */
+/* All the events of a log, loaded into memory */
+typedef struct _GbbEventLog GbbEventLog;
+
+const char *gbb_event_type_get_name  (GbbEventType  type);
+gboolean    gbb_event_type_from_name (const char   *name,
+                                      gsize         len,
+                                      GbbEventType *type);
+
+gboolean gbb_event_write (GOutputStream  *output_stream,
+                          const GbbEvent *event,
+                          GCancellable   *cancellable,
+                          GError        **error);
+
+GbbEventLogFormat gbb_event_log_get_format (int fd);
 
+GbbEventLogMap *gbb_event_log_map_new           (int             fd,
+                                                 GError        **error);
+guint           gbb_event_log_map_get_n_events  (GbbEventLogMap *map);
+void            gbb_event_log_map_get_event     (GbbEventLogMap *map,
+                                                 guint           index,
+                                                 GbbEvent       *event);
+void            gbb_event_log_map_free          (GbbEventLogMap *map);
+
+GbbEventLogReader *gbb_event_log_reader_new  (int                 fd,
+                                              GError            **error);
+gboolean           gbb_event_log_reader_next (GbbEventLogReader  *reader,
+                                              GbbEvent           *event,
+                                              GError            **error);
+void               gbb_event_log_reader_free (GbbEventLogReader  *reader);
+
+GbbEventLog    *gbb_event_log_new_from_fd          (int            fd,
+                                                    GError       **error);
+GbbEventLog    *gbb_event_log_new_from_file        (const char    *filename,
+                                                    GError       **error);
+GbbEventLog    *gbb_event_log_new_from_sealed_fd   (int            fd,
+                                                    GError       **error);
+GbbEventLog    *gbb_event_log_ref                  (GbbEventLog   *log);
+void            gbb_event_log_unref                (GbbEventLog   *log);
+const GbbEvent *gbb_event_log_get_events           (GbbEventLog   *log,
+                                                    guint         *n_events);
+guint           gbb_event_log_get_n_events         (GbbEventLog   *log);
+guint           gbb_event_log_get_n_events_of_type (GbbEventLog   *log,
+                                                    GbbEventType   type);
+guint           gbb_event_log_get_duration         (GbbEventLog   *log);
+int             gbb_event_log_get_binary_fd        (GbbEventLog   *log,
+                                                    GError       **error);
+guint           gbb_event_log_find_time            (GbbEventLog   *log,
+                                                    guint          time);
+GbbEventLog    *gbb_event_log_new_range            (GbbEventLog   *log,
+                                                    guint          start,
+                                                    guint          end);
+
+void         gbb_event_transform_init         (GbbEventTransform       *transform);
+gboolean     gbb_event_transform_set_max_idle (GbbEventTransform       *transform,
+                                               double                   seconds);
+gboolean     gbb_event_transform_is_identity  (const GbbEventTransform *transform);
+GbbEventLog *gbb_event_log_transform          (GbbEventLog             *log,
+                                               const GbbEventTransform *transform);
+
+gboolean gbb_event_log_convert (const char        *input_filename,
+                                const char        *output_filename,
+                                GbbEventLogFormat  format,
+                                GError           **error);
+
+#endif /* __EVENT_H__ */
@@ -15,6 +15,8 @@
 
 enum {
     READY,
+    ITERATION_FINISHED,
+    PROGRESS,
     FINISHED,
     LAST_SIGNAL
 };
@@ -37,6 +39,7 @@ gbb_event_player_finalize(GObject *object)
 static void
 gbb_event_player_init(GbbEventPlayer *player)
 {
+    player->create_time = g_get_monotonic_time();
 }
 
 static void
@@ -53,6 +56,24 @@ gbb_event_player_class_init(GbbEventPlayerClass *player_class)
                       0,
                       NULL, NULL, NULL,
                       G_TYPE_NONE, 0);
+    /* Emitted with the number of iterations played so far each time
+     * the end of the log is reached when playing in a loop */
+    signals[ITERATION_FINISHED] =
+        g_signal_new ("iteration-finished",
+                      GBB_TYPE_EVENT_PLAYER,
+                      G_SIGNAL_RUN_LAST,
+                      0,
+                      NULL, NULL, NULL,
+                      G_TYPE_NONE, 1, G_TYPE_UINT);
+    /* Emitted with a const GbbPlaybackProgress * at most once per
+     * progress interval while events are being played */
+    signals[PROGRESS] =
+        g_signal_new ("progress",
+                      GBB_TYPE_EVENT_PLAYER,
+                      G_SIGNAL_RUN_LAST,
+                      0,
+                      NULL, NULL, NULL,
+                      G_TYPE_NONE, 1, G_TYPE_POINTER);
     signals[FINISHED] =
         g_signal_new ("finished",
                       GBB_TYPE_EVENT_PLAYER,
@@ -80,22 +101,135 @@ gbb_event_player_get_mouse_device_node(GbbEventPlayer *player)
     return player->mouse_device_node;
 }
 
+/**
+ * gbb_event_player_set_realtime:
+ * @player: a #GbbEventPlayer
+ * @realtime: whether to play events from a thread with realtime priority
+ *
+ * Events are normally played from the main loop, where they can be held
+ * up by other work. With realtime set, subsequent plays emit events from
+ * a dedicated high-priority thread instead, which needs privileges to
+ * raise its priority.
+ */
+void
+gbb_event_player_set_realtime(GbbEventPlayer *player,
+                              gboolean        realtime)
+{
+    player->realtime = realtime;
+}
+
+gboolean
+gbb_event_player_get_realtime(GbbEventPlayer *player)
+{
+    return player->realtime;
+}
+
+/**
+ * gbb_event_player_set_progress_interval:
+ * @player: a #GbbEventPlayer
+ * @interval: milliseconds between #GbbEventPlayer::progress signals,
+ *   or 0 for none
+ *
+ * Progress is reported when the player wakes up to play events, at
+ * most once every @interval, and once more when playback stops, so an
+ * idle stretch of a log doesn't wake anything up. Takes effect on the
+ * next play.
+ */
+void
+gbb_event_player_set_progress_interval(GbbEventPlayer *player,
+                                       guint           interval)
+{
+    player->progress_interval = interval;
+}
+
+guint
+gbb_event_player_get_progress_interval(GbbEventPlayer *player)
+{
+    return player->progress_interval;
+}
+
+/* The player keeps a reference to @log while playing it */
+void
+gbb_event_player_play_log(GbbEventPlayer *player,
+                          GbbEventLog    *log)
+{
+    gbb_event_player_play_loop(player, log, 0, 1, 0);
+}
+
+/* Plays @log once, skipping the events before @start (in ms) */
+void
+gbb_event_player_play_from(GbbEventPlayer *player,
+                           GbbEventLog    *log,
+                           guint           start)
+{
+    gbb_event_player_play_loop(player, log, start, 1, 0);
+}
+
+/* Plays the events of @log from @start up to @end (in ms) once */
+void
+gbb_event_player_play_range(GbbEventPlayer *player,
+                            GbbEventLog    *log,
+                            guint           start,
+                            guint           end)
+{
+    GbbEventLog *range = gbb_event_log_new_range(log, start, end);
+    gbb_event_player_play_log(player, range);
+    gbb_event_log_unref(range);
+}
+
+/**
+ * gbb_event_player_play_loop:
+ * @player: a #GbbEventPlayer
+ * @log: the events to play
+ * @start: time offset into @log to start the first iteration at, in
+ *   milliseconds
+ * @n_iterations: number of times to play @log, or 0 for no limit
+ * @max_duration: don't start a new iteration once this many milliseconds
+ *   have passed, or 0 for no limit
+ *
+ * Plays @log repeatedly, each iteration starting where the last one
+ * ended on the timeline of the log, without a gap. A shortened first
+ * iteration still counts as an iteration.
+ * #GbbEventPlayer::iteration-finished is emitted at the end of each
+ * iteration, and #GbbEventPlayer::finished once the limits are reached
+ * or the player is stopped.
+ */
+void
+gbb_event_player_play_loop(GbbEventPlayer *player,
+                           GbbEventLog    *log,
+                           guint           start,
+                           guint           n_iterations,
+                           guint           max_duration)
+{
+    GBB_EVENT_PLAYER_GET_CLASS(player)->play_log(player, log, start, n_iterations, max_duration);
+}
+
 void
 gbb_event_player_play_fd(GbbEventPlayer *player,
                          int             fd)
 {
-    GBB_EVENT_PLAYER_GET_CLASS(player)->play_fd(player, fd);
+    GError *error = NULL;
+
+    GbbEventLog *log = gbb_event_log_new_from_fd(fd, &error);
+    if (!log)
+        die("Can't load event log: %s", error->message);
+
+    gbb_event_player_play_log(player, log);
+    gbb_event_log_unref(log);
 }
 
 void
 gbb_event_player_play_file(GbbEventPlayer *player,
                            const char     *filename)
 {
-    int fd = open(filename, O_RDONLY);
-    if (fd == -1)
-        die_errno("Can't open '%s'", filename);
+    GError *error = NULL;
+
+    GbbEventLog *log = gbb_event_log_new_from_file(filename, &error);
+    if (!log)
+        die("Can't load event log: %s", error->message);
 
-    gbb_event_player_play_fd(player, fd);
+    gbb_event_player_play_log(player, log);
+    gbb_event_log_unref(log);
 }
 
 void
@@ -104,18 +238,63 @@ gbb_event_player_stop(GbbEventPlayer *player)
     GBB_EVENT_PLAYER_GET_CLASS(player)->stop(player);
 }
 
+/**
+ * gbb_event_player_get_timing:
+ * @player: a #GbbEventPlayer
+ * @timing: location to store the timing
+ *
+ * Gets how late the events of the current or most recent play were
+ * emitted, compared to when they were scheduled.
+ */
+void
+gbb_event_player_get_timing(GbbEventPlayer    *player,
+                            GbbPlaybackTiming *timing)
+{
+    GBB_EVENT_PLAYER_GET_CLASS(player)->get_timing(player, timing);
+}
+
+/* When the player became ready, in g_get_monotonic_time() microseconds */
+gint64
+gbb_event_player_get_ready_time(GbbEventPlayer *player)
+{
+    return player->ready_time;
+}
+
+/* Return value: microseconds from creating the player to its devices
+ *  being ready, or -1 if they aren't ready yet */
+gint64
+gbb_event_player_get_startup_time(GbbEventPlayer *player)
+{
+    return player->ready ? player->ready_time - player->create_time : -1;
+}
+
 void
 gbb_event_player_set_ready(GbbEventPlayer *player,
                            const char     *keyboard_device_node,
                            const char     *mouse_device_node)
 {
     player->ready = TRUE;
+    player->ready_time = g_get_monotonic_time();
     player->keyboard_device_node = g_strdup(keyboard_device_node);
     player->mouse_device_node = g_strdup(mouse_device_node);
 
     g_signal_emit(player, signals[READY], 0);
 }
 
+void
+gbb_event_player_progress(GbbEventPlayer            *player,
+                          const GbbPlaybackProgress *progress)
+{
+    g_signal_emit(player, signals[PROGRESS], 0, progress);
+}
+
+void
+gbb_event_player_iteration_finished(GbbEventPlayer *player,
+                                    guint           n_iterations)
+{
+    g_signal_emit(player, signals[ITERATION_FINISHED], 0, n_iterations);
+}
+
 void
 gbb_event_player_finished(GbbEventPlayer *player)
 {
@@ -3,6 +3,9 @@
 
 #include <glib-object.h>
 
+#include "event-log.h"
+#include "playback-timing.h"
+
 typedef struct _GbbEventPlayer      GbbEventPlayer;
 typedef struct _GbbEventPlayerClass GbbEventPlayerClass;
 
@@ -19,33 +22,74 @@ struct _GbbEventPlayer {
     gboolean ready;
     char *keyboard_device_node;
     char *mouse_device_node;
+    gboolean realtime;
+    guint progress_interval;
+
+    gint64 create_time;
+    gint64 ready_time;
 };
 
 struct _GbbEventPlayerClass {
     GObjectClass parent_class;
 
-  void (*play_fd) (GbbEventPlayer *player,
-                   int             fd);
-  void (*stop)    (GbbEventPlayer *player);
+  void (*play_log) (GbbEventPlayer *player,
+                    GbbEventLog    *log,
+                    guint           start,
+                    guint           n_iterations,
+                    guint           max_duration);
+  void (*stop)     (GbbEventPlayer *player);
+  void (*get_timing) (GbbEventPlayer    *player,
+                      GbbPlaybackTiming *timing);
 };
 
 gboolean gbb_event_player_is_ready(GbbEventPlayer *player);
+gint64   gbb_event_player_get_startup_time(GbbEventPlayer *player);
+gint64   gbb_event_player_get_ready_time  (GbbEventPlayer *player);
 
 const char *gbb_event_player_get_keyboard_device_node(GbbEventPlayer *player);
 const char *gbb_event_player_get_mouse_device_node   (GbbEventPlayer *player);
 
+void     gbb_event_player_set_realtime (GbbEventPlayer *player,
+                                       gboolean        realtime);
+gboolean gbb_event_player_get_realtime (GbbEventPlayer *player);
+
+void  gbb_event_player_set_progress_interval (GbbEventPlayer *player,
+                                              guint           interval);
+guint gbb_event_player_get_progress_interval (GbbEventPlayer *player);
+
+void gbb_event_player_play_log (GbbEventPlayer *player,
+                                GbbEventLog    *log);
+void gbb_event_player_play_from(GbbEventPlayer *player,
+                                GbbEventLog    *log,
+                                guint           start);
+void gbb_event_player_play_range(GbbEventPlayer *player,
+                                 GbbEventLog    *log,
+                                 guint           start,
+                                 guint           end);
+void gbb_event_player_play_loop(GbbEventPlayer *player,
+                                GbbEventLog    *log,
+                                guint           start,
+                                guint           n_iterations,
+                                guint           max_duration);
 void gbb_event_player_play_fd  (GbbEventPlayer *player,
                                 int             fd);
 void gbb_event_player_play_file(GbbEventPlayer *player,
                                 const char     *filename);
 void gbb_event_player_stop     (GbbEventPlayer *player);
 
+void gbb_event_player_get_timing (GbbEventPlayer    *player,
+                                  GbbPlaybackTiming *timing);
+
 GType gbb_event_player_get_type(void);
 
 /* For implementations */
 void gbb_event_player_set_ready (GbbEventPlayer *player,
                                  const char     *keyboard_device_node,
                                  const char     *mouse_device_node);
+void gbb_event_player_iteration_finished (GbbEventPlayer *player,
+                                          guint           n_iterations);
+void gbb_event_player_progress           (GbbEventPlayer            *player,
+                                          const GbbPlaybackProgress *progress);
 void gbb_event_player_finished  (GbbEventPlayer *player);
 
 #endif /* __EVENT_PLAYER_H__*/
@@ -17,8 +17,21 @@ static const char gbb_introspection_xml[] =
     "    <method name='Play'>"
     "      <arg type='h' name='eventfd' direction='in'/>"
     "    </method>"
+    "    <method name='PlayLoop'>"
+    "      <arg type='h' name='eventfd' direction='in'/>"
+    "      <arg type='a{sv}' name='options' direction='in'/>"
+    "    </method>"
+    "    <signal name='IterationFinished'>"
+    "      <arg type='u' name='iterations'/>"
+    "    </signal>"
+    "    <signal name='Progress'>"
+    "      <arg type='a{sv}' name='progress'/>"
+    "    </signal>"
     "    <method name='Stop'>"
     "    </method>"
+    "    <method name='GetTiming'>"
+    "      <arg type='a{sv}' name='timing' direction='out'/>"
+    "    </method>"
     "    <method name='Destroy'>"
     "    </method>"
     " </interface>"
@@ -0,0 +1,191 @@
+/* -*- mode: C; c-file-style: "stroustrup"; indent-tabs-mode: nil; -*- */
+
+#include <string.h>
+
+#include "playback-timing.h"
+
+/* Lateness in microseconds is bucketed exactly below 16us, and above
+ * that into eight buckets for each power of two, so the resolution is
+ * always within 1/8 of the value. The last bucket holds everything
+ * from about two minutes up.
+ */
+#define EXACT_BUCKETS 16
+#define SUB_BUCKETS 8
+
+static guint
+get_bucket(guint64 lateness_us)
+{
+    if (lateness_us < EXACT_BUCKETS)
+        return lateness_us;
+
+    int msb = g_bit_nth_msf(lateness_us, -1);
+    guint bucket = EXACT_BUCKETS + (msb - 4) * SUB_BUCKETS + ((lateness_us >> (msb - 3)) - SUB_BUCKETS);
+
+    return MIN(bucket, GBB_PLAYBACK_TIMING_N_BUCKETS - 1);
+}
+
+/* The smallest lateness that falls into @bucket */
+gint64
+gbb_playback_timing_get_bucket_start(guint bucket)
+{
+    g_return_val_if_fail(bucket < GBB_PLAYBACK_TIMING_N_BUCKETS, -1);
+
+    if (bucket < EXACT_BUCKETS)
+        return bucket;
+
+    guint msb = (bucket - EXACT_BUCKETS) / SUB_BUCKETS + 4;
+    guint64 mantissa = (bucket - EXACT_BUCKETS) % SUB_BUCKETS + SUB_BUCKETS;
+
+    return mantissa << (msb - 3);
+}
+
+void
+gbb_playback_timing_reset(GbbPlaybackTiming *timing)
+{
+    memset(timing, 0, sizeof(GbbPlaybackTiming));
+}
+
+/* Events that went out early count as on time */
+void
+gbb_playback_timing_add(GbbPlaybackTiming *timing,
+                        gint64             lateness_us)
+{
+    if (lateness_us < 0)
+        lateness_us = 0;
+
+    timing->n_events++;
+    timing->max_lateness_us = MAX(timing->max_lateness_us, lateness_us);
+    if (lateness_us > 1000)
+        timing->n_late_1ms++;
+    if (lateness_us > 5000)
+        timing->n_late_5ms++;
+    if (lateness_us > 20000)
+        timing->n_late_20ms++;
+
+    timing->buckets[get_bucket(lateness_us)]++;
+}
+
+/**
+ * gbb_playback_timing_get_percentile:
+ * @timing: a #GbbPlaybackTiming
+ * @fraction: the percentile, from 0 to 1
+ *
+ * Return value: the lateness in microseconds that @fraction of events
+ *   were within, rounded down to the start of its bucket, or -1 if no
+ *   events have been added.
+ */
+gint64
+gbb_playback_timing_get_percentile(const GbbPlaybackTiming *timing,
+                                   double                   fraction)
+{
+    guint64 count = 0;
+    guint i;
+
+    if (timing->n_events == 0)
+        return -1;
+
+    guint64 target = MAX(1, (guint64)(fraction * timing->n_events + 0.5));
+    for (i = 0; i < GBB_PLAYBACK_TIMING_N_BUCKETS; i++) {
+        count += timing->buckets[i];
+        if (count >= target)
+            break;
+    }
+
+    return MIN(gbb_playback_timing_get_bucket_start(MIN(i, GBB_PLAYBACK_TIMING_N_BUCKETS - 1)),
+               timing->max_lateness_us);
+}
+
+/* For passing over D-Bus, as a{sv} */
+GVariant *
+gbb_playback_timing_to_variant(const GbbPlaybackTiming *timing)
+{
+    GVariantBuilder builder;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+    g_variant_builder_add(&builder, "{sv}", "events", g_variant_new_uint64(timing->n_events));
+    g_variant_builder_add(&builder, "{sv}", "wakeups", g_variant_new_uint64(timing->n_wakeups));
+    g_variant_builder_add(&builder, "{sv}", "writes", g_variant_new_uint64(timing->n_writes));
+    g_variant_builder_add(&builder, "{sv}", "elapsed", g_variant_new_int64(timing->elapsed_us));
+    g_variant_builder_add(&builder, "{sv}", "position", g_variant_new_uint32(timing->position_ms));
+    g_variant_builder_add(&builder, "{sv}", "max", g_variant_new_int64(timing->max_lateness_us));
+    g_variant_builder_add(&builder, "{sv}", "late-1ms", g_variant_new_uint64(timing->n_late_1ms));
+    g_variant_builder_add(&builder, "{sv}", "late-5ms", g_variant_new_uint64(timing->n_late_5ms));
+    g_variant_builder_add(&builder, "{sv}", "late-20ms", g_variant_new_uint64(timing->n_late_20ms));
+    g_variant_builder_add(&builder, "{sv}", "buckets",
+                          g_variant_new_fixed_array(G_VARIANT_TYPE_UINT64,
+                                                    timing->buckets, GBB_PLAYBACK_TIMING_N_BUCKETS,
+                                                    sizeof(guint64)));
+
+    return g_variant_builder_end(&builder);
+}
+
+gboolean
+gbb_playback_timing_from_variant(GbbPlaybackTiming *timing,
+                                 GVariant          *variant)
+{
+    gbb_playback_timing_reset(timing);
+
+    if (!g_variant_is_of_type(variant, G_VARIANT_TYPE("a{sv}")))
+        return FALSE;
+
+    GVariant *buckets = g_variant_lookup_value(variant, "buckets", G_VARIANT_TYPE("at"));
+    if (buckets == NULL)
+        return FALSE;
+
+    gsize n_buckets;
+    const guint64 *bucket_values = g_variant_get_fixed_array(buckets, &n_buckets, sizeof(guint64));
+    memcpy(timing->buckets, bucket_values,
+           MIN(n_buckets, GBB_PLAYBACK_TIMING_N_BUCKETS) * sizeof(guint64));
+    g_variant_unref(buckets);
+
+    if (!g_variant_lookup(variant, "wakeups", "t", &timing->n_wakeups) ||
+        !g_variant_lookup(variant, "writes", "t", &timing->n_writes) ||
+        !g_variant_lookup(variant, "elapsed", "x", &timing->elapsed_us) ||
+        !g_variant_lookup(variant, "position", "u", &timing->position_ms) ||
+        !g_variant_lookup(variant, "events", "t", &timing->n_events) ||
+        !g_variant_lookup(variant, "max", "x", &timing->max_lateness_us) ||
+        !g_variant_lookup(variant, "late-1ms", "t", &timing->n_late_1ms) ||
+        !g_variant_lookup(variant, "late-5ms", "t", &timing->n_late_5ms) ||
+        !g_variant_lookup(variant, "late-20ms", "t", &timing->n_late_20ms)) {
+        gbb_playback_timing_reset(timing);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+GVariant *
+gbb_playback_progress_to_variant(const GbbPlaybackProgress *progress)
+{
+    GVariantBuilder builder;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+    g_variant_builder_add(&builder, "{sv}", "time", g_variant_new_int64(progress->time_us));
+    g_variant_builder_add(&builder, "{sv}", "iteration", g_variant_new_uint32(progress->iteration));
+    g_variant_builder_add(&builder, "{sv}", "position", g_variant_new_uint32(progress->position_ms));
+    g_variant_builder_add(&builder, "{sv}", "events", g_variant_new_uint64(progress->n_events));
+    g_variant_builder_add(&builder, "{sv}", "max", g_variant_new_int64(progress->max_lateness_us));
+
+    return g_variant_builder_end(&builder);
+}
+
+gboolean
+gbb_playback_progress_from_variant(GbbPlaybackProgress *progress,
+                                   GVariant            *variant)
+{
+    memset(progress, 0, sizeof(GbbPlaybackProgress));
+
+    if (!g_variant_is_of_type(variant, G_VARIANT_TYPE("a{sv}")))
+        return FALSE;
+
+    if (!g_variant_lookup(variant, "time", "x", &progress->time_us) ||
+        !g_variant_lookup(variant, "iteration", "u", &progress->iteration) ||
+        !g_variant_lookup(variant, "position", "u", &progress->position_ms) ||
+        !g_variant_lookup(variant, "events", "t", &progress->n_events) ||
+        !g_variant_lookup(variant, "max", "x", &progress->max_lateness_us)) {
+        memset(progress, 0, sizeof(GbbPlaybackProgress));
+        return FALSE;
+    }
+
+    return TRUE;
+}
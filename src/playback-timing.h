@@ -0,0 +1,49 @@
+/* -*- mode: C; c-file-style: "stroustrup"; indent-tabs-mode: nil; -*- */
+
+#ifndef __PLAYBACK_TIMING_H__
+#define __PLAYBACK_TIMING_H__
+
+#include <glib.h>
+
+#define GBB_PLAYBACK_TIMING_N_BUCKETS 200
+
+/* How late events were emitted relative to their scheduled times, and
+ * what it cost to emit them */
+typedef struct {
+    guint64 n_events;
+    guint64 n_wakeups;  /* Times the player woke up to emit events */
+    guint64 n_writes;   /* write() calls to the input devices */
+    gint64 elapsed_us;  /* From the start of the play to the last events */
+    guint position_ms;  /* Where to resume: just after the last events, in ms into the log */
+    gint64 max_lateness_us;
+    guint64 n_late_1ms;
+    guint64 n_late_5ms;
+    guint64 n_late_20ms;
+    guint64 buckets[GBB_PLAYBACK_TIMING_N_BUCKETS];
+} GbbPlaybackTiming;
+
+/* How far playback has got, reported while playing */
+typedef struct {
+    gint64 time_us;         /* g_get_monotonic_time() when the last events were played */
+    guint iteration;        /* Iteration of the last events played, from 0 */
+    guint position_ms;      /* Time of the last events played, in ms into the log */
+    guint64 n_events;
+    gint64 max_lateness_us;
+} GbbPlaybackProgress;
+
+void   gbb_playback_timing_reset          (GbbPlaybackTiming       *timing);
+void   gbb_playback_timing_add            (GbbPlaybackTiming       *timing,
+                                           gint64                   lateness_us);
+gint64 gbb_playback_timing_get_percentile (const GbbPlaybackTiming *timing,
+                                           double                   fraction);
+gint64 gbb_playback_timing_get_bucket_start (guint                  bucket);
+
+GVariant *gbb_playback_timing_to_variant   (const GbbPlaybackTiming *timing);
+gboolean  gbb_playback_timing_from_variant (GbbPlaybackTiming       *timing,
+                                            GVariant                *variant);
+
+GVariant *gbb_playback_progress_to_variant   (const GbbPlaybackProgress *progress);
+gboolean  gbb_playback_progress_from_variant (GbbPlaybackProgress       *progress,
+                                              GVariant                  *variant);
+
+#endif /* __PLAYBACK_TIMING_H__ */
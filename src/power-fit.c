@@ -0,0 +1,221 @@
+/* -*- mode: C; c-file-style: "stroustrup"; indent-tabs-mode: nil; -*- */
+
+#include <math.h>
+
+#include "power-fit.h"
+
+/* Estimates power as the slope of a least-squares line through the
+ * battery's energy readings, with the standard error of the slope as
+ * an error bar.
+ *
+ * The firmware only updates the energy every so often, and rounds it
+ * to some quantum, so the readings form a staircase. We only take a
+ * point at each step, at the time the new value appeared; those lie on
+ * the true discharge line give or take one quantum, while the flat
+ * parts in between would bias the fit.
+ */
+
+typedef struct {
+    gint64 time_us;
+    double energy; /* WH */
+} FitPoint;
+
+struct _GbbPowerFit {
+    double window; /* seconds, or <= 0 to fit all points */
+    GArray *points;
+
+    gboolean have_state;
+    guint supplies_serial;
+    gboolean online;
+    gint64 last_time_us;
+    double last_energy;
+    double quantum; /* Smallest change in energy seen, or -1 */
+
+    gboolean valid;
+    double power;
+    double error;
+};
+
+/**
+ * gbb_power_fit_new:
+ * @window_seconds: only fit the points in this much time before the
+ *  latest one, or 0 to fit all points since the last reset.
+ *
+ * Return value: a new #GbbPowerFit, free with gbb_power_fit_free()
+ */
+GbbPowerFit *
+gbb_power_fit_new(double window_seconds)
+{
+    GbbPowerFit *fit = g_slice_new0(GbbPowerFit);
+
+    fit->window = window_seconds;
+    fit->points = g_array_new(FALSE, FALSE, sizeof(FitPoint));
+    gbb_power_fit_reset(fit);
+
+    return fit;
+}
+
+void
+gbb_power_fit_free(GbbPowerFit *fit)
+{
+    g_array_free(fit->points, TRUE);
+    g_slice_free(GbbPowerFit, fit);
+}
+
+void
+gbb_power_fit_reset(GbbPowerFit *fit)
+{
+    g_array_set_size(fit->points, 0);
+    fit->have_state = FALSE;
+    fit->last_time_us = 0;
+    fit->last_energy = -1;
+    fit->quantum = -1;
+    fit->valid = FALSE;
+}
+
+static double
+state_get_energy(const GbbPowerState *state)
+{
+    if (state->energy_now >= 0)
+        return state->energy_now;
+    else if (state->charge_now >= 0 && state->voltage_now >= 0)
+        return state->charge_now * state->voltage_now;
+    else
+        return -1;
+}
+
+static void
+fit_update(GbbPowerFit *fit)
+{
+    FitPoint *points = (FitPoint *)fit->points->data;
+    guint n = fit->points->len;
+    guint i;
+
+    fit->valid = FALSE;
+    if (n < 3)
+        return;
+
+    /* Relative to the first point, to keep precision */
+    double mean_t = 0, mean_e = 0;
+    for (i = 0; i < n; i++) {
+        mean_t += (points[i].time_us - points[0].time_us) / 1000000.;
+        mean_e += points[i].energy - points[0].energy;
+    }
+    mean_t /= n;
+    mean_e /= n;
+
+    double sxx = 0, sxy = 0;
+    for (i = 0; i < n; i++) {
+        double dt = (points[i].time_us - points[0].time_us) / 1000000. - mean_t;
+        double de = points[i].energy - points[0].energy - mean_e;
+        sxx += dt * dt;
+        sxy += dt * de;
+    }
+
+    if (sxx <= 0)
+        return;
+
+    double slope = sxy / sxx;
+
+    double rss = 0;
+    for (i = 0; i < n; i++) {
+        double dt = (points[i].time_us - points[0].time_us) / 1000000. - mean_t;
+        double de = points[i].energy - points[0].energy - mean_e;
+        rss += (de - slope * dt) * (de - slope * dt);
+    }
+
+    /* The scatter can't really be less than the rounding to the quantum,
+     * even when the points happen to line up. */
+    double variance = rss / (n - 2);
+    if (fit->quantum > 0)
+        variance = MAX(variance, fit->quantum * fit->quantum / 12);
+
+    fit->power = - 3600 * slope;
+    fit->error = 3600 * sqrt(variance / sxx);
+    fit->valid = TRUE;
+}
+
+/**
+ * gbb_power_fit_add_state:
+ * @fit: a #GbbPowerFit
+ * @state: the latest state from the power monitor
+ *
+ * Adds a point to the fit if the battery's energy has been updated since
+ * the last state. The fit starts over when the power supplies change or
+ * the AC adapter is plugged in or removed.
+ */
+void
+gbb_power_fit_add_state(GbbPowerFit         *fit,
+                        const GbbPowerState *state)
+{
+    if (fit->have_state &&
+        (state->supplies_serial != fit->supplies_serial || state->online != fit->online))
+        gbb_power_fit_reset(fit);
+
+    fit->have_state = TRUE;
+    fit->supplies_serial = state->supplies_serial;
+    fit->online = state->online;
+
+    double energy = state_get_energy(state);
+    if (energy < 0)
+        return;
+
+    /* Until an update has been seen, we don't know when the value appeared */
+    if (!state->have_energy_time || state->energy_time_us == fit->last_time_us)
+        return;
+
+    if (fit->last_energy >= 0) {
+        double step = fabs(energy - fit->last_energy);
+        if (step > 0 && (fit->quantum < 0 || step < fit->quantum))
+            fit->quantum = step;
+    }
+
+    fit->last_time_us = state->energy_time_us;
+    fit->last_energy = energy;
+
+    FitPoint point = { state->energy_time_us, energy };
+    g_array_append_val(fit->points, point);
+
+    if (fit->window > 0) {
+        FitPoint *points = (FitPoint *)fit->points->data;
+        guint n_old = 0;
+        while (n_old < fit->points->len &&
+               point.time_us - points[n_old].time_us > fit->window * 1000000.)
+            n_old++;
+        if (n_old > 0)
+            g_array_remove_range(fit->points, 0, n_old);
+    }
+
+    fit_update(fit);
+}
+
+/**
+ * gbb_power_fit_get_power:
+ * @fit: a #GbbPowerFit
+ * @power: (out): location to store the estimated power draw (W), negative
+ *   when charging
+ * @error: (out): location to store the standard error of @power (W)
+ *
+ * Return value: %TRUE if there are enough points for an estimate
+ */
+gboolean
+gbb_power_fit_get_power(GbbPowerFit *fit,
+                        double      *power,
+                        double      *error)
+{
+    if (!fit->valid)
+        return FALSE;
+
+    if (power)
+        *power = fit->power;
+    if (error)
+        *error = fit->error;
+
+    return TRUE;
+}
+
+int
+gbb_power_fit_get_n_points(GbbPowerFit *fit)
+{
+    return fit->points->len;
+}
@@ -0,0 +1,23 @@
+/* -*- mode: C; c-file-style: "stroustrup"; indent-tabs-mode: nil; -*- */
+
+#ifndef __POWER_FIT_H__
+#define __POWER_FIT_H__
+
+#include <glib.h>
+
+#include "power-monitor.h"
+
+typedef struct _GbbPowerFit GbbPowerFit;
+
+GbbPowerFit *gbb_power_fit_new  (double       window_seconds);
+void         gbb_power_fit_free (GbbPowerFit *fit);
+
+void     gbb_power_fit_reset     (GbbPowerFit         *fit);
+void     gbb_power_fit_add_state (GbbPowerFit         *fit,
+                                  const GbbPowerState *state);
+gboolean gbb_power_fit_get_power (GbbPowerFit         *fit,
+                                  double              *power,
+                                  double              *error);
+int      gbb_power_fit_get_n_points (GbbPowerFit      *fit);
+
+#endif /* __POWER_FIT_H__ */
@@ -135,12 +135,31 @@ update_chart_ranges(GbbPowerGraphs *graphs)
             const GbbPowerState *last_state = gbb_test_run_get_last_state(graphs->run);
 
             if (start_state != last_state) {
-                GbbPowerStatistics *stats = gbb_power_statistics_compute(start_state, last_state);
+                GbbPowerStatistics *stats = gbb_power_statistics_compute_with_estimator(start_state, last_state,
+                                                                                         gbb_test_run_get_estimator(graphs->run));
                 graphs->max_x = round_up_time(stats->battery_life);
                 gbb_power_statistics_free(stats);
             }
         }
         break;
+    case GBB_DURATION_CONVERGED:
+        graphs->max_x = 60 * 60;
+        if (graphs->run) {
+            /* The end isn't known in advance; leave room to grow */
+            const GbbPowerState *start_state = gbb_test_run_get_start_state(graphs->run);
+            const GbbPowerState *last_state = gbb_test_run_get_last_state(graphs->run);
+            double max_seconds = gbb_test_run_get_duration_max_time(graphs->run);
+            double loop_time = gbb_test_run_get_loop_time(graphs->run);
+            double seconds = gbb_test_run_get_duration_min_iterations(graphs->run) * loop_time;
+
+            if (start_state != last_state)
+                seconds = MAX(seconds, 1.5 * (last_state->time_us - start_state->time_us) / 1000000.);
+            if (max_seconds > 0)
+                seconds = MIN(seconds, max_seconds);
+
+            graphs->max_x = round_up_time(seconds + loop_time);
+        }
+        break;
     }
 
     if (graphs->max_x >= 60 * 60)
@@ -261,19 +280,22 @@ on_chart_area_draw (GtkWidget      *chart_area,
 
     GbbPowerState *start_state = history->head->data;
     GbbPowerState *last_state = history->head->data;
+    GbbPowerEstimator estimator = gbb_test_run_get_estimator(graphs->run);
     GList *l;
     for (l = history->head->next; l; l = l->next) {
         GbbPowerState *state = l->data;
         double v;
 
         if (chart_area == graphs->power_area) {
-            GbbPowerStatistics *interval_stats = gbb_power_statistics_compute(last_state, state);
+            GbbPowerStatistics *interval_stats = gbb_power_statistics_compute_with_estimator(last_state, state,
+                                                                                             estimator);
             v = interval_stats->power / graphs->max_y_power;
             gbb_power_statistics_free(interval_stats);
         } else if (chart_area == graphs->percentage_area) {
             v = gbb_power_state_get_percent(state) / 100;
         } else {
-            GbbPowerStatistics *overall_stats = gbb_power_statistics_compute(start_state, state);
+            GbbPowerStatistics *overall_stats = gbb_power_statistics_compute_with_estimator(start_state, state,
+                                                                                            estimator);
             v = overall_stats->battery_life / graphs->max_y_life;
             gbb_power_statistics_free(overall_stats);
         }
@@ -281,7 +303,9 @@ on_chart_area_draw (GtkWidget      *chart_area,
         double x = allocation.width * (state->time_us - start_state->time_us) / 1000000. / graphs->max_x;
         double y = (1 - v) * allocation.height;
 
-        if (l == history->head->next)
+        /* Leave a gap where power supplies were added or removed */
+        if (l == history->head->next ||
+            (chart_area == graphs->power_area && state->supplies_serial != last_state->supplies_serial))
             cairo_move_to(cr, x, y);
         else
             cairo_line_to(cr, x, y);
@@ -1,31 +1,160 @@
 /* -*- mode: C; c-file-style: "stroustrup"; indent-tabs-mode: nil; -*- */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <linux/netlink.h>
 
 #include <gio/gio.h>
+#include <glib-unix.h>
 
 #include "power-monitor.h"
 
 /* Time between reading values out of proc (ms) */
 #define UPDATE_FREQUENCY 250
 
+/* In GBB_SAMPLING_MODE_UEVENT, if the kernel hasn't sent a power_supply uevent
+ * in this long (seconds), assume the firmware has stopped notifying and poll */
+#define UEVENT_PROBE_TIMEOUT 60
+
+/* Once the fuel gauge's update period is known, sample every
+ * EDGE_SAMPLE_INTERVAL (ms) in a window of EDGE_WINDOW_FRACTION of the
+ * period either side of the next expected update, and otherwise only
+ * every EDGE_RELAXED_FACTOR * UPDATE_FREQUENCY. */
+#define EDGE_SAMPLE_INTERVAL 25
+#define EDGE_WINDOW_FRACTION 0.1
+#define EDGE_RELAXED_FACTOR 8
+/* Consistent update intervals seen before the period is trusted */
+#define EDGE_MIN_CONFIRMATIONS 2
+
+/* Without uevents, how often to look for power supplies coming and going (s) */
+#define RESCAN_INTERVAL 5
+
+/* Number of samples that can be queued up for the main thread; must be a power of two */
+#define STATE_RING_SIZE 64
+
+/* Times when a counter changes value; each new value is timestamped at
+ * the midpoint between the last sample showing the old value and the
+ * first showing the new one */
+typedef struct {
+    double last_value;
+    gint64 last_time; /* 0 before the first sample */
+    gint64 edge_time;
+    gboolean have_edge;
+} EdgeTracker;
+
+typedef struct {
+    GbbPowerState states[STATE_RING_SIZE];
+    guint head; /* Only written by the sampler thread */
+    guint tail; /* Only written by the main thread */
+} StateRing;
+
 struct _GbbPowerMonitor {
     GObject parent;
+    char *sysfs_root;
     GList *batteries;
     GList *adapters;
+    GList *rapl_zones;
     GbbPowerState current_state;
-    guint update_timeout;
+
+    GbbSamplingMode sampling_mode;
+    gboolean read_uevent_files;
+
+    /* Running trapezoidal integral of the instantaneous power, only
+     * touched by whichever thread is calling read_state() */
+    double energy_integrated;
+    double last_power;
+    gint64 last_power_time;
+
+    /* Updates ("edges") of the combined figures: an edge is complete
+     * once every battery's own counter has changed since the last one.
+     * Before the first, combined_edge_time is when tracking started. */
+    gint64 combined_edge_time;
+    gboolean have_combined_edge;
+    gint64 update_period_us;
+    int period_confirmations;
+
+    gboolean warned_mixed_batteries;
+
+    /* Power supplies added or removed, from the sampler thread */
+    GAsyncQueue *supply_changes;
+    guint supplies_serial;
+
+    /* Sample timestamps run this many times faster than real time */
+    double time_scale;
+    gint64 time_base;
+    gint64 manual_time_us; /* Time of the sample in GBB_SAMPLING_MODE_MANUAL */
+
+    GThread *sampler;
+    gboolean sampler_stop;
+    int wake_fd;   /* Wakes up the sampler thread to stop it */
+    StateRing ring;
+    int notify_fd; /* Tells the main thread there are samples in the ring */
+    guint notify_watch;
+
+    int uevent_fd;
+
+    guint sample_syscalls;
+
+    /* Written by the sampler thread and read by the main thread, for
+     * gbb_power_monitor_get_sampling_cost() and _get_saved_wakeups() */
+    GMutex stats_lock;
+    guint64 total_syscalls;
+    gint64 total_sample_time_us;
+    guint64 n_samples;
+    guint64 dropped_samples;
+    gint64 uevent_start_time; /* 0 when not listening for uevents */
+    gint64 uevent_time_us;
+    guint64 uevent_wakeups;
 };
 
 struct _GbbPowerMonitorClass {
     GObjectClass parent_class;
 };
 
-typedef struct {
-} BatteryState;
+static void monitor_stop_sampler(GbbPowerMonitor *monitor);
+static void close_uevents       (GbbPowerMonitor *monitor);
+
+typedef enum {
+    BATTERY_ENERGY_NOW,
+    BATTERY_ENERGY_FULL,
+    BATTERY_ENERGY_FULL_DESIGN,
+    BATTERY_CHARGE_NOW,
+    BATTERY_CHARGE_FULL,
+    BATTERY_CHARGE_FULL_DESIGN,
+    BATTERY_CAPACITY_NOW,
+    BATTERY_VOLTAGE_NOW,
+    BATTERY_POWER_NOW,
+    BATTERY_CURRENT_NOW,
+    BATTERY_UEVENT,
+    N_BATTERY_ATTRIBUTES
+} BatteryAttribute;
+
+static const char * const battery_attribute_names[N_BATTERY_ATTRIBUTES] = {
+    "energy_now",
+    "energy_full",
+    "energy_full_design",
+    "charge_now",
+    "charge_full",
+    "charge_full_design",
+    "capacity_now",
+    "voltage_now",
+    "power_now",
+    "current_now",
+    "uevent"
+};
 
 typedef struct  {
-    GFile *directory;
+    char *path;
+    char *name;
+    int fds[N_BATTERY_ATTRIBUTES];
     double energy_now;
     double energy_full;
     double energy_full_design;
@@ -34,15 +163,44 @@ typedef struct  {
     double charge_full_design;
     double capacity_now;
     double voltage_now;
+    double power_now;
+    double current_now;
+    int cycle_count;
+    GbbBatteryStatus status;
+    EdgeTracker edges;
 } Battery;
 
 typedef struct  {
-    GFile *directory;
+    char *path;
+    int online_fd;
     gboolean online;
 } Adapter;
 
+static const char * const rapl_domain_names[GBB_RAPL_N_DOMAINS] = {
+    "package",
+    "core",
+    "uncore",
+    "dram"
+};
+
+typedef struct {
+    gint64 time_us;
+    guint serial; /* supplies_serial of the samples taken after the change */
+    char *description;
+} SupplyChange;
+
+typedef struct {
+    char *path;
+    GbbRaplDomain domain;
+    int energy_fd;
+    gint64 max_energy_range_uj; /* -1 if unknown */
+    gint64 last_energy_uj;
+    gint64 total_energy_uj; /* With wraparounds accounted for */
+} RaplZone;
+
 enum {
     CHANGED,
+    SUPPLIES_CHANGED,
     LAST_SIGNAL
 };
 
@@ -69,10 +227,87 @@ gbb_power_state_get_percent (const GbbPowerState *state)
         return -1;
 }
 
+/* Returns the energy in WH, converting from charge if necessary, or -1 */
+double
+gbb_battery_state_get_energy (const GbbBatteryState *battery)
+{
+    if (battery->energy_now >= 0)
+        return battery->energy_now;
+    else if (battery->charge_now >= 0 && battery->voltage_now >= 0)
+        return battery->charge_now * battery->voltage_now;
+    else
+        return -1;
+}
+
+static const char * const battery_status_names[] = {
+    "Unknown",
+    "Charging",
+    "Discharging",
+    "Not charging",
+    "Full"
+};
+
+const char *
+gbb_battery_status_get_name (GbbBatteryStatus status)
+{
+    g_return_val_if_fail(status < G_N_ELEMENTS(battery_status_names), NULL);
+
+    return battery_status_names[status];
+}
+
+/* @str is the value from sysfs, not necessarily nul-terminated */
+GbbBatteryStatus
+gbb_battery_status_from_string (const char *str,
+                                gsize       len)
+{
+    guint i;
+
+    while (len > 0 && g_ascii_isspace(str[len - 1]))
+        len--;
+
+    for (i = 0; i < G_N_ELEMENTS(battery_status_names); i++) {
+        if (strlen(battery_status_names[i]) == len &&
+            memcmp(str, battery_status_names[i], len) == 0)
+            return i;
+    }
+
+    return GBB_BATTERY_STATUS_UNKNOWN;
+}
+
+const char *
+gbb_rapl_domain_get_name (GbbRaplDomain domain)
+{
+    g_return_val_if_fail(domain < GBB_RAPL_N_DOMAINS, NULL);
+
+    return rapl_domain_names[domain];
+}
+
 static gboolean
 gbb_power_state_equal(GbbPowerState *a,
                       GbbPowerState *b)
 {
+    int i;
+
+    for (i = 0; i < GBB_RAPL_N_DOMAINS; i++)
+        if (a->rapl_energy[i] != b->rapl_energy[i])
+            return FALSE;
+
+    if (a->n_batteries != b->n_batteries || a->supplies_serial != b->supplies_serial)
+        return FALSE;
+
+    for (i = 0; i < a->n_batteries; i++) {
+        const GbbBatteryState *battery_a = &a->batteries[i];
+        const GbbBatteryState *battery_b = &b->batteries[i];
+
+        if (battery_a->status != battery_b->status ||
+            battery_a->energy_now != battery_b->energy_now ||
+            battery_a->charge_now != battery_b->charge_now ||
+            battery_a->capacity_now != battery_b->capacity_now ||
+            battery_a->voltage_now != battery_b->voltage_now ||
+            battery_a->power_now != battery_b->power_now)
+            return FALSE;
+    }
+
     return (a->online == b->online &&
             a->energy_now == b->energy_now &&
             a->energy_full == b->energy_full &&
@@ -81,7 +316,9 @@ gbb_power_state_equal(GbbPowerState *a,
             a->charge_full == b->charge_full &&
             a->charge_full_design == b->charge_full_design &&
             a->capacity_now == b->capacity_now &&
-            a->voltage_now == b->voltage_now);
+            a->voltage_now == b->voltage_now &&
+            a->power_now == b->power_now &&
+            a->current_now == b->current_now);
 }
 
 void
@@ -90,47 +327,67 @@ gbb_power_statistics_free (GbbPowerStatistics *statistics)
     g_slice_free(GbbPowerStatistics, statistics);
 }
 
-static char *
-get_file_contents_string (GFile        *directory,
-                          char         *child,
-                          GCancellable *cancellable,
-                          GError      **error)
+/* Attribute files are opened once when the power supply is found and
+ * kept open; sysfs regenerates the contents each time a read starts at
+ * offset 0, so a pread() into a stack buffer gets the current value
+ * without reopening the file or allocating.
+ */
+static int
+open_attribute (const char *directory,
+                const char *name)
 {
-    GFile *file = g_file_get_child(directory, child);
-    char *contents;
-    if (!g_file_load_contents(file, cancellable, &contents, NULL, NULL, error))
-        contents = NULL;
+    char *path = g_build_filename(directory, name, NULL);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    g_free(path);
 
-    g_object_unref (file);
-    return contents;
+    return fd;
+}
+
+static void
+close_attribute (int *fd)
+{
+    if (*fd >= 0) {
+        close(*fd);
+        *fd = -1;
+    }
 }
 
 static gboolean
-get_file_contents_int (GFile        *directory,
-                       char         *child,
-                       int          *result,
-                       GCancellable *cancellable,
-                       GError      **error)
-{
-    char *contents = get_file_contents_string(directory, child, cancellable, error);
-    if (contents) {
-        *result = atoi (contents);
-        g_free (contents);
-        return TRUE;
-    } else {
+read_attribute_int (GbbPowerMonitor *monitor,
+                    int              fd,
+                    gint64          *result)
+{
+    char buf[32];
+    char *end;
+    ssize_t count;
+
+    if (fd < 0)
         return FALSE;
-    }
+
+    do {
+        monitor->sample_syscalls++;
+        count = pread(fd, buf, sizeof(buf) - 1, 0);
+    } while (count < 0 && errno == EINTR);
+
+    if (count <= 0)
+        return FALSE;
+
+    buf[count] = '\0';
+    gint64 value = g_ascii_strtoll(buf, &end, 10);
+    if (end == buf)
+        return FALSE;
+
+    *result = value;
+    return TRUE;
 }
 
 static gboolean
-get_file_contents_double (GFile        *directory,
-                          char         *child,
-                          double       *result,
-                          GCancellable *cancellable,
-                          GError      **error)
-{
-    int result_int;
-    if (get_file_contents_int (directory, child, &result_int, cancellable, error)) {
+read_attribute_double (GbbPowerMonitor *monitor,
+                       int              fd,
+                       double          *result)
+{
+    gint64 result_int;
+    if (read_attribute_int (monitor, fd, &result_int)) {
         *result = result_int / 1000000.;
         return TRUE;
     } else {
@@ -138,8 +395,35 @@ get_file_contents_double (GFile        *directory,
     }
 }
 
+/* power_now and current_now are updated by the firmware much more
+ * often than the energy and charge counters. Some firmware reports
+ * them as negative while discharging.
+ */
+static void
+battery_poll_instantaneous(Battery         *battery,
+                           GbbPowerMonitor *monitor)
+{
+    int *fds = battery->fds;
+
+    battery->power_now = -1.0;
+    battery->current_now = -1.0;
+
+    if (read_attribute_double (monitor, fds[BATTERY_POWER_NOW], &battery->power_now)) {
+        battery->power_now = fabs(battery->power_now);
+        return;
+    }
+
+    if (read_attribute_double (monitor, fds[BATTERY_CURRENT_NOW], &battery->current_now)) {
+        battery->current_now = fabs(battery->current_now);
+        if (battery->voltage_now < 0)
+            read_attribute_double (monitor, fds[BATTERY_VOLTAGE_NOW], &battery->voltage_now);
+        if (battery->voltage_now >= 0)
+            battery->power_now = battery->current_now * battery->voltage_now;
+    }
+}
+
 static void
-battery_poll(Battery *battery)
+battery_reset(Battery *battery)
 {
     battery->energy_now = -1.0;
     battery->energy_full = -1.0;
@@ -148,33 +432,179 @@ battery_poll(Battery *battery)
     battery->charge_full = -1.0;
     battery->charge_full_design = -1.0;
     battery->capacity_now = -1.0;
+    battery->voltage_now = -1.0;
+    battery->power_now = -1.0;
+    battery->current_now = -1.0;
+    battery->cycle_count = -1;
+    battery->status = GBB_BATTERY_STATUS_UNKNOWN;
+}
+
+static void
+battery_poll_attributes(Battery         *battery,
+                        GbbPowerMonitor *monitor)
+{
+    int *fds = battery->fds;
 
-    get_file_contents_double (battery->directory, "energy_now", &battery->energy_now, NULL, NULL);
+    read_attribute_double (monitor, fds[BATTERY_ENERGY_NOW], &battery->energy_now);
     if (battery->energy_now >= 0) {
-        GError *error = NULL;
-        get_file_contents_double (battery->directory, "energy_full", &battery->energy_full, NULL, NULL);
-        get_file_contents_double (battery->directory, "energy_full_design", &battery->energy_full_design, NULL, &error);
+        read_attribute_double (monitor, fds[BATTERY_ENERGY_FULL], &battery->energy_full);
+        read_attribute_double (monitor, fds[BATTERY_ENERGY_FULL_DESIGN], &battery->energy_full_design);
+    } else {
+        read_attribute_double (monitor, fds[BATTERY_CHARGE_NOW], &battery->charge_now);
+        if (battery->charge_now >= 0) {
+            read_attribute_double (monitor, fds[BATTERY_CHARGE_FULL], &battery->charge_full);
+            read_attribute_double (monitor, fds[BATTERY_CHARGE_FULL_DESIGN], &battery->charge_full_design);
+            read_attribute_double (monitor, fds[BATTERY_VOLTAGE_NOW], &battery->voltage_now);
+        } else {
+            gint64 capacity;
+            if (read_attribute_int (monitor, fds[BATTERY_CAPACITY_NOW], &capacity))
+                battery->capacity_now = capacity / 100.;
+        }
+    }
+
+    battery_poll_instantaneous(battery, monitor);
+}
+
+typedef struct {
+    const char *key;
+    gsize key_len;
+    gsize offset;
+    double scale; /* Negative to take the absolute value, as firmware may report discharge as negative */
+} UeventKey;
+
+#define UEVENT_KEY(key, field, scale) { key, sizeof(key) - 1, G_STRUCT_OFFSET(Battery, field), scale }
+
+static const UeventKey uevent_keys[] = {
+    UEVENT_KEY("ENERGY_NOW", energy_now, 1e-6),
+    UEVENT_KEY("ENERGY_FULL", energy_full, 1e-6),
+    UEVENT_KEY("ENERGY_FULL_DESIGN", energy_full_design, 1e-6),
+    UEVENT_KEY("CHARGE_NOW", charge_now, 1e-6),
+    UEVENT_KEY("CHARGE_FULL", charge_full, 1e-6),
+    UEVENT_KEY("CHARGE_FULL_DESIGN", charge_full_design, 1e-6),
+    UEVENT_KEY("CAPACITY", capacity_now, 1e-2),
+    UEVENT_KEY("VOLTAGE_NOW", voltage_now, 1e-6),
+    UEVENT_KEY("POWER_NOW", power_now, -1e-6),
+    UEVENT_KEY("CURRENT_NOW", current_now, -1e-6),
+};
+
+#define UEVENT_PREFIX "POWER_SUPPLY_"
+
+static void
+parse_uevent_value(Battery    *battery,
+                   const char *key,
+                   gsize       key_len,
+                   const char *value,
+                   const char *value_end)
+{
+    char *end;
+    guint i;
+
+    if (key_len == 6 && memcmp(key, "STATUS", 6) == 0) {
+        battery->status = gbb_battery_status_from_string(value, value_end - value);
         return;
     }
-    get_file_contents_double (battery->directory, "charge_now", &battery->charge_now, NULL, NULL);
-    if (battery->charge_now >= 0) {
-        get_file_contents_double (battery->directory, "charge_full", &battery->charge_full, NULL, NULL);
-        get_file_contents_double (battery->directory, "charge_full_design", &battery->charge_full_design, NULL, NULL);
-        get_file_contents_double (battery->directory, "voltage_now", &battery->voltage_now, NULL, NULL);
+
+    gint64 v = g_ascii_strtoll(value, &end, 10);
+    if (end == value)
+        return;
+
+    if (key_len == 11 && memcmp(key, "CYCLE_COUNT", 11) == 0) {
+        battery->cycle_count = v;
         return;
     }
 
-    int capacity;
-    if (get_file_contents_int (battery->directory, "capacity_now", &capacity, NULL, NULL))
-        battery->capacity_now = capacity / 100.;
+    for (i = 0; i < G_N_ELEMENTS(uevent_keys); i++) {
+        if (key_len == uevent_keys[i].key_len && memcmp(key, uevent_keys[i].key, key_len) == 0) {
+            double scale = uevent_keys[i].scale;
+            if (scale < 0)
+                G_STRUCT_MEMBER(double, battery, uevent_keys[i].offset) = fabs(v * scale);
+            else
+                G_STRUCT_MEMBER(double, battery, uevent_keys[i].offset) = v * scale;
+            return;
+        }
+    }
+}
+
+/* The uevent file has all the POWER_SUPPLY_* values in a single
+ * consistent snapshot; parse it in place, in one pass.
+ */
+static gboolean
+battery_poll_uevent(Battery         *battery,
+                    GbbPowerMonitor *monitor)
+{
+    char buf[4096];
+    ssize_t count;
+
+    if (battery->fds[BATTERY_UEVENT] < 0)
+        return FALSE;
+
+    do {
+        monitor->sample_syscalls++;
+        count = pread(battery->fds[BATTERY_UEVENT], buf, sizeof(buf) - 1, 0);
+    } while (count < 0 && errno == EINTR);
+
+    if (count <= 0)
+        return FALSE;
+
+    buf[count] = '\0';
+
+    const char *line = buf;
+    const char *end = buf + count;
+    while (line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol)
+            eol = end;
+
+        if (eol - line > (gssize)strlen(UEVENT_PREFIX) &&
+            memcmp(line, UEVENT_PREFIX, strlen(UEVENT_PREFIX)) == 0) {
+            const char *key = line + strlen(UEVENT_PREFIX);
+            const char *equals = memchr(key, '=', eol - key);
+            if (equals)
+                parse_uevent_value(battery, key, equals - key, equals + 1, eol);
+        }
+
+        line = eol + 1;
+    }
+
+    /* Match what we'd read from the individual files */
+    if (battery->energy_now >= 0) {
+        battery->charge_now = battery->charge_full = battery->charge_full_design = -1.0;
+        battery->capacity_now = -1.0;
+    } else if (battery->charge_now >= 0) {
+        battery->capacity_now = -1.0;
+    }
+
+    if (battery->power_now < 0 && battery->current_now >= 0 && battery->voltage_now >= 0)
+        battery->power_now = battery->current_now * battery->voltage_now;
+
+    return TRUE;
+}
+
+static void
+battery_poll(Battery         *battery,
+             GbbPowerMonitor *monitor)
+{
+    battery_reset(battery);
+
+    if (monitor->read_uevent_files && battery_poll_uevent(battery, monitor))
+        return;
+
+    battery_poll_attributes(battery, monitor);
 }
 
 static Battery *
-battery_new (GFile *directory)
+battery_new (GbbPowerMonitor *monitor,
+             const char      *path)
 {
     Battery *battery = g_slice_new0(Battery);
-    battery->directory = g_object_ref(directory);
-    battery_poll(battery);
+    int i;
+
+    battery->path = g_strdup(path);
+    battery->name = g_path_get_basename(path);
+    for (i = 0; i < N_BATTERY_ATTRIBUTES; i++)
+        battery->fds[i] = open_attribute(path, battery_attribute_names[i]);
+
+    battery_poll(battery, monitor);
 
     return battery;
 }
@@ -182,27 +612,36 @@ battery_new (GFile *directory)
 static void
 battery_free (Battery *battery)
 {
-    g_object_unref(battery->directory);
+    int i;
+
+    for (i = 0; i < N_BATTERY_ATTRIBUTES; i++)
+        close_attribute(&battery->fds[i]);
+
+    g_free(battery->path);
+    g_free(battery->name);
     g_slice_free(Battery, battery);
 }
 
 static void
-adapter_poll(Adapter *adapter)
+adapter_poll(Adapter         *adapter,
+             GbbPowerMonitor *monitor)
 {
-    int online;
+    gint64 online;
 
-    if (get_file_contents_int (adapter->directory, "online", &online, NULL, NULL))
+    if (read_attribute_int (monitor, adapter->online_fd, &online))
         adapter->online = online != 0;
     else
         adapter->online = FALSE;
 }
 
 static Adapter *
-adapter_new(GFile *directory)
+adapter_new(GbbPowerMonitor *monitor,
+            const char      *path)
 {
     Adapter *adapter = g_slice_new0(Adapter);
-    adapter->directory = g_object_ref(directory);
-    adapter_poll(adapter);
+    adapter->path = g_strdup(path);
+    adapter->online_fd = open_attribute(path, "online");
+    adapter_poll(adapter, monitor);
 
     return adapter;
 }
@@ -210,53 +649,285 @@ adapter_new(GFile *directory)
 static void
 adapter_free (Adapter *adapter)
 {
-    g_object_unref(adapter->directory);
+    close_attribute(&adapter->online_fd);
+    g_free(adapter->path);
     g_slice_free(Adapter, adapter);
 }
 
+static int
+compare_batteries(const Battery *a,
+                  const Battery *b)
+{
+    return strcmp(a->name, b->name);
+}
+
+static int
+compare_battery_path(const Battery *battery,
+                     const char    *path)
+{
+    return strcmp(battery->path, path);
+}
+
+static int
+compare_adapter_path(const Adapter *adapter,
+                     const char    *path)
+{
+    return strcmp(adapter->path, path);
+}
+
+typedef enum {
+    SUPPLY_OTHER,
+    SUPPLY_BATTERY,
+    SUPPLY_ADAPTER
+} SupplyType;
+
+static char *
+read_string_attribute(const char *directory,
+                      const char *name)
+{
+    char *path = g_build_filename(directory, name, NULL);
+    char *contents = NULL;
+
+    if (g_file_get_contents(path, &contents, NULL, NULL))
+        g_strstrip(contents);
+    g_free(path);
+
+    return contents;
+}
+
+/* Uses the type attribute where there is one, so that USB-C and
+ * other non-"AC" supplies are found; batteries of peripherals such
+ * as wireless mice have a scope of "Device" and are skipped.
+ */
+static SupplyType
+classify_power_supply(const char *path,
+                      const char *name)
+{
+    SupplyType result = SUPPLY_OTHER;
+    char *scope = read_string_attribute(path, "scope");
+    char *type = read_string_attribute(path, "type");
+
+    if (scope && strcmp(scope, "Device") == 0)
+        result = SUPPLY_OTHER;
+    else if (type && strcmp(type, "Battery") == 0)
+        result = SUPPLY_BATTERY;
+    else if (type && (strcmp(type, "Mains") == 0 || g_str_has_prefix(type, "USB")))
+        result = SUPPLY_ADAPTER;
+    else if (!type && g_str_has_prefix(name, "BAT"))
+        result = SUPPLY_BATTERY;
+    else if (!type && g_str_has_prefix(name, "AC"))
+        result = SUPPLY_ADAPTER;
+
+    g_free(scope);
+    g_free(type);
+
+    return result;
+}
+
+/* Brings the lists of batteries and adapters up to date with the
+ * contents of <sysfs root>/class/power_supply, adding a description of
+ * each change to @changes, if not %NULL.
+ */
 static gboolean
-find_power_supplies(GbbPowerMonitor *monitor,
-                    GCancellable *cancellable,
-                    GError      **error)
-{
-    GFile *file = g_file_new_for_path ("/sys/class/power_supply");
-    GFileEnumerator *enumerator = NULL;
-
-    enumerator = g_file_enumerate_children (file,
-                                            "standard::name,standard::type",
-                                            G_FILE_QUERY_INFO_NONE,
-                                            cancellable, error);
-    if (!enumerator)
-        goto out;
+update_power_supplies(GbbPowerMonitor *monitor,
+                      GPtrArray       *changes,
+                      GError         **error)
+{
+    char *path = g_build_filename(monitor->sysfs_root, "class", "power_supply", NULL);
+    GHashTable *present = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    const char *name;
+    GList *l, *next;
+
+    GDir *dir = g_dir_open(path, 0, error);
+    if (!dir) {
+        g_free(path);
+        g_hash_table_destroy(present);
+        return FALSE;
+    }
 
-    while (*error == NULL) {
-        GFileInfo *info = g_file_enumerator_next_file (enumerator, cancellable, error);
-        GFile *child = NULL;
-        if (*error != NULL)
-            goto out;
-        else if (!info)
+    while ((name = g_dir_read_name(dir))) {
+        char *child_path = g_build_filename(path, name, NULL);
+        g_hash_table_add(present, child_path);
+
+        if (g_list_find_custom(monitor->batteries, child_path, (GCompareFunc)compare_battery_path) ||
+            g_list_find_custom(monitor->adapters, child_path, (GCompareFunc)compare_adapter_path))
+            continue;
+
+        switch (classify_power_supply(child_path, name)) {
+        case SUPPLY_BATTERY:
+            monitor->batteries = g_list_prepend(monitor->batteries, battery_new(monitor, child_path));
+            if (changes)
+                g_ptr_array_add(changes, g_strdup_printf("Battery %s added", name));
+            break;
+        case SUPPLY_ADAPTER:
+            monitor->adapters = g_list_prepend(monitor->adapters, adapter_new(monitor, child_path));
+            if (changes)
+                g_ptr_array_add(changes, g_strdup_printf("Power supply %s added", name));
+            break;
+        case SUPPLY_OTHER:
             break;
+        }
+    }
+
+    g_dir_close(dir);
+
+    for (l = monitor->batteries; l; l = next) {
+        Battery *battery = l->data;
+        next = l->next;
+        if (!g_hash_table_contains(present, battery->path)) {
+            if (changes)
+                g_ptr_array_add(changes, g_strdup_printf("Battery %s removed", battery->name));
+            battery_free(battery);
+            monitor->batteries = g_list_delete_link(monitor->batteries, l);
+        }
+    }
+
+    for (l = monitor->adapters; l; l = next) {
+        Adapter *adapter = l->data;
+        next = l->next;
+        if (!g_hash_table_contains(present, adapter->path)) {
+            if (changes) {
+                char *basename = g_path_get_basename(adapter->path);
+                g_ptr_array_add(changes, g_strdup_printf("Power supply %s removed", basename));
+                g_free(basename);
+            }
+            adapter_free(adapter);
+            monitor->adapters = g_list_delete_link(monitor->adapters, l);
+        }
+    }
+
+    /* Keep the order of the per-battery states stable */
+    monitor->batteries = g_list_sort(monitor->batteries, (GCompareFunc)compare_batteries);
+
+    g_hash_table_destroy(present);
+    g_free(path);
+
+    return TRUE;
+}
+
+/* The counter in energy_uj wraps around at max_energy_range_uj; on
+ * a busy package that can happen every few minutes. Without the range,
+ * the energy used across a wrap can't be known, and it is left out.
+ */
+static void
+rapl_zone_poll(RaplZone        *zone,
+               GbbPowerMonitor *monitor)
+{
+    gint64 energy_uj;
+
+    if (!read_attribute_int(monitor, zone->energy_fd, &energy_uj))
+        return;
+
+    if (zone->last_energy_uj >= 0) {
+        if (energy_uj >= zone->last_energy_uj)
+            zone->total_energy_uj += energy_uj - zone->last_energy_uj;
+        else if (zone->max_energy_range_uj > 0)
+            zone->total_energy_uj += zone->max_energy_range_uj - zone->last_energy_uj + energy_uj;
+    }
+
+    zone->last_energy_uj = energy_uj;
+}
+
+static RaplZone *
+rapl_zone_new(GbbPowerMonitor *monitor,
+              const char      *path,
+              GbbRaplDomain    domain)
+{
+    RaplZone *zone = g_slice_new0(RaplZone);
+    zone->path = g_strdup(path);
+    zone->domain = domain;
+    zone->last_energy_uj = -1;
+
+    zone->energy_fd = open_attribute(path, "energy_uj");
+
+    int fd = open_attribute(path, "max_energy_range_uj");
+    if (!read_attribute_int(monitor, fd, &zone->max_energy_range_uj))
+        zone->max_energy_range_uj = -1;
+    close_attribute(&fd);
+
+    rapl_zone_poll(zone, monitor);
+
+    return zone;
+}
+
+static void
+rapl_zone_free(RaplZone *zone)
+{
+    close_attribute(&zone->energy_fd);
+    g_free(zone->path);
+    g_slice_free(RaplZone, zone);
+}
+
+static gboolean
+rapl_domain_from_name(const char    *name,
+                      GbbRaplDomain *domain)
+{
+    int i;
+
+    /* Package zones are named package-0, package-1, ... */
+    for (i = 0; i < GBB_RAPL_N_DOMAINS; i++) {
+        if (g_str_has_prefix(name, rapl_domain_names[i])) {
+            *domain = i;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
 
-        if (g_file_info_get_file_type (info) != G_FILE_TYPE_DIRECTORY)
-            goto next;
+static void
+add_rapl_zone(GbbPowerMonitor *monitor,
+              const char      *path)
+{
+    char *name_path = g_build_filename(path, "name", NULL);
+    char *name = NULL;
+    GbbRaplDomain domain;
+
+    if (!g_file_get_contents(name_path, &name, NULL, NULL))
+        goto out;
 
-        child = g_file_enumerator_get_child (enumerator, info);
+    g_strstrip(name);
+    if (!rapl_domain_from_name(name, &domain))
+        goto out;
 
-        const char *basename = g_file_info_get_name (info);
-        if (g_str_has_prefix (basename, "BAT"))
-            monitor->batteries = g_list_prepend (monitor->batteries, battery_new (child));
-        else if (g_str_has_prefix (basename, "AC"))
-            monitor->adapters = g_list_prepend (monitor->adapters, adapter_new (child));
-    next:
-        g_clear_object (&child);
-        g_clear_object (&info);
+    RaplZone *zone = rapl_zone_new(monitor, path, domain);
+    /* Since Linux 5.10, energy_uj is only readable by root */
+    if (zone->energy_fd < 0) {
+        rapl_zone_free(zone);
+        goto out;
     }
 
+    monitor->rapl_zones = g_list_prepend(monitor->rapl_zones, zone);
+
 out:
-    g_clear_object (&file);
-    g_clear_object (&enumerator);
+    g_free(name);
+    g_free(name_path);
+}
+
+/* Zones are intel-rapl:<package> with subzones intel-rapl:<package>:<n>
+ * for core, uncore and dram; all of them appear flat in the class directory.
+ * A missing powercap directory just means no RAPL support.
+ */
+static void
+find_rapl_zones(GbbPowerMonitor *monitor,
+                const char      *powercap_path)
+{
+    GDir *dir = g_dir_open(powercap_path, 0, NULL);
+    const char *basename;
+
+    if (!dir)
+        return;
+
+    while ((basename = g_dir_read_name(dir)) != NULL) {
+        if (!g_str_has_prefix(basename, "intel-rapl:"))
+            continue;
+
+        char *path = g_build_filename(powercap_path, basename, NULL);
+        add_rapl_zone(monitor, path);
+        g_free(path);
+    }
 
-    return *error == NULL;
+    g_dir_close(dir);
 }
 
 static void
@@ -264,15 +935,43 @@ gbb_power_monitor_finalize(GObject *object)
 {
     GbbPowerMonitor *monitor = GBB_POWER_MONITOR(object);
 
-    g_list_foreach(monitor->batteries, (GFunc)battery_free, NULL);
-    g_list_foreach(monitor->adapters, (GFunc)adapter_free, NULL);
+    monitor_stop_sampler(monitor);
+    close_uevents(monitor);
+
+    if (monitor->notify_watch)
+        g_source_remove(monitor->notify_watch);
+    if (monitor->notify_fd >= 0)
+        close(monitor->notify_fd);
+    if (monitor->wake_fd >= 0)
+        close(monitor->wake_fd);
+
+    g_list_free_full(monitor->batteries, (GDestroyNotify)battery_free);
+    g_list_free_full(monitor->adapters, (GDestroyNotify)adapter_free);
+    g_list_free_full(monitor->rapl_zones, (GDestroyNotify)rapl_zone_free);
+    g_async_queue_unref(monitor->supply_changes);
+    g_free(monitor->sysfs_root);
+    g_mutex_clear(&monitor->stats_lock);
 
     G_OBJECT_CLASS(gbb_power_monitor_parent_class)->finalize(object);
 }
 
+static void
+supply_change_free(SupplyChange *change)
+{
+    g_free(change->description);
+    g_slice_free(SupplyChange, change);
+}
+
 static void
 gbb_power_monitor_init(GbbPowerMonitor *monitor)
 {
+    monitor->supply_changes = g_async_queue_new_full((GDestroyNotify)supply_change_free);
+    g_mutex_init(&monitor->stats_lock);
+    monitor->time_scale = 1.0;
+    monitor->last_power = -1.0;
+    monitor->uevent_fd = -1;
+    monitor->notify_fd = -1;
+    monitor->wake_fd = -1;
 }
 
 static void
@@ -289,6 +988,16 @@ gbb_power_monitor_class_init(GbbPowerMonitorClass *monitor_class)
                       0,
                       NULL, NULL, NULL,
                       G_TYPE_NONE, 0);
+
+    /* Emitted with the time (as in GbbPowerState.time_us) and a description
+     * when a battery or other power supply appears or goes away */
+    signals[SUPPLIES_CHANGED] =
+        g_signal_new ("supplies-changed",
+                      GBB_TYPE_POWER_MONITOR,
+                      G_SIGNAL_RUN_LAST,
+                      0,
+                      NULL, NULL, NULL,
+                      G_TYPE_NONE, 2, G_TYPE_INT64, G_TYPE_STRING);
 }
 
 static void
@@ -303,6 +1012,8 @@ add_to (double *total, double  increment)
 static void
 gbb_power_state_init(GbbPowerState *state)
 {
+    int i;
+
     state->time_us = 0;
     state->online = FALSE;
     state->energy_now = -1.0;
@@ -313,6 +1024,16 @@ gbb_power_state_init(GbbPowerState *state)
     state->charge_full_design = -1.0;
     state->capacity_now = -1.0;
     state->voltage_now = -1.0;
+    state->power_now = -1.0;
+    state->current_now = -1.0;
+    state->energy_integrated = -1.0;
+    state->energy_time_us = 0;
+    state->have_energy_time = FALSE;
+    state->update_period_us = 0;
+    state->n_batteries = 0;
+    state->supplies_serial = 0;
+    for (i = 0; i < GBB_RAPL_N_DOMAINS; i++)
+        state->rapl_energy[i] = -1.0;
 }
 
 GbbPowerState *
@@ -329,139 +1050,1050 @@ gbb_power_state_copy(const GbbPowerState *state)
     return g_slice_dup(GbbPowerState, state);
 }
 
-static GbbPowerState *
-read_state(GbbPowerMonitor *monitor,
-           GbbPowerState   *state)
+static gint64
+monitor_get_time(GbbPowerMonitor *monitor)
 {
-    GList *l;
-    int n_batteries = 0;
+    gint64 now = g_get_monotonic_time();
 
-    gbb_power_state_init(state);
-    state->time_us = g_get_monotonic_time();
+    if (g_atomic_int_get(&monitor->sampling_mode) == GBB_SAMPLING_MODE_MANUAL)
+        return monitor->manual_time_us;
+    else if (monitor->time_scale == 1.0)
+        return now;
+    else
+        return monitor->time_base + (gint64)((now - monitor->time_base) * monitor->time_scale);
+}
+
+/* Energy in WH, converting charge with the current voltage if necessary */
+static gboolean
+battery_get_energy(Battery *battery,
+                   double  *energy_now,
+                   double  *energy_full,
+                   double  *energy_full_design)
+{
+    if (battery->energy_now >= 0) {
+        *energy_now = battery->energy_now;
+        *energy_full = battery->energy_full;
+        *energy_full_design = battery->energy_full_design;
+        return TRUE;
+    } else if (battery->charge_now >= 0 && battery->voltage_now >= 0) {
+        *energy_now = battery->charge_now * battery->voltage_now;
+        *energy_full = battery->charge_full >= 0 ? battery->charge_full * battery->voltage_now : -1;
+        *energy_full_design = battery->charge_full_design >= 0 ? battery->charge_full_design * battery->voltage_now : -1;
+        return TRUE;
+    } else {
+        return FALSE;
+    }
+}
 
-    g_list_foreach (monitor->adapters, (GFunc)adapter_poll, NULL);
-    g_list_foreach (monitor->batteries, (GFunc)battery_poll, NULL);
+/* Returns %TRUE if @value is a change from the last sample. We don't
+ * know when the first value we see appeared, so that isn't an edge */
+static gboolean
+edge_tracker_update(EdgeTracker *tracker,
+                    double       value,
+                    gint64       time_us)
+{
+    gboolean changed = tracker->last_time != 0 && value != tracker->last_value;
 
-    for (l = monitor->adapters; l; l = l->next) {
-        Adapter *adapter = l->data;
-        if (adapter->online)
-            state->online = TRUE;
+    if (changed) {
+        tracker->edge_time = (tracker->last_time + time_us) / 2;
+        tracker->have_edge = TRUE;
     }
 
-    for (l = monitor->batteries; l; l = l->next) {
-        Battery *battery = l->data;
-        if (battery->energy_now >= 0) {
-            add_to (&state->energy_now, battery->energy_now);
-            add_to (&state->energy_full, battery->energy_full);
+    tracker->last_value = value;
+    tracker->last_time = time_us;
 
-            if (battery->energy_full_design >= 0) {
-                if (n_batteries == 0 || state->energy_full_design >= 0)
-                    add_to (&state->energy_full_design, battery->energy_full_design);
-            } else {
-                state->energy_full_design = -1;
-            }
-        } else if (battery->charge_now >= 0) {
-            add_to (&state->charge_now, battery->charge_now);
-            add_to (&state->charge_full, battery->charge_full);
-            add_to (&state->voltage_now, battery->voltage_now);
+    return changed;
+}
+
+static double
+get_counter(double energy_now,
+            double charge_now,
+            double capacity_now)
+{
+    if (energy_now >= 0)
+        return energy_now;
+    else if (charge_now >= 0)
+        return charge_now;
+    else
+        return capacity_now;
+}
+
+static void
+fill_battery_state(Battery         *battery,
+                   GbbBatteryState *battery_state)
+{
+    g_strlcpy(battery_state->name, battery->name, sizeof(battery_state->name));
+    battery_state->energy_now = battery->energy_now;
+    battery_state->energy_full = battery->energy_full;
+    battery_state->energy_full_design = battery->energy_full_design;
+    battery_state->charge_now = battery->charge_now;
+    battery_state->charge_full = battery->charge_full;
+    battery_state->charge_full_design = battery->charge_full_design;
+    battery_state->capacity_now = battery->capacity_now;
+    battery_state->voltage_now = battery->voltage_now;
+    battery_state->power_now = battery->power_now;
+    battery_state->energy_time_us = battery->edges.edge_time;
+    battery_state->have_energy_time = battery->edges.have_edge;
+    battery_state->cycle_count = battery->cycle_count;
+    battery_state->status = battery->status;
+}
+
+/* Fills in the per-battery states, and the combined figures. When all
+ * batteries use the same accounting they are simply summed; otherwise
+ * charge is converted to energy using the voltage, and batteries that
+ * only report a capacity percentage are left out of the total. If a
+ * battery's charge can't be converted, the combined energy and power
+ * are unknown rather than too low.
+ */
+static void
+combine_batteries(GbbPowerMonitor *monitor,
+                  GbbPowerState   *state)
+{
+    int n_energy = 0, n_charge = 0, n_capacity = 0;
+    int n_batteries = 0;
+    GList *l;
+
+    for (l = monitor->batteries; l; l = l->next) {
+        Battery *battery = l->data;
+
+        edge_tracker_update(&battery->edges,
+                            get_counter(battery->energy_now, battery->charge_now, battery->capacity_now),
+                            state->time_us);
+
+        if (battery->energy_now >= 0)
+            n_energy++;
+        else if (battery->charge_now >= 0)
+            n_charge++;
+        else if (battery->capacity_now >= 0)
+            n_capacity++;
+
+        if (n_batteries < GBB_MAX_BATTERIES)
+            fill_battery_state(battery, &state->batteries[n_batteries]);
+        n_batteries++;
+
+        if (battery->power_now >= 0)
+            add_to (&state->power_now, battery->power_now);
+        if (battery->current_now >= 0)
+            add_to (&state->current_now, battery->current_now);
+    }
+
+    state->n_batteries = MIN(n_batteries, GBB_MAX_BATTERIES);
+
+    if (n_capacity > 0 && n_capacity == n_batteries) {
+        for (l = monitor->batteries; l; l = l->next) {
+            Battery *battery = l->data;
+            add_to (&state->capacity_now, battery->capacity_now);
+        }
+        state->capacity_now /= n_capacity;
+        return;
+    }
+
+    if (n_capacity > 0 && !monitor->warned_mixed_batteries) {
+        g_warning("Some batteries only report a capacity percentage; leaving them out of the total");
+        monitor->warned_mixed_batteries = TRUE;
+    }
+
+    gboolean first = TRUE;
+
+    if (n_charge > 0 && n_energy == 0) {
+        for (l = monitor->batteries; l; l = l->next) {
+            Battery *battery = l->data;
+            if (battery->charge_now < 0)
+                continue;
+
+            add_to (&state->charge_now, battery->charge_now);
+            add_to (&state->charge_full, battery->charge_full);
+            add_to (&state->voltage_now, battery->voltage_now);
 
             if (battery->charge_full_design >= 0) {
-                if (n_batteries == 0 || state->charge_full_design >= 0)
+                if (first || state->charge_full_design >= 0)
                     add_to (&state->charge_full_design, battery->charge_full_design);
             } else {
                 state->charge_full_design = -1;
             }
-        } else if (battery->capacity_now >= 0) {
-            add_to (&state->capacity_now, battery->capacity_now);
+
+            first = FALSE;
+        }
+        return;
+    }
+
+    for (l = monitor->batteries; l; l = l->next) {
+        Battery *battery = l->data;
+        double energy_now, energy_full, energy_full_design;
+
+        if (battery->energy_now < 0 && battery->charge_now < 0)
+            continue;
+
+        if (!battery_get_energy(battery, &energy_now, &energy_full, &energy_full_design)) {
+            state->energy_now = state->energy_full = state->energy_full_design = -1;
+            state->power_now = -1;
+            return;
+        }
+
+        add_to (&state->energy_now, energy_now);
+        add_to (&state->energy_full, energy_full);
+
+        if (energy_full_design >= 0) {
+            if (first || state->energy_full_design >= 0)
+                add_to (&state->energy_full_design, energy_full_design);
+        } else {
+            state->energy_full_design = -1;
+        }
+
+        first = FALSE;
+    }
+}
+
+/* Learns when the fuel gauges update their counters, and how often.
+ * The combined figures are made from the batteries' raw counters, and
+ * with mixed accounting change with the voltage, so rather than
+ * watching them, the combined figures are taken to update when every
+ * battery in use has updated. Idle batteries, which some laptops keep
+ * while draining another, are left out. No time is reported until
+ * that first happens.
+ */
+static void
+track_counter_edges(GbbPowerMonitor *monitor,
+                    GbbPowerState   *state)
+{
+    gint64 edge_time = 0;
+    GList *l;
+
+    for (l = monitor->batteries; l; l = l->next) {
+        Battery *battery = l->data;
+
+        if (battery->status == GBB_BATTERY_STATUS_FULL ||
+            battery->status == GBB_BATTERY_STATUS_NOT_CHARGING)
+            continue;
+
+        if (!battery->edges.have_edge || battery->edges.edge_time <= monitor->combined_edge_time) {
+            edge_time = 0;
+            break;
+        }
+
+        edge_time = MAX(edge_time, battery->edges.edge_time);
+    }
+
+    if (edge_time != 0) {
+        if (monitor->have_combined_edge) {
+            gint64 interval = edge_time - monitor->combined_edge_time;
+            gint64 period = monitor->update_period_us;
+
+            /* An update that left the value unchanged looks like a longer
+             * interval; one much shorter means our estimate was too long */
+            if (period == 0 || interval < period / 2) {
+                monitor->update_period_us = interval;
+                monitor->period_confirmations = 0;
+            } else if (interval < period + period / 2) {
+                monitor->update_period_us = (3 * period + interval) / 4;
+                monitor->period_confirmations++;
+            }
         }
 
-        n_batteries += 1;
+        monitor->combined_edge_time = edge_time;
+        monitor->have_combined_edge = TRUE;
+    }
+
+    if (monitor->have_combined_edge) {
+        state->energy_time_us = monitor->combined_edge_time;
+        state->have_energy_time = TRUE;
+        if (monitor->period_confirmations >= EDGE_MIN_CONFIRMATIONS)
+            state->update_period_us = monitor->update_period_us;
+    }
+}
+
+static GbbPowerState *
+read_state(GbbPowerMonitor *monitor,
+           GbbPowerState   *state)
+{
+    GList *l;
+    gint64 start_time = g_get_monotonic_time();
+
+    gbb_power_state_init(state);
+    state->time_us = monitor_get_time(monitor);
+    state->supplies_serial = monitor->supplies_serial;
+
+    monitor->sample_syscalls = 0;
+    g_list_foreach (monitor->adapters, (GFunc)adapter_poll, monitor);
+    g_list_foreach (monitor->batteries, (GFunc)battery_poll, monitor);
+    g_list_foreach (monitor->rapl_zones, (GFunc)rapl_zone_poll, monitor);
+
+    g_mutex_lock(&monitor->stats_lock);
+    monitor->total_syscalls += monitor->sample_syscalls;
+    monitor->total_sample_time_us += g_get_monotonic_time() - start_time;
+    monitor->n_samples++;
+    g_mutex_unlock(&monitor->stats_lock);
+
+    for (l = monitor->adapters; l; l = l->next) {
+        Adapter *adapter = l->data;
+        if (adapter->online)
+            state->online = TRUE;
     }
 
-    if ((state->energy_now >= 0 ? 1 : 0) +
-        (state->charge_now >= 0 ? 1 : 0) +
-        (state->capacity_now >= 0 ? 1 : 0) > 1) {
-        g_error ("Different batteries have different accounting methods");
+    for (l = monitor->rapl_zones; l; l = l->next) {
+        RaplZone *zone = l->data;
+        add_to (&state->rapl_energy[zone->domain], zone->total_energy_uj / 1000000.);
     }
 
-    if (state->capacity_now >= 0)
-        state->capacity_now /= n_batteries;
+    combine_batteries(monitor, state);
+
+    /* If power_now couldn't be read for a while, the gap is bridged by
+     * the trapezoid from the last reading, rather than left out */
+    if (state->power_now >= 0) {
+        if (monitor->last_power >= 0) {
+            double hours = (state->time_us - monitor->last_power_time) / (3600 * 1000000.);
+            monitor->energy_integrated += hours * (monitor->last_power + state->power_now) / 2;
+        }
+        state->energy_integrated = monitor->energy_integrated;
+
+        monitor->last_power = state->power_now;
+        monitor->last_power_time = state->time_us;
+    }
+
+    track_counter_edges(monitor, state);
 
     return state;
 }
 
+/* A kernel uevent is a NUL-separated list of strings: "ACTION@DEVPATH"
+ * followed by KEY=VALUE pairs.
+ */
 static gboolean
-update_timeout(gpointer data)
+uevent_is_power_supply (const char *buf,
+                        gssize      len)
 {
-    GbbPowerMonitor *monitor = data;
-    GbbPowerState state;
-    read_state(monitor, &state);
+    const char *p = buf;
+    const char *end = buf + len;
+
+    while (p < end) {
+        if (strcmp(p, "SUBSYSTEM=power_supply") == 0)
+            return TRUE;
+        p += strlen(p) + 1;
+    }
+
+    return FALSE;
+}
+
+/* Returns TRUE if any of the pending uevents was for a power supply */
+static gboolean
+read_uevents(GbbPowerMonitor *monitor,
+             gboolean        *hotplug)
+{
+    gboolean power_supply_changed = FALSE;
+    char buf[8192];
+
+    while (TRUE) {
+        gssize len = recv(monitor->uevent_fd, buf, sizeof(buf) - 1, 0);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            /* We overflowed the socket buffer and lost events; re-read to be safe */
+            if (errno == ENOBUFS) {
+                power_supply_changed = TRUE;
+                *hotplug = TRUE;
+                continue;
+            }
+            break;
+        }
+
+        buf[len] = '\0';
+        if (uevent_is_power_supply(buf, len)) {
+            power_supply_changed = TRUE;
+            if (g_str_has_prefix(buf, "add@") || g_str_has_prefix(buf, "remove@"))
+                *hotplug = TRUE;
+        }
+    }
+
+    return power_supply_changed;
+}
+
+static void
+close_uevents(GbbPowerMonitor *monitor)
+{
+    if (monitor->uevent_fd >= 0) {
+        close(monitor->uevent_fd);
+        monitor->uevent_fd = -1;
+
+        g_mutex_lock(&monitor->stats_lock);
+        monitor->uevent_time_us += g_get_monotonic_time() - monitor->uevent_start_time;
+        monitor->uevent_start_time = 0;
+        g_mutex_unlock(&monitor->stats_lock);
+    }
+}
+
+static gboolean
+open_uevents(GbbPowerMonitor *monitor,
+             GError         **error)
+{
+    struct sockaddr_nl addr = { 0 };
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+        goto fail;
+
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1; /* kernel uevents, not the ones rebroadcast by udev */
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        int errsv = errno;
+        close(fd);
+        errno = errsv;
+        goto fail;
+    }
+
+    monitor->uevent_fd = fd;
 
-    if (!gbb_power_state_equal(&monitor->current_state, &state)) {
-        monitor->current_state = state;
-        g_signal_emit(monitor, signals[CHANGED], 0);
+    g_mutex_lock(&monitor->stats_lock);
+    monitor->uevent_start_time = g_get_monotonic_time();
+    g_mutex_unlock(&monitor->stats_lock);
+
+    return TRUE;
+
+fail:
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                "Can't listen for uevents: %s", g_strerror(errno));
+    return FALSE;
+}
+
+/* Samples are taken on a separate thread, so that their timestamps don't
+ * depend on how busy the main loop is with event playback, redraws or D-Bus.
+ * The sampler thread is the only writer of ring->head and the main thread
+ * the only writer of ring->tail, so no lock is needed.
+ */
+static gboolean
+ring_push(StateRing           *ring,
+          const GbbPowerState *state)
+{
+    guint head = ring->head;
+    guint tail = g_atomic_int_get(&ring->tail);
+
+    if (head - tail == STATE_RING_SIZE)
+        return FALSE;
+
+    ring->states[head % STATE_RING_SIZE] = *state;
+    g_atomic_int_set(&ring->head, head + 1);
+
+    return TRUE;
+}
+
+/* Returns the oldest queued sample without removing it, or %NULL */
+static const GbbPowerState *
+ring_peek(StateRing *ring)
+{
+    guint tail = ring->tail;
+    guint head = g_atomic_int_get(&ring->head);
+
+    if (head == tail)
+        return NULL;
+
+    return &ring->states[tail % STATE_RING_SIZE];
+}
+
+static gboolean
+ring_pop(StateRing     *ring,
+         GbbPowerState *state)
+{
+    const GbbPowerState *next = ring_peek(ring);
+
+    if (next == NULL)
+        return FALSE;
+
+    *state = *next;
+    g_atomic_int_set(&ring->tail, ring->tail + 1);
+
+    return TRUE;
+}
+
+static void
+eventfd_signal(int fd)
+{
+    guint64 value = 1;
+    while (write(fd, &value, sizeof(value)) < 0 && errno == EINTR)
+        ;
+}
+
+static void
+eventfd_drain(int fd)
+{
+    guint64 value;
+    while (read(fd, &value, sizeof(value)) < 0 && errno == EINTR)
+        ;
+}
+
+/* Called in the sampler thread, which owns the lists of power supplies
+ * once it is running; changes are passed on to the main thread.
+ */
+static void
+rescan_power_supplies(GbbPowerMonitor *monitor)
+{
+    GPtrArray *changes = g_ptr_array_new();
+    GError *error = NULL;
+    guint i;
+
+    if (!update_power_supplies(monitor, changes, &error)) {
+        g_warning("Can't update power supplies: %s", error->message);
+        g_clear_error(&error);
+    }
+
+    if (changes->len > 0) {
+        gint64 time_us = monitor_get_time(monitor);
+
+        monitor->supplies_serial++;
+        /* The combined counters jump, which isn't a fuel gauge update;
+         * the next edge is when all the current batteries have updated */
+        monitor->combined_edge_time = time_us;
+        monitor->have_combined_edge = FALSE;
+
+        for (i = 0; i < changes->len; i++) {
+            SupplyChange *change = g_slice_new(SupplyChange);
+            change->time_us = time_us;
+            change->serial = monitor->supplies_serial;
+            change->description = g_ptr_array_index(changes, i);
+            g_async_queue_push(monitor->supply_changes, change);
+        }
+        eventfd_signal(monitor->notify_fd);
+    }
+
+    g_ptr_array_free(changes, TRUE);
+}
+
+static int
+poll_timeout(gint64 deadline,
+             gint64 now)
+{
+    if (deadline <= now)
+        return 0;
+    else
+        return (deadline - now + 999) / 1000;
+}
+
+/* With the update period known, returns the time for the next sample
+ * so that samples cluster around the next expected counter update;
+ * otherwise keeps to the fixed schedule.
+ */
+static gint64
+schedule_next_sample(GbbPowerMonitor     *monitor,
+                     const GbbPowerState *state,
+                     gint64               next_sample,
+                     gint64               now,
+                     gint64               interval)
+{
+    gint64 period = state->update_period_us;
+
+    /* Stay on a fixed schedule rather than drifting by the time spent sampling */
+    while (next_sample <= now)
+        next_sample += interval;
+
+    if (period == 0)
+        return next_sample;
+
+    gint64 window = MAX(period * EDGE_WINDOW_FRACTION, 2 * UPDATE_FREQUENCY * 1000);
+    if (2 * window >= period)
+        return next_sample;
+
+    gint64 expected = state->energy_time_us + period;
+    while (expected + window < state->time_us)
+        expected += period;
+
+    /* Convert from the (possibly scaled) sample clock to real time */
+    gint64 window_start = now + (expected - window - state->time_us) / monitor->time_scale;
+    gint64 window_end = now + (expected + window - state->time_us) / monitor->time_scale;
+
+    if (now >= window_start && now < window_end)
+        return now + EDGE_SAMPLE_INTERVAL * 1000 / monitor->time_scale;
+
+    /* power_now and RAPL readings still want the regular schedule */
+    if (state->power_now < 0 && monitor->rapl_zones == NULL)
+        next_sample = now + EDGE_RELAXED_FACTOR * interval;
+
+    return MIN(next_sample, MAX(window_start, now));
+}
+
+static void
+count_uevent_wakeup(GbbPowerMonitor *monitor)
+{
+    g_mutex_lock(&monitor->stats_lock);
+    monitor->uevent_wakeups++;
+    g_mutex_unlock(&monitor->stats_lock);
+}
+
+typedef struct {
+    GbbPowerMonitor *monitor;
+    GbbPowerState last_state; /* Copied from the main thread's state before starting */
+} SamplerData;
+
+static gpointer
+sampler_thread(gpointer data)
+{
+    SamplerData *sampler_data = data;
+    GbbPowerMonitor *monitor = sampler_data->monitor;
+    GbbPowerState last_state = sampler_data->last_state;
+    gint64 interval = UPDATE_FREQUENCY * 1000 / monitor->time_scale;
+    gint64 next_sample = g_get_monotonic_time() + interval;
+    /* Like the sampling interval, the probe runs on the (possibly scaled) sample clock */
+    gint64 probe_deadline = g_get_monotonic_time() + UEVENT_PROBE_TIMEOUT * G_USEC_PER_SEC / monitor->time_scale;
+    gint64 next_rescan = g_get_monotonic_time() + RESCAN_INTERVAL * G_USEC_PER_SEC;
+
+    while (!g_atomic_int_get(&monitor->sampler_stop)) {
+        GbbSamplingMode mode = g_atomic_int_get(&monitor->sampling_mode);
+        gboolean do_sample = FALSE;
+        gboolean hotplug = FALSE;
+        struct pollfd fds[2];
+        int n_fds = 0;
+        int timeout = -1;
+        gint64 now;
+
+        fds[n_fds].fd = monitor->wake_fd;
+        fds[n_fds].events = POLLIN;
+        n_fds++;
+        if (monitor->uevent_fd >= 0) {
+            fds[n_fds].fd = monitor->uevent_fd;
+            fds[n_fds].events = POLLIN;
+            n_fds++;
+        }
+
+        now = g_get_monotonic_time();
+        if (mode == GBB_SAMPLING_MODE_TIMER)
+            timeout = poll_timeout(MIN(next_sample, next_rescan), now);
+        else
+            timeout = poll_timeout(probe_deadline, now);
+
+        if (poll(fds, n_fds, timeout) < 0 && errno != EINTR)
+            g_error("Error waiting to sample power supplies: %s", g_strerror(errno));
+
+        now = g_get_monotonic_time();
+
+        if (fds[0].revents & POLLIN)
+            eventfd_drain(monitor->wake_fd);
+
+        if (n_fds > 1 && (fds[1].revents & POLLIN)) {
+            count_uevent_wakeup(monitor);
+            if (read_uevents(monitor, &hotplug)) {
+                /* A driver might only ever send one, so keep checking */
+                probe_deadline = now + UEVENT_PROBE_TIMEOUT * G_USEC_PER_SEC / monitor->time_scale;
+                do_sample = TRUE;
+            }
+        }
+
+        if (mode == GBB_SAMPLING_MODE_UEVENT && now >= probe_deadline) {
+            g_warning("No power supply uevents received in %d seconds, polling instead",
+                      UEVENT_PROBE_TIMEOUT);
+            count_uevent_wakeup(monitor);
+            close_uevents(monitor);
+            mode = GBB_SAMPLING_MODE_TIMER;
+            g_atomic_int_set(&monitor->sampling_mode, mode);
+            next_sample = now;
+        }
+
+        if (mode == GBB_SAMPLING_MODE_TIMER && now >= next_sample)
+            do_sample = TRUE;
+
+        /* With uevents, we hear about power supplies being added and removed */
+        if (monitor->uevent_fd < 0 && now >= next_rescan) {
+            hotplug = TRUE;
+            next_rescan = now + RESCAN_INTERVAL * G_USEC_PER_SEC;
+        }
+
+        if (hotplug) {
+            rescan_power_supplies(monitor);
+            do_sample = TRUE;
+        }
+
+        if (do_sample) {
+            GbbPowerState state;
+            read_state(monitor, &state);
+
+            if (mode == GBB_SAMPLING_MODE_TIMER)
+                next_sample = schedule_next_sample(monitor, &state, next_sample, now, interval);
+
+            if (!gbb_power_state_equal(&last_state, &state)) {
+                last_state = state;
+                if (ring_push(&monitor->ring, &state)) {
+                    eventfd_signal(monitor->notify_fd);
+                } else {
+                    g_mutex_lock(&monitor->stats_lock);
+                    monitor->dropped_samples++;
+                    g_mutex_unlock(&monitor->stats_lock);
+                }
+            }
+        }
+    }
+
+    g_slice_free(SamplerData, sampler_data);
+
+    return NULL;
+}
+
+static gboolean
+on_samples_ready(gint         fd,
+                 GIOCondition condition,
+                 gpointer     data)
+{
+    GbbPowerMonitor *monitor = data;
+    SupplyChange *change = NULL;
+
+    eventfd_drain(fd);
+
+    /* Samples still queued from before a change are passed on before
+     * it. The sampler queues a change before any sample taken after it,
+     * so a sample from after the change means the change can be seen. */
+    while (TRUE) {
+        const GbbPowerState *next = ring_peek(&monitor->ring);
+
+        if (change == NULL)
+            change = g_async_queue_try_pop(monitor->supply_changes);
+
+        if (change && (next == NULL || next->supplies_serial >= change->serial)) {
+            g_signal_emit(monitor, signals[SUPPLIES_CHANGED], 0, change->time_us, change->description);
+            g_clear_pointer(&change, supply_change_free);
+        } else if (next != NULL) {
+            ring_pop(&monitor->ring, &monitor->current_state);
+            g_signal_emit(monitor, signals[CHANGED], 0);
+        } else {
+            break;
+        }
     }
 
     return G_SOURCE_CONTINUE;
 }
 
+static void
+monitor_start_sampler(GbbPowerMonitor *monitor)
+{
+    if (monitor->sampling_mode == GBB_SAMPLING_MODE_MANUAL)
+        return;
+
+    SamplerData *sampler_data = g_slice_new(SamplerData);
+    sampler_data->monitor = monitor;
+    sampler_data->last_state = monitor->current_state;
+
+    g_atomic_int_set(&monitor->sampler_stop, FALSE);
+    monitor->sampler = g_thread_new("gbb-power-sampler", sampler_thread, sampler_data);
+}
+
+static void
+monitor_stop_sampler(GbbPowerMonitor *monitor)
+{
+    if (!monitor->sampler)
+        return;
+
+    g_atomic_int_set(&monitor->sampler_stop, TRUE);
+    eventfd_signal(monitor->wake_fd);
+    g_thread_join(monitor->sampler);
+    monitor->sampler = NULL;
+}
+
+/**
+ * gbb_power_monitor_new_for_root:
+ * @sysfs_root: directory to use in place of /sys
+ *
+ * Creates a power monitor that looks for power supplies and RAPL zones
+ * under @sysfs_root/class; this allows running against a simulated
+ * sysfs tree such as the one created by #GbbPowerSimulator.
+ */
 GbbPowerMonitor *
-gbb_power_monitor_new(void)
+gbb_power_monitor_new_for_root(const char *sysfs_root)
 {
     GbbPowerMonitor *monitor = g_object_new(GBB_TYPE_POWER_MONITOR, NULL);
     GError *error = NULL;
 
-    if (!find_power_supplies(monitor, NULL, &error))
+    monitor->sysfs_root = g_strdup(sysfs_root);
+
+    if (!update_power_supplies(monitor, NULL, &error))
         g_error("%s\n", error->message);
 
+    char *powercap_path = g_build_filename(sysfs_root, "class", "powercap", NULL);
+    find_rapl_zones(monitor, powercap_path);
+    g_free(powercap_path);
+
     read_state(monitor, &monitor->current_state);
-    monitor->update_timeout = g_timeout_add(UPDATE_FREQUENCY, update_timeout, monitor);
+
+    monitor->notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    monitor->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (monitor->notify_fd < 0 || monitor->wake_fd < 0)
+        g_error("Can't create eventfd: %s", g_strerror(errno));
+
+    monitor->notify_watch = g_unix_fd_add(monitor->notify_fd, G_IO_IN, on_samples_ready, monitor);
+
+    monitor->sampling_mode = GBB_SAMPLING_MODE_TIMER;
+    monitor_start_sampler(monitor);
 
     return monitor;
 }
 
+/* $GBB_SYSFS_ROOT allows pointing the whole application at a fake sysfs tree */
+GbbPowerMonitor *
+gbb_power_monitor_new(void)
+{
+    const char *sysfs_root = g_getenv("GBB_SYSFS_ROOT");
+
+    return gbb_power_monitor_new_for_root(sysfs_root ? sysfs_root : "/sys");
+}
+
+/* Makes sample timestamps, and the sampling interval, run @time_scale times
+ * faster than real time, to match a #GbbPowerSimulator running accelerated.
+ */
+void
+gbb_power_monitor_set_time_scale (GbbPowerMonitor *monitor,
+                                  double           time_scale)
+{
+    g_return_if_fail(time_scale > 0);
+
+    monitor_stop_sampler(monitor);
+
+    monitor->time_base = g_get_monotonic_time();
+    monitor->time_scale = time_scale;
+
+    monitor_start_sampler(monitor);
+}
+
+/* Reads each battery's uevent file, which has all the values in one
+ * read, instead of the individual attribute files.
+ */
+void
+gbb_power_monitor_set_read_uevent_files (GbbPowerMonitor *monitor,
+                                         gboolean         read_uevent_files)
+{
+    monitor_stop_sampler(monitor);
+    monitor->read_uevent_files = read_uevent_files != FALSE;
+    monitor_start_sampler(monitor);
+}
+
+void
+gbb_power_monitor_set_sampling_mode (GbbPowerMonitor *monitor,
+                                     GbbSamplingMode  mode)
+{
+    if (mode == g_atomic_int_get(&monitor->sampling_mode))
+        return;
+
+    monitor_stop_sampler(monitor);
+    close_uevents(monitor);
+
+    if (mode == GBB_SAMPLING_MODE_UEVENT) {
+        GError *error = NULL;
+        if (!open_uevents(monitor, &error)) {
+            g_warning("%s, polling instead", error->message);
+            g_clear_error(&error);
+            mode = GBB_SAMPLING_MODE_TIMER;
+        }
+    }
+
+    monitor->sampling_mode = mode;
+    monitor_start_sampler(monitor);
+}
+
+GbbSamplingMode
+gbb_power_monitor_get_sampling_mode (GbbPowerMonitor *monitor)
+{
+    return g_atomic_int_get(&monitor->sampling_mode);
+}
+
+/**
+ * gbb_power_monitor_sample:
+ * @monitor: a #GbbPowerMonitor in %GBB_SAMPLING_MODE_MANUAL
+ * @time_us: time to give the sample
+ *
+ * Reads the power supplies straight away, in the calling thread, and
+ * timestamps the state with @time_us. This lets tests feed a sequence
+ * of readings at known times, without waiting for a sampler thread.
+ */
+void
+gbb_power_monitor_sample (GbbPowerMonitor *monitor,
+                          gint64           time_us)
+{
+    g_return_if_fail(monitor->sampling_mode == GBB_SAMPLING_MODE_MANUAL);
+
+    monitor->manual_time_us = time_us;
+    read_state(monitor, &monitor->current_state);
+    g_signal_emit(monitor, signals[CHANGED], 0);
+}
+
+/* The number of times that the timer would have woken us up while we were
+ * waiting for uevents, minus the number of times that we actually woke up.
+ */
+gint64
+gbb_power_monitor_get_saved_wakeups (GbbPowerMonitor *monitor)
+{
+    g_mutex_lock(&monitor->stats_lock);
+    gint64 uevent_time_us = monitor->uevent_time_us;
+    if (monitor->uevent_start_time != 0)
+        uevent_time_us += g_get_monotonic_time() - monitor->uevent_start_time;
+    gint64 uevent_wakeups = monitor->uevent_wakeups;
+    g_mutex_unlock(&monitor->stats_lock);
+
+    return uevent_time_us / (UPDATE_FREQUENCY * 1000) - uevent_wakeups;
+}
+
+/* Returns the learned interval between fuel gauge updates in seconds,
+ * or -1 if it isn't known yet.
+ */
+double
+gbb_power_monitor_get_update_period (GbbPowerMonitor *monitor)
+{
+    if (monitor->current_state.update_period_us == 0)
+        return -1;
+
+    return monitor->current_state.update_period_us / 1000000.;
+}
+
 const GbbPowerState *
 gbb_power_monitor_get_state (GbbPowerMonitor *monitor)
 {
     return &monitor->current_state;
 }
 
+/* @dropped_samples is the number of samples lost because the main
+ * loop fell too far behind in handling them */
+void
+gbb_power_monitor_get_sampling_cost (GbbPowerMonitor *monitor,
+                                     double          *syscalls_per_sample,
+                                     double          *usec_per_sample,
+                                     guint64         *dropped_samples)
+{
+    g_mutex_lock(&monitor->stats_lock);
+    guint64 n_samples = MAX(monitor->n_samples, 1);
+
+    if (syscalls_per_sample)
+        *syscalls_per_sample = (double)monitor->total_syscalls / n_samples;
+    if (usec_per_sample)
+        *usec_per_sample = (double)monitor->total_sample_time_us / n_samples;
+    if (dropped_samples)
+        *dropped_samples = monitor->dropped_samples;
+    g_mutex_unlock(&monitor->stats_lock);
+}
+
+static const char * const power_estimator_names[] = {
+    "energy",
+    "integrated"
+};
+
+const char *
+gbb_power_estimator_get_name (GbbPowerEstimator estimator)
+{
+    g_return_val_if_fail(estimator < G_N_ELEMENTS(power_estimator_names), NULL);
+
+    return power_estimator_names[estimator];
+}
+
+gboolean
+gbb_power_estimator_from_name (const char        *name,
+                               GbbPowerEstimator *estimator)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(power_estimator_names); i++) {
+        if (strcmp(name, power_estimator_names[i]) == 0) {
+            *estimator = i;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
 GbbPowerStatistics *
 gbb_power_statistics_compute (const GbbPowerState   *base,
                               const GbbPowerState   *current)
+{
+    return gbb_power_statistics_compute_with_estimator(base, current, GBB_POWER_ESTIMATOR_ENERGY);
+}
+
+/* With GBB_POWER_ESTIMATOR_INTEGRATED, power and the battery life
+ * predictions come from the integrated instantaneous power when the
+ * battery reports it, falling back to the energy or charge counters.
+ */
+GbbPowerStatistics *
+gbb_power_statistics_compute_with_estimator (const GbbPowerState *base,
+                                             const GbbPowerState *current,
+                                             GbbPowerEstimator    estimator)
 {
     GbbPowerStatistics *statistics = g_slice_new(GbbPowerStatistics);
     statistics->power = -1;
     statistics->current = -1;
+    statistics->power_integrated = -1;
     statistics->battery_life = -1;
     statistics->battery_life_design = -1;
 
     double time_elapsed = (current->time_us - base->time_us) / 1000000.;
 
-    if (current->energy_now >= 0 && time_elapsed > 0) {
+    /* The counters are measured between the times their values appeared */
+    double counter_time_elapsed = time_elapsed;
+    if (base->have_energy_time && current->have_energy_time)
+        counter_time_elapsed = (current->energy_time_us - base->energy_time_us) / 1000000.;
+
+    int i;
+    for (i = 0; i < GBB_RAPL_N_DOMAINS; i++) {
+        if (base->rapl_energy[i] >= 0 && current->rapl_energy[i] >= 0 && time_elapsed > 0)
+            statistics->rapl_power[i] = (current->rapl_energy[i] - base->rapl_energy[i]) / time_elapsed;
+        else
+            statistics->rapl_power[i] = -1;
+    }
+
+    /* Each battery's fuel gauge updates on its own schedule */
+    for (i = 0; i < GBB_MAX_BATTERIES; i++) {
+        statistics->battery_power[i] = -1;
+        if (i >= base->n_batteries || i >= current->n_batteries)
+            continue;
+
+        const GbbBatteryState *base_battery = &base->batteries[i];
+        const GbbBatteryState *current_battery = &current->batteries[i];
+        double battery_time_elapsed = counter_time_elapsed;
+        if (base_battery->have_energy_time && current_battery->have_energy_time)
+            battery_time_elapsed = (current_battery->energy_time_us - base_battery->energy_time_us) / 1000000.;
+        if (battery_time_elapsed <= 0)
+            continue;
+
+        double base_energy = gbb_battery_state_get_energy(base_battery);
+        double current_energy = gbb_battery_state_get_energy(current_battery);
+        if (base_energy >= 0 && current_energy >= 0 &&
+            strcmp(base_battery->name, current_battery->name) == 0)
+            statistics->battery_power[i] = 3600 * (base_energy - current_energy) / battery_time_elapsed;
+    }
+
+    if (base->energy_integrated >= 0 && current->energy_integrated >= 0 && time_elapsed > 0)
+        statistics->power_integrated = 3600 * (current->energy_integrated - base->energy_integrated) / time_elapsed;
+
+    if (estimator == GBB_POWER_ESTIMATOR_INTEGRATED && statistics->power_integrated > 0) {
+        statistics->power = statistics->power_integrated;
+
+        double energy_full = -1, energy_full_design = -1;
+        if (base->energy_full >= 0) {
+            energy_full = base->energy_full;
+            energy_full_design = base->energy_full_design;
+        } else if (base->charge_full >= 0 && base->voltage_now >= 0) {
+            energy_full = base->charge_full * base->voltage_now;
+            if (base->charge_full_design >= 0)
+                energy_full_design = base->charge_full_design * base->voltage_now;
+        }
+
+        if (energy_full >= 0)
+            statistics->battery_life = 3600 * energy_full / statistics->power;
+        if (energy_full_design >= 0)
+            statistics->battery_life_design = 3600 * energy_full_design / statistics->power;
+    } else if (current->energy_now >= 0 && counter_time_elapsed > 0) {
         double energy_used = base->energy_now - current->energy_now;
         if (energy_used > 0) {
-            statistics->power = 3600 * (energy_used) / time_elapsed;
+            statistics->power = 3600 * (energy_used) / counter_time_elapsed;
             if (base->energy_full >= 0)
                 statistics->battery_life = 3600 * base->energy_full / statistics->power;
             if (base->energy_full_design >= 0)
                 statistics->battery_life_design = 3600 * base->energy_full_design / statistics->power;
         }
-    } else if (current->charge_now >= 0 && time_elapsed > 0) {
+    } else if (current->charge_now >= 0 && counter_time_elapsed > 0) {
         double charge_used = base->charge_now - current->charge_now;
         double energy_used = base->charge_now * base->voltage_now - current->charge_now * current->voltage_now;
         if (charge_used > 0) {
-            statistics->current = 3600 * (charge_used) / time_elapsed;
-            statistics->power = 3600 * (energy_used) / time_elapsed;
+            statistics->current = 3600 * (charge_used) / counter_time_elapsed;
+            statistics->power = 3600 * (energy_used) / counter_time_elapsed;
             if (base->charge_full >= 0)
                 statistics->battery_life = 3600 * base->charge_full / statistics->current;
             if (base->charge_full_design >= 0)
                 statistics->battery_life_design = 3600 * base->charge_full_design / statistics->current;
         }
-    } else if (current->capacity_now >= 0 && time_elapsed > 0) {
+    } else if (current->capacity_now >= 0 && counter_time_elapsed > 0) {
         double capacity_used = base->capacity_now - current->capacity_now;
         if (capacity_used > 0)
-            statistics->battery_life = 3600 * time_elapsed / capacity_used;
+            statistics->battery_life = 3600 * counter_time_elapsed / capacity_used;
     }
 
     return statistics;
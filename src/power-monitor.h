@@ -5,6 +5,7 @@
 
 typedef struct _GbbPowerMonitor      GbbPowerMonitor;
 typedef struct _GbbPowerMonitorClass GbbPowerMonitorClass;
+typedef struct _GbbBatteryState      GbbBatteryState;
 typedef struct _GbbPowerState        GbbPowerState;
 typedef struct _GbbPowerStatistics   GbbPowerStatistics;
 
@@ -15,6 +16,60 @@ typedef struct _GbbPowerStatistics   GbbPowerStatistics;
 #define GBB_IS_POWER_MONITOR_CLASS(k)  (G_TYPE_CHECK_CLASS_TYPE ((k), GBB_TYPE_POWER_MONITOR))
 #define GBB_POWER_MONITOR_GET_CLASS(o) (G_TYPE_INSTANCE_GET_CLASS ((o), GBB_TYPE_POWER_MONITOR, GbbPowerMonitorClass))
 
+typedef enum {
+    GBB_SAMPLING_MODE_TIMER,  /* Poll the power supplies at a fixed interval */
+    GBB_SAMPLING_MODE_UEVENT, /* Re-read only when the kernel reports a change */
+    GBB_SAMPLING_MODE_MANUAL  /* Read only in gbb_power_monitor_sample(), for tests */
+} GbbSamplingMode;
+
+/* Running Average Power Limit domains reported by /sys/class/powercap */
+typedef enum {
+    GBB_RAPL_PACKAGE,
+    GBB_RAPL_CORE,
+    GBB_RAPL_UNCORE,
+    GBB_RAPL_DRAM,
+    GBB_RAPL_N_DOMAINS
+} GbbRaplDomain;
+
+/* How gbb_power_statistics_compute_with_estimator() derives the power */
+typedef enum {
+    GBB_POWER_ESTIMATOR_ENERGY,     /* Differences of energy_now or charge_now */
+    GBB_POWER_ESTIMATOR_INTEGRATED  /* Integral of power_now or current_now * voltage_now */
+} GbbPowerEstimator;
+
+/* As reported by the kernel in the status attribute */
+typedef enum {
+    GBB_BATTERY_STATUS_UNKNOWN,
+    GBB_BATTERY_STATUS_CHARGING,
+    GBB_BATTERY_STATUS_DISCHARGING,
+    GBB_BATTERY_STATUS_NOT_CHARGING,
+    GBB_BATTERY_STATUS_FULL
+} GbbBatteryStatus;
+
+/* Batteries beyond this are still included in the combined figures */
+#define GBB_MAX_BATTERIES 4
+
+/* The readings of a single battery; unlike the combined figures in
+ * GbbPowerState, exactly one of energy, charge and capacity is set.
+ */
+struct _GbbBatteryState {
+    char name[16];
+    double energy_now; /* WH */
+    double energy_full;
+    double energy_full_design;
+    double charge_now; /* AH */
+    double charge_full;
+    double charge_full_design;
+    double capacity_now; /* 0 - 1.0 */
+    double voltage_now;
+    double power_now; /* W, instantaneous */
+    gint64 energy_time_us; /* When this battery's energy/charge/capacity value appeared */
+    gboolean have_energy_time;
+    /* Only known when reading uevent files */
+    int cycle_count;
+    GbbBatteryStatus status;
+};
+
 struct _GbbPowerState {
     gint64 time_us;
     gboolean online;
@@ -26,6 +81,20 @@ struct _GbbPowerState {
     double charge_full_design;
     double capacity_now; /* 0 - 1.0 */
     double voltage_now;
+    double power_now; /* W, instantaneous */
+    double current_now; /* A, instantaneous */
+    double energy_integrated; /* WH, integral of power_now since the monitor was created */
+    gint64 energy_time_us; /* When the current energy/charge/capacity value appeared */
+    gboolean have_energy_time; /* FALSE until a fuel gauge update has been seen */
+    gint64 update_period_us; /* Learned interval between fuel gauge updates, or 0 */
+    /* When batteries use different accounting, the combined figures are
+     * energy, with charge converted using the voltage */
+    int n_batteries;
+    GbbBatteryState batteries[GBB_MAX_BATTERIES];
+    /* Changes whenever power supplies are added or removed; statistics
+     * across such a change are not meaningful */
+    guint supplies_serial;
+    double rapl_energy[GBB_RAPL_N_DOMAINS]; /* J, since the monitor was created */
 };
 
 struct _GbbPowerStatistics {
@@ -33,24 +102,63 @@ struct _GbbPowerStatistics {
     double power; /* W */
     double current; /* A */
 
+    /* From energy_integrated, whichever estimator was used for power */
+    double power_integrated; /* W */
+
     double battery_life;
     double battery_life_design;
+
+    double rapl_power[GBB_RAPL_N_DOMAINS]; /* W */
+    double battery_power[GBB_MAX_BATTERIES]; /* W, for each of base->batteries */
 };
 
 GType               gbb_power_monitor_get_type(void);
 
-GbbPowerMonitor    *gbb_power_monitor_new        (void);
+GbbPowerMonitor    *gbb_power_monitor_new          (void);
+GbbPowerMonitor    *gbb_power_monitor_new_for_root (const char *sysfs_root);
+
+void                gbb_power_monitor_set_time_scale (GbbPowerMonitor *monitor,
+                                                      double           time_scale);
 
 const GbbPowerState *gbb_power_monitor_get_state (GbbPowerMonitor *monitor);
 
+void                gbb_power_monitor_get_sampling_cost (GbbPowerMonitor *monitor,
+                                                         double          *syscalls_per_sample,
+                                                         double          *usec_per_sample,
+                                                         guint64         *dropped_samples);
+
+void                gbb_power_monitor_set_sampling_mode (GbbPowerMonitor *monitor,
+                                                         GbbSamplingMode  mode);
+GbbSamplingMode     gbb_power_monitor_get_sampling_mode (GbbPowerMonitor *monitor);
+void                gbb_power_monitor_sample            (GbbPowerMonitor *monitor,
+                                                         gint64           time_us);
+void                gbb_power_monitor_set_read_uevent_files (GbbPowerMonitor *monitor,
+                                                             gboolean         read_uevent_files);
+gint64              gbb_power_monitor_get_saved_wakeups (GbbPowerMonitor *monitor);
+double              gbb_power_monitor_get_update_period (GbbPowerMonitor *monitor);
+
 GbbPowerState      *gbb_power_state_new          (void);
 GbbPowerState      *gbb_power_state_copy         (const GbbPowerState   *state);
 void                gbb_power_state_free         (GbbPowerState         *state);
 
 double              gbb_power_state_get_percent  (const GbbPowerState   *state);
+double              gbb_battery_state_get_energy (const GbbBatteryState *battery);
+
+const char         *gbb_battery_status_get_name    (GbbBatteryStatus  status);
+GbbBatteryStatus    gbb_battery_status_from_string (const char       *str,
+                                                    gsize             len);
+
+const char         *gbb_rapl_domain_get_name     (GbbRaplDomain          domain);
+
+const char         *gbb_power_estimator_get_name (GbbPowerEstimator      estimator);
+gboolean            gbb_power_estimator_from_name(const char            *name,
+                                                  GbbPowerEstimator     *estimator);
 
 GbbPowerStatistics *gbb_power_statistics_compute (const GbbPowerState   *base,
                                                   const GbbPowerState   *current);
+GbbPowerStatistics *gbb_power_statistics_compute_with_estimator (const GbbPowerState *base,
+                                                                 const GbbPowerState *current,
+                                                                 GbbPowerEstimator    estimator);
 void                gbb_power_statistics_free    (GbbPowerStatistics *statistics);
 
 #endif /*__POWER_MONITOR_H__ */
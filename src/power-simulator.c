@@ -0,0 +1,537 @@
+/* -*- mode: C; c-file-style: "stroustrup"; indent-tabs-mode: nil; -*- */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "power-simulator.h"
+
+/* Simulated time advances in the main loop at this interval (ms) */
+#define TICK_INTERVAL 5
+
+/* Each file is rewritten in place with a fixed-width value, so readers
+ * that keep the file open and pread() it always see a complete number.
+ */
+#define VALUE_WIDTH 20
+
+typedef enum {
+    COMMAND_ENERGY_FULL_DESIGN,
+    COMMAND_ENERGY_FULL,
+    COMMAND_ENERGY,
+    COMMAND_DRAIN,
+    COMMAND_UPDATE_PERIOD,
+    COMMAND_QUANTUM,
+    COMMAND_AC,
+    COMMAND_END
+} CommandType;
+
+static const char *command_names[] = {
+    "energy-full-design",
+    "energy-full",
+    "energy",
+    "drain",
+    "update-period",
+    "quantum",
+    "ac",
+    "end"
+};
+
+typedef struct {
+    double time;
+    CommandType type;
+    double value;
+} Command;
+
+typedef struct {
+    int fd;
+    gint64 value;
+} Attribute;
+
+typedef enum {
+    ATTRIBUTE_ENERGY_NOW,
+    ATTRIBUTE_ENERGY_FULL,
+    ATTRIBUTE_ENERGY_FULL_DESIGN,
+    ATTRIBUTE_POWER_NOW,
+    ATTRIBUTE_ONLINE,
+    N_ATTRIBUTES
+} AttributeType;
+
+struct _GbbPowerSimulator {
+    char *sysfs_root;
+    GPtrArray *created_paths;
+    Attribute attributes[N_ATTRIBUTES];
+    int uevent_fd;
+    gboolean uevent_dirty;
+
+    GArray *commands;
+    guint next_command;
+
+    double time_scale;
+    gint64 start_time;
+    guint timeout_id;
+
+    /* Simulated state; times are in simulated seconds, energies in Wh */
+    double time;
+    double energy;
+    double energy_full;
+    double energy_full_design;
+    double drain;
+    double update_period;
+    double next_update;
+    double quantum;
+    gboolean online;
+};
+
+static gboolean
+parse_script(GbbPowerSimulator *simulator,
+             const char        *script_file,
+             GError           **error)
+{
+    char *contents;
+    char **lines;
+    int i;
+    gboolean result = FALSE;
+
+    if (!g_file_get_contents(script_file, &contents, NULL, error))
+        return FALSE;
+
+    lines = g_strsplit(contents, "\n", -1);
+    for (i = 0; lines[i]; i++) {
+        char *comment = strchr(lines[i], '#');
+        if (comment)
+            *comment = '\0';
+
+        char *line = g_strstrip(lines[i]);
+        if (*line == '\0')
+            continue;
+
+        char **fields = g_strsplit(line, ",", -1);
+        Command command = { 0, };
+        char *end;
+        guint j;
+        gboolean found = FALSE;
+
+        if (g_strv_length(fields) < 2)
+            goto bad_line;
+
+        command.time = g_ascii_strtod(fields[0], &end);
+        if (end == fields[0] || command.time < 0)
+            goto bad_line;
+
+        for (j = 0; j < G_N_ELEMENTS(command_names); j++) {
+            if (strcmp(g_strstrip(fields[1]), command_names[j]) == 0) {
+                command.type = j;
+                found = TRUE;
+            }
+        }
+        if (!found)
+            goto bad_line;
+
+        if (command.type != COMMAND_END) {
+            if (fields[2] == NULL)
+                goto bad_line;
+            command.value = g_ascii_strtod(fields[2], &end);
+            if (end == fields[2])
+                goto bad_line;
+        }
+
+        if (simulator->commands->len > 0 &&
+            command.time < g_array_index(simulator->commands, Command, simulator->commands->len - 1).time)
+            goto bad_line;
+
+        g_array_append_val(simulator->commands, command);
+        g_strfreev(fields);
+        continue;
+
+    bad_line:
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                    "%s:%d: Can't parse '%s'", script_file, i + 1, line);
+        g_strfreev(fields);
+        goto out;
+    }
+
+    result = TRUE;
+
+out:
+    g_strfreev(lines);
+    g_free(contents);
+
+    return result;
+}
+
+static gboolean
+make_directory(GbbPowerSimulator *simulator,
+               const char        *path,
+               GError           **error)
+{
+    if (g_mkdir(path, 0755) < 0) {
+        int errsv = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+                    "Can't create %s: %s", path, g_strerror(errsv));
+        return FALSE;
+    }
+
+    g_ptr_array_add(simulator->created_paths, g_strdup(path));
+
+    return TRUE;
+}
+
+static void
+write_attribute(GbbPowerSimulator *simulator,
+                AttributeType      type,
+                gint64             value)
+{
+    Attribute *attribute = &simulator->attributes[type];
+    char buf[VALUE_WIDTH + 2];
+
+    if (value == attribute->value)
+        return;
+
+    attribute->value = value;
+    simulator->uevent_dirty = TRUE;
+    g_snprintf(buf, sizeof(buf), "%-" G_STRINGIFY(VALUE_WIDTH) G_GINT64_FORMAT "\n", value);
+
+    if (pwrite(attribute->fd, buf, VALUE_WIDTH + 1, 0) < 0)
+        g_warning("Error writing simulated attribute: %s", g_strerror(errno));
+}
+
+static gboolean
+create_attribute(GbbPowerSimulator *simulator,
+                 AttributeType      type,
+                 const char        *directory,
+                 const char        *name,
+                 GError           **error)
+{
+    char *path = g_build_filename(directory, name, NULL);
+    Attribute *attribute = &simulator->attributes[type];
+
+    attribute->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (attribute->fd < 0) {
+        int errsv = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+                    "Can't create %s: %s", path, g_strerror(errsv));
+        g_free(path);
+        return FALSE;
+    }
+
+    g_ptr_array_add(simulator->created_paths, path);
+
+    attribute->value = -1;
+    write_attribute(simulator, type, 0);
+
+    return TRUE;
+}
+
+/* The battery's uevent file repeats all the values, with fixed-width
+ * lines so it can be rewritten with a single pwrite().
+ */
+static void
+write_uevent(GbbPowerSimulator *simulator)
+{
+    Attribute *attributes = simulator->attributes;
+    char *contents;
+
+    if (simulator->uevent_fd < 0 || !simulator->uevent_dirty)
+        return;
+
+    simulator->uevent_dirty = FALSE;
+
+    contents = g_strdup_printf("POWER_SUPPLY_NAME=BAT0\n"
+                               "POWER_SUPPLY_TYPE=Battery\n"
+                               "POWER_SUPPLY_STATUS=%-12s\n"
+                               "POWER_SUPPLY_ENERGY_NOW=%-" G_STRINGIFY(VALUE_WIDTH) G_GINT64_FORMAT "\n"
+                               "POWER_SUPPLY_ENERGY_FULL=%-" G_STRINGIFY(VALUE_WIDTH) G_GINT64_FORMAT "\n"
+                               "POWER_SUPPLY_ENERGY_FULL_DESIGN=%-" G_STRINGIFY(VALUE_WIDTH) G_GINT64_FORMAT "\n"
+                               "POWER_SUPPLY_POWER_NOW=%-" G_STRINGIFY(VALUE_WIDTH) G_GINT64_FORMAT "\n",
+                               attributes[ATTRIBUTE_ONLINE].value ? "Not charging" : "Discharging",
+                               attributes[ATTRIBUTE_ENERGY_NOW].value,
+                               attributes[ATTRIBUTE_ENERGY_FULL].value,
+                               attributes[ATTRIBUTE_ENERGY_FULL_DESIGN].value,
+                               attributes[ATTRIBUTE_POWER_NOW].value);
+
+    if (pwrite(simulator->uevent_fd, contents, strlen(contents), 0) < 0)
+        g_warning("Error writing simulated uevent file: %s", g_strerror(errno));
+
+    g_free(contents);
+}
+
+static gboolean
+create_uevent(GbbPowerSimulator *simulator,
+              const char        *directory,
+              GError           **error)
+{
+    char *path = g_build_filename(directory, "uevent", NULL);
+
+    simulator->uevent_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (simulator->uevent_fd < 0) {
+        int errsv = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+                    "Can't create %s: %s", path, g_strerror(errsv));
+        g_free(path);
+        return FALSE;
+    }
+
+    g_ptr_array_add(simulator->created_paths, path);
+    simulator->uevent_dirty = TRUE;
+
+    return TRUE;
+}
+
+static gboolean
+create_sysfs(GbbPowerSimulator *simulator,
+             GError           **error)
+{
+    char *class_path = g_build_filename(simulator->sysfs_root, "class", NULL);
+    char *power_supply_path = g_build_filename(class_path, "power_supply", NULL);
+    char *battery_path = g_build_filename(power_supply_path, "BAT0", NULL);
+    char *adapter_path = g_build_filename(power_supply_path, "AC", NULL);
+    gboolean result;
+
+    result = (make_directory(simulator, class_path, error) &&
+              make_directory(simulator, power_supply_path, error) &&
+              make_directory(simulator, battery_path, error) &&
+              make_directory(simulator, adapter_path, error) &&
+              create_attribute(simulator, ATTRIBUTE_ENERGY_NOW, battery_path, "energy_now", error) &&
+              create_attribute(simulator, ATTRIBUTE_ENERGY_FULL, battery_path, "energy_full", error) &&
+              create_attribute(simulator, ATTRIBUTE_ENERGY_FULL_DESIGN, battery_path, "energy_full_design", error) &&
+              create_attribute(simulator, ATTRIBUTE_POWER_NOW, battery_path, "power_now", error) &&
+              create_attribute(simulator, ATTRIBUTE_ONLINE, adapter_path, "online", error) &&
+              create_uevent(simulator, battery_path, error));
+
+    g_free(class_path);
+    g_free(power_supply_path);
+    g_free(battery_path);
+    g_free(adapter_path);
+
+    return result;
+}
+
+/* What the firmware reports: the true energy, rounded down to the
+ * reporting quantum, as of the last firmware update.
+ */
+static void
+update_reported_energy(GbbPowerSimulator *simulator)
+{
+    double energy = simulator->energy;
+
+    if (simulator->quantum > 0)
+        energy = floor(energy / simulator->quantum) * simulator->quantum;
+
+    write_attribute(simulator, ATTRIBUTE_ENERGY_NOW, (gint64)(energy * 1000000.));
+}
+
+static void
+integrate_to(GbbPowerSimulator *simulator,
+             double             time)
+{
+    simulator->energy -= simulator->drain * (time - simulator->time) / 3600.;
+    if (simulator->energy < 0)
+        simulator->energy = 0;
+    simulator->time = time;
+}
+
+static void
+apply_command(GbbPowerSimulator *simulator,
+              const Command     *command)
+{
+    switch (command->type) {
+    case COMMAND_ENERGY_FULL_DESIGN:
+        simulator->energy_full_design = command->value;
+        write_attribute(simulator, ATTRIBUTE_ENERGY_FULL_DESIGN, (gint64)(command->value * 1000000.));
+        break;
+    case COMMAND_ENERGY_FULL:
+        simulator->energy_full = command->value;
+        write_attribute(simulator, ATTRIBUTE_ENERGY_FULL, (gint64)(command->value * 1000000.));
+        break;
+    case COMMAND_ENERGY:
+        /* A step in the true energy; also used to simulate counter resets */
+        simulator->energy = command->value;
+        break;
+    case COMMAND_DRAIN:
+        /* power_now follows the true drain immediately */
+        simulator->drain = command->value;
+        write_attribute(simulator, ATTRIBUTE_POWER_NOW, (gint64)(command->value * 1000000.));
+        break;
+    case COMMAND_UPDATE_PERIOD:
+        simulator->update_period = command->value;
+        simulator->next_update = command->time;
+        break;
+    case COMMAND_QUANTUM:
+        simulator->quantum = command->value;
+        break;
+    case COMMAND_AC:
+        simulator->online = command->value != 0;
+        write_attribute(simulator, ATTRIBUTE_ONLINE, simulator->online ? 1 : 0);
+        break;
+    case COMMAND_END:
+        break;
+    }
+}
+
+/* Steps the simulation forward to @time, handling script commands and
+ * firmware updates in the order they occur in between.
+ */
+static void
+advance_to(GbbPowerSimulator *simulator,
+           double             time)
+{
+    while (TRUE) {
+        const Command *command = NULL;
+        double next_time = time;
+
+        if (simulator->next_command < simulator->commands->len) {
+            command = &g_array_index(simulator->commands, Command, simulator->next_command);
+            if (command->time <= next_time)
+                next_time = command->time;
+            else
+                command = NULL;
+        }
+
+        gboolean is_update = (simulator->update_period > 0 &&
+                              simulator->next_update <= next_time &&
+                              (command == NULL || simulator->next_update < command->time));
+        if (is_update) {
+            next_time = simulator->next_update;
+            command = NULL;
+        }
+
+        if (!command && !is_update)
+            break;
+
+        integrate_to(simulator, next_time);
+
+        if (command) {
+            apply_command(simulator, command);
+            simulator->next_command++;
+        } else {
+            update_reported_energy(simulator);
+            simulator->next_update += simulator->update_period;
+        }
+    }
+
+    integrate_to(simulator, time);
+
+    if (simulator->update_period <= 0)
+        update_reported_energy(simulator);
+
+    write_uevent(simulator);
+}
+
+static gboolean
+on_tick(gpointer data)
+{
+    GbbPowerSimulator *simulator = data;
+    gint64 elapsed = g_get_monotonic_time() - simulator->start_time;
+
+    advance_to(simulator, elapsed * simulator->time_scale / 1000000.);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * gbb_power_simulator_new:
+ * @script_file: file describing the simulated battery
+ * @time_scale: how many times faster than real time to run
+ * @error: location to store error
+ *
+ * Creates a fake sysfs tree with a single battery and AC adapter and
+ * updates it from the main loop following the script. Each line of the
+ * script has the form 'SECONDS,COMMAND,VALUE', with commands:
+ *
+ *  energy-full-design, energy-full: capacities (Wh)
+ *  energy: set the true energy (Wh) - for steps and counter resets
+ *  drain: constant power draw from now on (W), also reported as power_now
+ *  update-period: firmware only updates energy_now this often (s)
+ *  quantum: energy_now is rounded down to a multiple of this (Wh)
+ *  ac: adapter online (1) or offline (0)
+ *  end: end of the script (no value)
+ *
+ * The battery also has a uevent file with all of its values.
+ */
+GbbPowerSimulator *
+gbb_power_simulator_new(const char *script_file,
+                        double      time_scale,
+                        GError    **error)
+{
+    GbbPowerSimulator *simulator = g_slice_new0(GbbPowerSimulator);
+    int i;
+
+    g_return_val_if_fail(time_scale > 0, NULL);
+
+    simulator->time_scale = time_scale;
+    simulator->commands = g_array_new(FALSE, FALSE, sizeof(Command));
+    simulator->created_paths = g_ptr_array_new_with_free_func(g_free);
+    for (i = 0; i < N_ATTRIBUTES; i++)
+        simulator->attributes[i].fd = -1;
+    simulator->uevent_fd = -1;
+
+    if (!parse_script(simulator, script_file, error))
+        goto fail;
+
+    simulator->sysfs_root = g_dir_make_tmp("gbb-sysfs-XXXXXX", error);
+    if (!simulator->sysfs_root)
+        goto fail;
+
+    if (!create_sysfs(simulator, error))
+        goto fail;
+
+    advance_to(simulator, 0);
+
+    simulator->start_time = g_get_monotonic_time();
+    simulator->timeout_id = g_timeout_add(TICK_INTERVAL, on_tick, simulator);
+
+    return simulator;
+
+fail:
+    gbb_power_simulator_free(simulator);
+    return NULL;
+}
+
+const char *
+gbb_power_simulator_get_sysfs_root(GbbPowerSimulator *simulator)
+{
+    return simulator->sysfs_root;
+}
+
+/* Simulated time of the last command in the script */
+double
+gbb_power_simulator_get_duration(GbbPowerSimulator *simulator)
+{
+    if (simulator->commands->len == 0)
+        return 0;
+
+    return g_array_index(simulator->commands, Command, simulator->commands->len - 1).time;
+}
+
+void
+gbb_power_simulator_free(GbbPowerSimulator *simulator)
+{
+    int i;
+
+    if (simulator->timeout_id)
+        g_source_remove(simulator->timeout_id);
+
+    for (i = 0; i < N_ATTRIBUTES; i++)
+        if (simulator->attributes[i].fd >= 0)
+            close(simulator->attributes[i].fd);
+    if (simulator->uevent_fd >= 0)
+        close(simulator->uevent_fd);
+
+    /* Remove in reverse order of creation, so directories are empty */
+    for (i = simulator->created_paths->len - 1; i >= 0; i--)
+        g_remove(g_ptr_array_index(simulator->created_paths, i));
+    g_ptr_array_free(simulator->created_paths, TRUE);
+
+    if (simulator->sysfs_root) {
+        g_rmdir(simulator->sysfs_root);
+        g_free(simulator->sysfs_root);
+    }
+
+    g_array_free(simulator->commands, TRUE);
+    g_slice_free(GbbPowerSimulator, simulator);
+}
@@ -0,0 +1,19 @@
+/* -*- mode: C; c-file-style: "stroustrup"; indent-tabs-mode: nil; -*- */
+
+#ifndef __POWER_SIMULATOR_H__
+#define __POWER_SIMULATOR_H__
+
+#include <glib.h>
+
+typedef struct _GbbPowerSimulator GbbPowerSimulator;
+
+GbbPowerSimulator *gbb_power_simulator_new(const char *script_file,
+                                           double      time_scale,
+                                           GError    **error);
+
+const char *gbb_power_simulator_get_sysfs_root(GbbPowerSimulator *simulator);
+double      gbb_power_simulator_get_duration  (GbbPowerSimulator *simulator);
+
+void gbb_power_simulator_free(GbbPowerSimulator *simulator);
+
+#endif /* __POWER_SIMULATOR_H__ */
@@ -18,7 +18,10 @@ struct _GbbRemotePlayer {
     GCancellable *cancellable;
 
     GDBusProxy *player_proxy;
-    int pending_fd;
+    GbbEventLog *pending_log;
+    guint pending_start;
+    guint pending_n_iterations;
+    guint pending_max_duration;
     gboolean started;
 };
 
@@ -28,22 +31,12 @@ struct _GbbRemotePlayerClass {
 
 G_DEFINE_TYPE(GbbRemotePlayer, gbb_remote_player, GBB_TYPE_EVENT_PLAYER);
 
-static void
-close_pending_fd(GbbRemotePlayer *player)
-{
-    if (player->pending_fd != -1) {
-        if (close(player->pending_fd) != 0)
-            die_errno("Error closing file");
-        player->pending_fd = -1;
-    }
-}
-
 static void
 gbb_remote_player_finalize(GObject *object)
 {
     GbbRemotePlayer *player = GBB_REMOTE_PLAYER(object);
 
-    close_pending_fd(player);
+    g_clear_pointer(&player->pending_log, gbb_event_log_unref);
 
     g_cancellable_cancel(player->cancellable);
     g_clear_object(&player->cancellable);
@@ -58,7 +51,6 @@ static void
 gbb_remote_player_init(GbbRemotePlayer *player)
 {
     player->cancellable = g_cancellable_new();
-    player->pending_fd = -1;
 }
 
 static void
@@ -90,13 +82,35 @@ static void
 remote_player_maybe_start(GbbRemotePlayer *player)
 {
     if (gbb_event_player_is_ready(GBB_EVENT_PLAYER(player)) &&
-        player->player_proxy && player->pending_fd != -1)
+        player->player_proxy && player->pending_log != NULL)
     {
-        GUnixFDList *fd_list = g_unix_fd_list_new_from_array(&player->pending_fd, 1);
-        player->pending_fd = -1;
-
-        g_dbus_proxy_call_with_unix_fd_list(player->player_proxy, "Play",
-                                            g_variant_new("(h)", 0),
+        /* The log is written out in binary format to a sealed memfd,
+         * or a temporary file without memfds, once, and the same file
+         * is passed for each play, so the helper doesn't have to parse
+         * it, and only reads it once. */
+        GError *error = NULL;
+        int fd = gbb_event_log_get_binary_fd(player->pending_log, &error);
+        if (fd == -1)
+            die("Can't write event log: %s", error->message);
+        g_clear_pointer(&player->pending_log, gbb_event_log_unref);
+
+        GUnixFDList *fd_list = g_unix_fd_list_new_from_array(&fd, 1);
+
+        GVariantBuilder options;
+        g_variant_builder_init(&options, G_VARIANT_TYPE("a{sv}"));
+        g_variant_builder_add(&options, "{sv}", "start",
+                              g_variant_new_uint32(player->pending_start));
+        g_variant_builder_add(&options, "{sv}", "iterations",
+                              g_variant_new_uint32(player->pending_n_iterations));
+        g_variant_builder_add(&options, "{sv}", "max-duration",
+                              g_variant_new_uint32(player->pending_max_duration));
+        g_variant_builder_add(&options, "{sv}", "realtime",
+                              g_variant_new_boolean(gbb_event_player_get_realtime(GBB_EVENT_PLAYER(player))));
+        g_variant_builder_add(&options, "{sv}", "progress-interval",
+                              g_variant_new_uint32(gbb_event_player_get_progress_interval(GBB_EVENT_PLAYER(player))));
+
+        g_dbus_proxy_call_with_unix_fd_list(player->player_proxy, "PlayLoop",
+                                            g_variant_new("(ha{sv})", 0, &options),
                                             G_DBUS_CALL_FLAGS_NONE,
                                             G_MAXINT,
                                             fd_list,
@@ -109,17 +123,23 @@ remote_player_maybe_start(GbbRemotePlayer *player)
 }
 
 static void
-gbb_remote_player_play_fd(GbbEventPlayer *event_player,
-                          int             fd)
+gbb_remote_player_play_log(GbbEventPlayer *event_player,
+                           GbbEventLog    *log,
+                           guint           start,
+                           guint           n_iterations,
+                           guint           max_duration)
 {
     GbbRemotePlayer *player = GBB_REMOTE_PLAYER(event_player);
 
-    if (player->pending_fd != -1 || player->started) {
+    if (player->pending_log != NULL || player->started) {
         g_critical("Player is already playing");
         return;
     }
 
-    player->pending_fd = fd;
+    player->pending_log = gbb_event_log_ref(log);
+    player->pending_start = start;
+    player->pending_n_iterations = n_iterations;
+    player->pending_max_duration = max_duration;
 
     remote_player_maybe_start(player);
 }
@@ -129,8 +149,8 @@ gbb_remote_player_stop(GbbEventPlayer *event_player)
 {
     GbbRemotePlayer *player = GBB_REMOTE_PLAYER(event_player);
 
-    if (player->pending_fd != -1) {
-        close_pending_fd(player);
+    if (player->pending_log != NULL) {
+        g_clear_pointer(&player->pending_log, gbb_event_log_unref);
     } else {
         GError *error = NULL;
 
@@ -150,6 +170,38 @@ gbb_remote_player_stop(GbbEventPlayer *event_player)
     }
 }
 
+static void
+gbb_remote_player_get_timing(GbbEventPlayer    *event_player,
+                             GbbPlaybackTiming *timing)
+{
+    GbbRemotePlayer *player = GBB_REMOTE_PLAYER(event_player);
+    GError *error = NULL;
+
+    gbb_playback_timing_reset(timing);
+
+    if (!player->player_proxy)
+        return;
+
+    GVariant *retval = g_dbus_proxy_call_sync(player->player_proxy,
+                                              "GetTiming",
+                                              NULL,
+                                              G_DBUS_CALL_FLAGS_NONE,
+                                              -1,
+                                              NULL,
+                                              &error);
+    if (error) {
+        g_warning("Error getting timing from remote player: %s\n", error->message);
+        g_clear_error(&error);
+        return;
+    }
+
+    GVariant *timing_variant = g_variant_get_child_value(retval, 0);
+    if (!gbb_playback_timing_from_variant(timing, timing_variant))
+        g_warning("Bad timing from remote player");
+    g_variant_unref(timing_variant);
+    g_variant_unref(retval);
+}
+
 static void
 gbb_remote_player_class_init(GbbRemotePlayerClass *player_class)
 {
@@ -157,11 +209,36 @@ gbb_remote_player_class_init(GbbRemotePlayerClass *player_class)
     gobject_class->finalize = gbb_remote_player_finalize;
 
     GbbEventPlayerClass *event_player_class = GBB_EVENT_PLAYER_CLASS (player_class);
-    event_player_class->play_fd = gbb_remote_player_play_fd;
+    event_player_class->play_log = gbb_remote_player_play_log;
     event_player_class->stop = gbb_remote_player_stop;
+    event_player_class->get_timing = gbb_remote_player_get_timing;
 
 }
 
+static void
+on_player_proxy_signal(GDBusProxy *proxy,
+                       const char *sender_name,
+                       const char *signal_name,
+                       GVariant   *parameters,
+                       gpointer    data)
+{
+    GbbRemotePlayer *player = data;
+
+    if (g_strcmp0(signal_name, "IterationFinished") == 0 && player->started) {
+        guint n_iterations;
+        g_variant_get(parameters, "(u)", &n_iterations);
+        gbb_event_player_iteration_finished(GBB_EVENT_PLAYER(player), n_iterations);
+    } else if (g_strcmp0(signal_name, "Progress") == 0 && player->started) {
+        GbbPlaybackProgress progress;
+        GVariant *progress_variant = g_variant_get_child_value(parameters, 0);
+        if (gbb_playback_progress_from_variant(&progress, progress_variant))
+            gbb_event_player_progress(GBB_EVENT_PLAYER(player), &progress);
+        else
+            g_warning("Bad progress from remote player");
+        g_variant_unref(progress_variant);
+    }
+}
+
 static void
 on_player_proxy_ready_cb(GObject      *source_object,
                          GAsyncResult *result,
@@ -183,6 +260,8 @@ on_player_proxy_ready_cb(GObject      *source_object,
     GbbRemotePlayer *player = data;
 
     player->player_proxy = player_proxy;
+    g_signal_connect(player->player_proxy, "g-signal",
+                     G_CALLBACK(on_player_proxy_signal), player);
 
     GVariant *keyboard_node_variant = g_dbus_proxy_get_cached_property(player->player_proxy,
                                                                        "KeyboardDeviceNode");
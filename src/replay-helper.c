@@ -1,6 +1,9 @@
 /* -*- mode: C; c-file-style: "stroustrup"; indent-tabs-mode: nil; -*- */
 
+#include <fcntl.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <gio/gio.h>
 #include <gio/gunixfdlist.h>
@@ -20,13 +23,49 @@ struct _Player {
     guint creator_changed_connection;
     guint registration_id;
     GbbEventPlayer *player;
+    GbbEvdevDevices *devices;
+
+    /* The last log played. Logs are sealed, or copied before they are
+     * checked, so when the same file is passed again, it can be played
+     * without reading it again. Keeping
+     * the file open stops its inode from being reused. */
+    GbbEventLog *log;
+    int log_fd;
 
     GDBusMethodInvocation *invocation;
+    guint iteration_finished_connection;
+    guint progress_connection;
     guint finished_connection;
 };
 
 int player_serial = 0;
 
+/* Simulated devices not in use by a player. The X server takes a while
+ * to notice new devices, so they are kept for the next player rather
+ * than destroyed. One set is created in on_bus_acquired(), so the
+ * first player doesn't wait either; only a player created while all
+ * the pooled sets are in use gets new devices. */
+static GQueue device_pool = G_QUEUE_INIT;
+
+#define DEVICE_NAME "GNOME Battery Bench"
+
+static GbbEvdevDevices *
+acquire_devices(void)
+{
+    GbbEvdevDevices *devices = g_queue_pop_head(&device_pool);
+    if (devices == NULL)
+        devices = gbb_evdev_devices_new(DEVICE_NAME);
+
+    return devices;
+}
+
+static void
+release_devices(GbbEvdevDevices *devices)
+{
+    gbb_evdev_devices_reset(devices);
+    g_queue_push_head(&device_pool, devices);
+}
+
 static void
 player_destroy(Player *player)
 {
@@ -36,10 +75,17 @@ player_destroy(Player *player)
                                               G_DBUS_ERROR,
                                               G_DBUS_ERROR_FAILED,
                                               "Player destroyed during playback");
+        g_signal_handler_disconnect(player->player, player->iteration_finished_connection);
+        g_signal_handler_disconnect(player->player, player->progress_connection);
         g_signal_handler_disconnect(player->player, player->finished_connection);
     }
 
     g_object_unref(player->player);
+    release_devices(player->devices);
+
+    g_clear_pointer(&player->log, gbb_event_log_unref);
+    if (player->log_fd != -1)
+        close(player->log_fd);
 
     g_dbus_connection_signal_unsubscribe(player->connection,
                                          player->creator_changed_connection);
@@ -51,10 +97,54 @@ player_destroy(Player *player)
     g_slice_free(Player, player);
 }
 
+static void
+on_player_iteration_finished(GbbEventPlayer *event_player,
+                             guint           n_iterations,
+                             Player         *player)
+{
+    GError *error = NULL;
+
+    g_dbus_connection_emit_signal(player->connection,
+                                  player->creator,
+                                  player->path,
+                                  GBB_DBUS_INTERFACE_PLAYER,
+                                  "IterationFinished",
+                                  g_variant_new("(u)", n_iterations),
+                                  &error);
+    if (error) {
+        g_warning("Can't emit IterationFinished: %s", error->message);
+        g_clear_error(&error);
+    }
+}
+
+static void
+on_player_progress(GbbEventPlayer            *event_player,
+                   const GbbPlaybackProgress *progress,
+                   Player                    *player)
+{
+    GError *error = NULL;
+
+    g_dbus_connection_emit_signal(player->connection,
+                                  player->creator,
+                                  player->path,
+                                  GBB_DBUS_INTERFACE_PLAYER,
+                                  "Progress",
+                                  g_variant_new("(@a{sv})", gbb_playback_progress_to_variant(progress)),
+                                  &error);
+    if (error) {
+        g_warning("Can't emit Progress: %s", error->message);
+        g_clear_error(&error);
+    }
+}
+
 static void
 on_player_finished(GbbEventPlayer *event_player,
                    Player         *player)
 {
+    g_signal_handler_disconnect(player->player, player->iteration_finished_connection);
+    player->iteration_finished_connection = 0;
+    g_signal_handler_disconnect(player->player, player->progress_connection);
+    player->progress_connection = 0;
     g_signal_handler_disconnect(player->player, player->finished_connection);
     player->finished_connection = 0;
 
@@ -62,6 +152,114 @@ on_player_finished(GbbEventPlayer *event_player,
     player->invocation = NULL;
 }
 
+/* Gets the event log passed to Play or PlayLoop; on failure, returns
+ * an error for @invocation and %FALSE */
+static gboolean
+steal_event_fd(Player                *player,
+               GVariant              *parameters,
+               GDBusMethodInvocation *invocation,
+               int                   *fd)
+{
+    GDBusMessage *message = g_dbus_method_invocation_get_message(invocation);
+    GUnixFDList *fd_list = g_dbus_message_get_unix_fd_list(message);
+    gint32 fd_index = -1;
+
+    if (fd_list == NULL || g_unix_fd_list_get_length(fd_list) != 1) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               G_DBUS_ERROR,
+                                               G_DBUS_ERROR_INVALID_ARGS,
+                                               "Exactly one file descriptor should be passed");
+        return FALSE;
+    }
+
+    g_variant_get_child (parameters, 0, "h", &fd_index);
+    if (fd_index != 0) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               G_DBUS_ERROR,
+                                               G_DBUS_ERROR_INVALID_ARGS,
+                                               "Bad file descriptor index %d", fd_index);
+        return FALSE;
+    }
+
+    if (player->invocation) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               G_DBUS_ERROR,
+                                               G_DBUS_ERROR_FAILED,
+                                               "Player already playing");
+        return FALSE;
+    }
+
+    int n_fds;
+    int *fds = g_unix_fd_list_steal_fds (fd_list, &n_fds);
+    *fd = fds[0];
+    g_free(fds);
+
+    return TRUE;
+}
+
+/* Takes ownership of @fd */
+static GbbEventLog *
+player_load_log(Player  *player,
+                int      fd,
+                GError **error)
+{
+    struct stat st, cached_st;
+
+    if (player->log &&
+        fstat(fd, &st) == 0 && fstat(player->log_fd, &cached_st) == 0 &&
+        st.st_dev == cached_st.st_dev && st.st_ino == cached_st.st_ino) {
+        close(fd);
+        return gbb_event_log_ref(player->log);
+    }
+
+    g_clear_pointer(&player->log, gbb_event_log_unref);
+    if (player->log_fd != -1) {
+        close(player->log_fd);
+        player->log_fd = -1;
+    }
+
+    int log_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    GbbEventLog *log = gbb_event_log_new_from_sealed_fd(fd, error);
+    if (log && log_fd != -1) {
+        player->log = gbb_event_log_ref(log);
+        player->log_fd = log_fd;
+    } else if (log_fd != -1) {
+        close(log_fd);
+    }
+
+    return log;
+}
+
+static void
+player_play(Player                *player,
+            GDBusMethodInvocation *invocation,
+            int                    fd,
+            guint                  start,
+            guint                  n_iterations,
+            guint                  max_duration)
+{
+    GError *error = NULL;
+
+    GbbEventLog *log = player_load_log(player, fd, &error);
+    if (!log) {
+        g_dbus_method_invocation_return_gerror (invocation, error);
+        g_clear_error(&error);
+        return;
+    }
+
+    player->invocation = invocation;
+    player->iteration_finished_connection = g_signal_connect(player->player, "iteration-finished",
+                                                             G_CALLBACK(on_player_iteration_finished),
+                                                             player);
+    player->progress_connection = g_signal_connect(player->player, "progress",
+                                                   G_CALLBACK(on_player_progress), player);
+    player->finished_connection = g_signal_connect(player->player, "finished",
+                                                   G_CALLBACK(on_player_finished), player);
+
+    gbb_event_player_play_loop(player->player, log, start, n_iterations, max_duration);
+    gbb_event_log_unref(log);
+}
+
 static void
 player_handle_method_call(GDBusConnection       *connection,
                           const gchar           *sender,
@@ -75,45 +273,35 @@ player_handle_method_call(GDBusConnection       *connection,
     Player *player = user_data;
 
     if (g_strcmp0 (method_name, "Play") == 0) {
-        gint32 fd_index = -1;
-
-        GDBusMessage *message = g_dbus_method_invocation_get_message(invocation);
-        GUnixFDList *fd_list = g_dbus_message_get_unix_fd_list(message);
-
-        if (g_unix_fd_list_get_length(fd_list) != 1) {
-            g_dbus_method_invocation_return_error (invocation,
-                                                   G_DBUS_ERROR,
-                                                   G_DBUS_ERROR_INVALID_ARGS,
-                                                   "Exactly one file descriptor should be passed");
-        }
-
-        g_variant_get (parameters, "(h)", &fd_index);
-        if (fd_index != 0) {
-            g_dbus_method_invocation_return_error (invocation,
-                                                   G_DBUS_ERROR,
-                                                   G_DBUS_ERROR_INVALID_ARGS,
-                                                   "Bad file descriptor index %d", fd_index);
-        }
-
-        if (player->invocation) {
-            g_dbus_method_invocation_return_error (invocation,
-                                                   G_DBUS_ERROR,
-                                                   G_DBUS_ERROR_FAILED,
-                                                   "Player already playing");
+        int fd;
+        if (!steal_event_fd(player, parameters, invocation, &fd))
             return;
-        }
-
-        int n_fds;
-        int *fds = g_unix_fd_list_steal_fds (fd_list, &n_fds);
-        int fd = fds[0];
-        g_free(fds);
 
-        gbb_event_player_play_fd(player->player, fd);
-
-        player->invocation = invocation;
-        player->finished_connection = g_signal_connect(player->player, "finished",
-                                                       G_CALLBACK(on_player_finished), player);
+        gbb_event_player_set_realtime(player->player, FALSE);
+        gbb_event_player_set_progress_interval(player->player, 0);
+        player_play(player, invocation, fd, 0, 1, 0);
+    } else if (g_strcmp0 (method_name, "PlayLoop") == 0) {
+        int fd;
+        if (!steal_event_fd(player, parameters, invocation, &fd))
+            return;
 
+        GVariant *options = g_variant_get_child_value(parameters, 1);
+        guint start = 0;
+        guint n_iterations = 0;
+        guint max_duration = 0;
+        gboolean realtime = FALSE;
+        guint progress_interval = 0;
+        g_variant_lookup(options, "start", "u", &start);
+        g_variant_lookup(options, "iterations", "u", &n_iterations);
+        g_variant_lookup(options, "max-duration", "u", &max_duration);
+        g_variant_lookup(options, "realtime", "b", &realtime);
+        g_variant_lookup(options, "progress-interval", "u", &progress_interval);
+        g_variant_unref(options);
+
+        gbb_event_player_set_realtime(player->player, realtime);
+        gbb_event_player_set_progress_interval(player->player, progress_interval);
+
+        player_play(player, invocation, fd, start, n_iterations, max_duration);
     } else if (g_strcmp0 (method_name, "Stop") == 0) {
         if (player->invocation == NULL) {
             g_dbus_method_invocation_return_error (invocation,
@@ -124,6 +312,12 @@ player_handle_method_call(GDBusConnection       *connection,
         }
         gbb_event_player_stop(player->player);
         g_dbus_method_invocation_return_value(invocation, NULL);
+    } else if (g_strcmp0 (method_name, "GetTiming") == 0) {
+        GbbPlaybackTiming timing;
+        gbb_event_player_get_timing(player->player, &timing);
+        g_dbus_method_invocation_return_value(invocation,
+                                              g_variant_new("(@a{sv})",
+                                                            gbb_playback_timing_to_variant(&timing)));
     } else if (g_strcmp0 (method_name, "Destroy") == 0) {
         player_destroy(user_data);
         g_dbus_method_invocation_return_value(invocation, NULL);
@@ -218,6 +412,7 @@ on_checked_authorization(GObject      *source_object,
     g_variant_get (parameters, "(&s)", &name);
 
     Player *player = g_slice_new0(Player);
+    player->log_fd = -1;
 
     player->connection = g_object_ref(connection);
     player->name = g_strdup(name);
@@ -234,7 +429,8 @@ on_checked_authorization(GObject      *source_object,
                                                                              on_name_owner_changed,
                                                                              player, NULL);
 
-    player->player = GBB_EVENT_PLAYER(gbb_evdev_player_new(player->name));
+    player->devices = acquire_devices();
+    player->player = GBB_EVENT_PLAYER(gbb_evdev_player_new_for_devices(player->devices));
 
     player->registration_id = g_dbus_connection_register_object(connection,
                                                                 player->path,
@@ -342,6 +538,9 @@ on_bus_acquired(GDBusConnection *connection,
     if (error)
         die("Cannot register object: %s\n", error->message);
 
+    /* Start the pool with one set, so the devices are ready by the time
+     * the first player asks for them */
+    release_devices(gbb_evdev_devices_new(DEVICE_NAME));
 }
 
 static void
@@ -0,0 +1,152 @@
+/* -*- mode: C; c-file-style: "stroustrup"; indent-tabs-mode: nil; -*- */
+
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "power-monitor.h"
+
+/* Tests of GbbPowerMonitor against a fake sysfs tree in a temporary directory */
+
+static char *sysfs_root;
+
+static void
+fake_sysfs_mkdir(const char *relative_path)
+{
+    char *path = g_build_filename(sysfs_root, relative_path, NULL);
+    g_assert_cmpint(g_mkdir_with_parents(path, 0755), ==, 0);
+    g_free(path);
+}
+
+/* Rewrites the file in place, since the monitor keeps it open */
+static void
+fake_sysfs_write(const char *relative_path,
+                 const char *contents)
+{
+    char *path = g_build_filename(sysfs_root, relative_path, NULL);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(write(fd, contents, strlen(contents)), ==, (gssize)strlen(contents));
+    close(fd);
+    g_free(path);
+}
+
+static void
+remove_tree(const char *path)
+{
+    GDir *dir = g_dir_open(path, 0, NULL);
+    const char *name;
+
+    if (dir) {
+        while ((name = g_dir_read_name(dir))) {
+            char *child_path = g_build_filename(path, name, NULL);
+            remove_tree(child_path);
+            g_free(child_path);
+        }
+        g_dir_close(dir);
+    }
+
+    g_remove(path);
+}
+
+static void
+fake_sysfs_init(void)
+{
+    GError *error = NULL;
+
+    sysfs_root = g_dir_make_tmp("gbb-test-sysfs-XXXXXX", &error);
+    g_assert_no_error(error);
+
+    fake_sysfs_mkdir("class/power_supply");
+    fake_sysfs_mkdir("class/powercap/intel-rapl:0");
+    fake_sysfs_write("class/powercap/intel-rapl:0/name", "package-0\n");
+}
+
+static void
+fake_sysfs_clear(void)
+{
+    remove_tree(sysfs_root);
+    g_clear_pointer(&sysfs_root, g_free);
+}
+
+/* Samples are taken by the test, at made-up times, rather than by the
+ * sampler thread, so nothing depends on how quickly that runs */
+static GbbPowerMonitor *
+monitor_new(void)
+{
+    GbbPowerMonitor *monitor = gbb_power_monitor_new_for_root(sysfs_root);
+    gbb_power_monitor_set_sampling_mode(monitor, GBB_SAMPLING_MODE_MANUAL);
+
+    return monitor;
+}
+
+static double
+sample_rapl_energy(GbbPowerMonitor *monitor,
+                   gint64           time_us,
+                   GbbRaplDomain    domain)
+{
+    gbb_power_monitor_sample(monitor, time_us);
+
+    return gbb_power_monitor_get_state(monitor)->rapl_energy[domain];
+}
+
+/* energy_uj wraps to 0 at max_energy_range_uj */
+static void
+test_rapl_wrap(void)
+{
+    fake_sysfs_init();
+    fake_sysfs_write("class/powercap/intel-rapl:0/max_energy_range_uj", "1000000\n");
+    fake_sysfs_write("class/powercap/intel-rapl:0/energy_uj", "999000\n");
+
+    GbbPowerMonitor *monitor = monitor_new();
+    double energy = sample_rapl_energy(monitor, 1 * G_USEC_PER_SEC, GBB_RAPL_PACKAGE);
+    g_assert_cmpfloat(energy, ==, 0);
+
+    fake_sysfs_write("class/powercap/intel-rapl:0/energy_uj", "500\n");
+    energy = sample_rapl_energy(monitor, 2 * G_USEC_PER_SEC, GBB_RAPL_PACKAGE);
+    g_assert_cmpfloat(fabs(energy - 0.0015), <, 1e-9);
+
+    fake_sysfs_write("class/powercap/intel-rapl:0/energy_uj", "2500\n");
+    energy = sample_rapl_energy(monitor, 3 * G_USEC_PER_SEC, GBB_RAPL_PACKAGE);
+    g_assert_cmpfloat(fabs(energy - 0.0035), <, 1e-9);
+
+    g_object_unref(monitor);
+    fake_sysfs_clear();
+}
+
+/* Without max_energy_range_uj, energy across a wrap is left out
+ * rather than guessed */
+static void
+test_rapl_wrap_unknown_range(void)
+{
+    fake_sysfs_init();
+    fake_sysfs_write("class/powercap/intel-rapl:0/energy_uj", "999000\n");
+
+    GbbPowerMonitor *monitor = monitor_new();
+
+    fake_sysfs_write("class/powercap/intel-rapl:0/energy_uj", "500\n");
+    double energy = sample_rapl_energy(monitor, 1 * G_USEC_PER_SEC, GBB_RAPL_PACKAGE);
+    g_assert_cmpfloat(energy, ==, 0);
+
+    fake_sysfs_write("class/powercap/intel-rapl:0/energy_uj", "1500\n");
+    energy = sample_rapl_energy(monitor, 2 * G_USEC_PER_SEC, GBB_RAPL_PACKAGE);
+    g_assert_cmpfloat(fabs(energy - 0.001), <, 1e-9);
+
+    g_object_unref(monitor);
+    fake_sysfs_clear();
+}
+
+int
+main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/power-monitor/rapl-wrap", test_rapl_wrap);
+    g_test_add_func("/power-monitor/rapl-wrap-unknown-range", test_rapl_wrap_unknown_range);
+
+    return g_test_run();
+}
@@ -1,11 +1,13 @@
 /* -*- mode: C; c-file-style: "stroustrup"; indent-tabs-mode: nil; -*- */
 
 #define _XOPEN_SOURCE
+#include <math.h>
 #include <time.h>
 
 #include <json-glib/json-glib.h>
 
 #include "event-log.h"
+#include "power-fit.h"
 #include "test-run.h"
 #include "util.h"
 
@@ -18,21 +20,56 @@ struct _GbbTestRun {
     char *description;
 
     GQueue *history;
+    GQueue *events;
     gint64 start_time;
 
     GbbDurationType duration_type;
     union {
         double seconds;
         double percent;
+        struct {
+            double relative_error;
+            int min_iterations;
+            double max_seconds;
+        } converged;
     } duration;
 
     int screen_brightness;
+    GbbPowerEstimator estimator;
+
+    GbbPowerFit *power_fit;
+    GArray *convergence;
+    GbbPlaybackTiming *playback_timing;
+    GArray *progress;
+
+    /* Where in the loop playback started and stopped, in ms */
+    guint loop_start;
+    guint loop_stop;
+    gboolean have_loop_stop;
+    guint n_iterations; /* Finished so far, including a partial first one */
 
     double max_power;
     double max_life;
     double loop_time;
 };
 
+/* How the relative error of the fitted power evolved */
+typedef struct {
+    gint64 time_us;
+    double power;
+    double relative_error;
+} ConvergencePoint;
+
+/* Where the loop playback was at a point in time */
+typedef struct {
+    gint64 time_us;
+    guint iteration;
+    guint position_ms;
+} ProgressPoint;
+
+/* Half-width of a 95% confidence interval, in standard errors */
+#define CONFIDENCE_Z 1.96
+
 struct _GbbTestRunClass {
     GObjectClass parent_class;
 };
@@ -46,12 +83,25 @@ static guint signals[LAST_SIGNAL];
 
 G_DEFINE_TYPE(GbbTestRun, gbb_test_run, G_TYPE_OBJECT)
 
+static void
+test_event_free(GbbTestEvent *event)
+{
+    g_free(event->description);
+    g_slice_free(GbbTestEvent, event);
+}
+
 static void
 gbb_test_run_finalize(GObject *object)
 {
     GbbTestRun *run = GBB_TEST_RUN(object);
 
     g_queue_free_full(run->history, (GDestroyNotify)gbb_power_state_free);
+    g_queue_free_full(run->events, (GDestroyNotify)test_event_free);
+    gbb_power_fit_free(run->power_fit);
+    g_array_free(run->convergence, TRUE);
+    g_array_free(run->progress, TRUE);
+    if (run->playback_timing)
+        g_slice_free(GbbPlaybackTiming, run->playback_timing);
     g_free(run->filename);
     g_free(run->name);
     g_free(run->description);
@@ -63,6 +113,10 @@ static void
 gbb_test_run_init(GbbTestRun *run)
 {
     run->history = g_queue_new();
+    run->events = g_queue_new();
+    run->power_fit = gbb_power_fit_new(0);
+    run->convergence = g_array_new(FALSE, FALSE, sizeof(ConvergencePoint));
+    run->progress = g_array_new(FALSE, FALSE, sizeof(ProgressPoint));
 }
 
 static void
@@ -90,12 +144,13 @@ gbb_test_run_new(GbbBatteryTest *test)
     run->name = g_strdup(test->name);
     run->description = g_strdup(test->description);
 
-    GFile *loop_file = g_file_new_for_path(run->test->loop_file);
+    /* Tests without a loop file just record power, as for 'gbb simulate' */
     GError *error = NULL;
-    run->loop_time = gbb_event_log_duration(loop_file, NULL, &error) / 1000.;
-    if (error)
-        die("Can't get duration of .loop file: %s", error->message);
-    g_object_unref(loop_file);
+    if (!gbb_battery_test_load_logs(test, &error))
+        die("Can't load event logs for test: %s", error->message);
+
+    if (test->loop_log)
+        run->loop_time = gbb_event_log_get_duration(test->loop_log) / 1000.;
 
     return run;
 }
@@ -129,6 +184,26 @@ gbb_test_run_set_duration_percent (GbbTestRun *run,
     run->duration.percent = percent;
 }
 
+/**
+ * gbb_test_run_set_duration_converged:
+ * @run: a #GbbTestRun
+ * @relative_error: stop once the 95% confidence interval of the
+ *   fitted power is within this fraction of the power (0.02 for ±2%)
+ * @min_iterations: run at least this many loops of the test
+ * @max_seconds: stop after this long even if not converged, or 0
+ */
+void
+gbb_test_run_set_duration_converged (GbbTestRun *run,
+                                     double      relative_error,
+                                     int         min_iterations,
+                                     double      max_seconds)
+{
+    run->duration_type = GBB_DURATION_CONVERGED;
+    run->duration.converged.relative_error = relative_error;
+    run->duration.converged.min_iterations = min_iterations;
+    run->duration.converged.max_seconds = max_seconds;
+}
+
 GbbDurationType
 gbb_test_run_get_duration_type (GbbTestRun *run)
 {
@@ -149,6 +224,47 @@ gbb_test_run_get_duration_percent (GbbTestRun *run)
     return run->duration.percent;
 }
 
+double
+gbb_test_run_get_duration_relative_error (GbbTestRun *run)
+{
+    g_return_val_if_fail(run->duration_type == GBB_DURATION_CONVERGED, -1.0);
+    return run->duration.converged.relative_error;
+}
+
+int
+gbb_test_run_get_duration_min_iterations (GbbTestRun *run)
+{
+    g_return_val_if_fail(run->duration_type == GBB_DURATION_CONVERGED, -1);
+    return run->duration.converged.min_iterations;
+}
+
+double
+gbb_test_run_get_duration_max_time (GbbTestRun *run)
+{
+    g_return_val_if_fail(run->duration_type == GBB_DURATION_CONVERGED, -1.0);
+    return run->duration.converged.max_seconds;
+}
+
+/**
+ * gbb_test_run_get_relative_error:
+ * @run: a #GbbTestRun
+ *
+ * Gets the half-width of the 95% confidence interval of the fitted
+ * power, as a fraction of the power.
+ *
+ * Return value: the relative error, or -1 if not yet known
+ */
+double
+gbb_test_run_get_relative_error (GbbTestRun *run)
+{
+    double power, error;
+
+    if (!gbb_power_fit_get_power(run->power_fit, &power, &error) || power <= 0)
+        return -1;
+
+    return CONFIDENCE_Z * error / power;
+}
+
 
 gboolean
 gbb_test_run_is_done (GbbTestRun *run)
@@ -156,9 +272,38 @@ gbb_test_run_is_done (GbbTestRun *run)
     const GbbPowerState *start_state = gbb_test_run_get_start_state(run);
     const GbbPowerState *last_state = gbb_test_run_get_last_state(run);
 
-    if (run->duration_type == GBB_DURATION_TIME)
-        return (last_state->time_us - start_state->time_us) / 1000000. > run->duration.seconds;
-    else
+    if (run->duration_type == GBB_DURATION_TIME) {
+        gint64 duration_us = run->duration.seconds * 1000000.;
+        gint64 period = last_state->update_period_us;
+
+        if (last_state->time_us - start_state->time_us <= duration_us)
+            return FALSE;
+
+        /* Finish on a fuel gauge update, so that the measurement covers whole
+         * update periods, unless the gauge seems to have stopped updating */
+        if (period != 0 &&
+            last_state->energy_time_us - start_state->time_us <= duration_us &&
+            last_state->time_us - start_state->time_us <= duration_us + 2 * period)
+            return FALSE;
+
+        return TRUE;
+    } else if (run->duration_type == GBB_DURATION_CONVERGED) {
+        double elapsed = (last_state->time_us - start_state->time_us) / 1000000.;
+
+        if (run->duration.converged.max_seconds > 0 && elapsed > run->duration.converged.max_seconds)
+            return TRUE;
+
+        /* When resuming part way through the loop, the first iteration
+         * isn't a whole one */
+        guint n_whole_iterations = run->n_iterations;
+        if (run->loop_start > 0 && n_whole_iterations > 0)
+            n_whole_iterations--;
+        if ((int)n_whole_iterations < run->duration.converged.min_iterations)
+            return FALSE;
+
+        double relative_error = gbb_test_run_get_relative_error(run);
+        return relative_error >= 0 && relative_error <= run->duration.converged.relative_error;
+    } else
         return gbb_power_state_get_percent(last_state) < run->duration.percent;
 }
 
@@ -175,21 +320,48 @@ gbb_test_run_get_screen_brightness (GbbTestRun *run)
     return run->screen_brightness;
 }
 
-static void
+/* Only affects the statistics computed for states added afterwards */
+void
+gbb_test_run_set_estimator (GbbTestRun        *run,
+                            GbbPowerEstimator  estimator)
+{
+    run->estimator = estimator;
+}
+
+GbbPowerEstimator
+gbb_test_run_get_estimator (GbbTestRun *run)
+{
+    return run->estimator;
+}
+
+/* Takes ownership of @state. States from a saved run were already
+ * chosen when the run was live, so @filter is FALSE for them, and they
+ * are all kept. Returns whether @state was kept. */
+static gboolean
 test_run_add_internal(GbbTestRun    *run,
-                      GbbPowerState *state)
+                      GbbPowerState *state,
+                      gboolean       filter)
 {
     GbbPowerState *start_state = run->history->head ? run->history->head->data : NULL;
     GbbPowerState *last_state = run->history->tail ? run->history->tail->data : NULL;
     gboolean use_this_state = FALSE;
 
-    if (!start_state) {
+    if (!start_state || !filter) {
+        use_this_state = TRUE;
+    } else if (state->supplies_serial != last_state->supplies_serial) {
+        /* Keep the boundaries of intervals with a fixed set of power supplies */
         use_this_state = TRUE;
     } else {
         switch (run->duration_type) {
         case GBB_DURATION_TIME:
-            if (state->time_us - last_state->time_us > run->duration.seconds * 1000000. / 100.)
-                use_this_state = TRUE;
+            if (state->time_us - last_state->time_us > run->duration.seconds * 1000000. / 100.) {
+                /* When we know the fuel gauge's update period, keep the first
+                 * state after each update, so statistics run edge to edge */
+                if (state->update_period_us == 0 ||
+                    state->energy_time_us != last_state->energy_time_us ||
+                    state->time_us - last_state->time_us > 2 * state->update_period_us)
+                    use_this_state = TRUE;
+            }
             break;
         case GBB_DURATION_PERCENT:
         {
@@ -201,38 +373,153 @@ test_run_add_internal(GbbTestRun    *run,
                 use_this_state = TRUE;
             break;
         }
+        case GBB_DURATION_CONVERGED:
+            /* The length isn't known in advance; keep each fuel gauge update,
+             * which is what the fit uses, and otherwise a state every so often */
+            if (state->energy_time_us != last_state->energy_time_us ||
+                state->time_us - last_state->time_us > 10 * 1000000)
+                use_this_state = TRUE;
+            break;
         }
     }
 
     if (!use_this_state) {
         gbb_power_state_free(state);
-        return;
+        return FALSE;
     }
 
     g_queue_push_tail(run->history, state);
 
+    int n_points = gbb_power_fit_get_n_points(run->power_fit);
+    gbb_power_fit_add_state(run->power_fit, state);
+    if (gbb_power_fit_get_n_points(run->power_fit) != n_points) {
+        ConvergencePoint point;
+        point.time_us = state->time_us;
+        point.relative_error = gbb_test_run_get_relative_error(run);
+        if (point.relative_error >= 0 &&
+            gbb_power_fit_get_power(run->power_fit, &point.power, NULL))
+            g_array_append_val(run->convergence, point);
+    }
+
     if (start_state) {
-        GbbPowerStatistics *overall_stats = gbb_power_statistics_compute(start_state, state);
+        GbbPowerStatistics *overall_stats = gbb_power_statistics_compute_with_estimator(start_state, state,
+                                                                                        run->estimator);
         run->max_life = MAX(overall_stats->battery_life, run->max_life);
 
-        GbbPowerStatistics *interval_stats = gbb_power_statistics_compute(last_state, state);
-        run->max_power = MAX(interval_stats->power, run->max_power);
+        GbbPowerStatistics *interval_stats = gbb_power_statistics_compute_with_estimator(last_state, state,
+                                                                                         run->estimator);
+        if (last_state->supplies_serial == state->supplies_serial)
+            run->max_power = MAX(interval_stats->power, run->max_power);
 
         gbb_power_statistics_free(interval_stats);
         gbb_power_statistics_free(overall_stats);
     }
 
     g_signal_emit(run, signals[UPDATED], 0);
+
+    return TRUE;
 }
 
 void
 gbb_test_run_add(GbbTestRun          *run,
                  const GbbPowerState *state)
 {
-    test_run_add_internal(run, gbb_power_state_copy(state));
+    test_run_add_internal(run, gbb_power_state_copy(state), TRUE);
     g_signal_emit(run, signals[UPDATED], 0);
 }
 
+/**
+ * gbb_test_run_add_event:
+ * @run: a #GbbTestRun
+ * @time_us: when the event happened, in the same timebase as GbbPowerState.time_us
+ * @description: what happened
+ *
+ * Annotates the run with something that happened during it, such as
+ * a power supply being plugged in.
+ */
+void
+gbb_test_run_add_event(GbbTestRun *run,
+                       gint64      time_us,
+                       const char *description)
+{
+    GbbTestEvent *event = g_slice_new(GbbTestEvent);
+    event->time_us = time_us;
+    event->description = g_strdup(description);
+    g_queue_push_tail(run->events, event);
+}
+
+GQueue *
+gbb_test_run_get_events(GbbTestRun *run)
+{
+    return run->events;
+}
+
+#define ACCUMULATE(field)                                               \
+    total->field = (total->field >= 0 && stats->field >= 0) ?           \
+        (total->field * total_time + stats->field * time) / (total_time + time) : -1
+
+/**
+ * gbb_test_run_compute_statistics:
+ * @run: a #GbbTestRun
+ *
+ * Computes statistics for the whole run, like gbb_power_statistics_compute()
+ * between the first and last states, but leaving out intervals where power
+ * supplies were added or removed. Values are averaged over the remaining
+ * intervals, weighted by time.
+ *
+ * Return value: the statistics, or %NULL if there aren't two states to compare
+ */
+GbbPowerStatistics *
+gbb_test_run_compute_statistics(GbbTestRun *run)
+{
+    GbbPowerStatistics *total = NULL;
+    double total_time = 0;
+    GList *segment_start = run->history->head;
+    GList *l;
+    int i;
+
+    for (l = run->history->head; l; l = l->next) {
+        const GbbPowerState *state = l->data;
+        const GbbPowerState *next_state = l->next ? l->next->data : NULL;
+
+        if (next_state && next_state->supplies_serial == state->supplies_serial)
+            continue;
+
+        const GbbPowerState *start_state = segment_start->data;
+        segment_start = l->next;
+        if (state == start_state)
+            continue;
+
+        GbbPowerStatistics *stats = gbb_power_statistics_compute_with_estimator(start_state, state,
+                                                                                run->estimator);
+        double time = (state->time_us - start_state->time_us) / 1000000.;
+
+        if (total == NULL) {
+            total = stats;
+            total_time = time;
+            continue;
+        }
+
+        ACCUMULATE(power);
+        ACCUMULATE(current);
+        ACCUMULATE(power_integrated);
+        ACCUMULATE(battery_life);
+        ACCUMULATE(battery_life_design);
+        for (i = 0; i < GBB_RAPL_N_DOMAINS; i++)
+            ACCUMULATE(rapl_power[i]);
+        /* Which battery is which can change with the set of supplies */
+        for (i = 0; i < GBB_MAX_BATTERIES; i++)
+            total->battery_power[i] = -1;
+
+        total_time += time;
+        gbb_power_statistics_free(stats);
+    }
+
+    return total;
+}
+
+#undef ACCUMULATE
+
 GbbBatteryTest *
 gbb_test_run_get_test(GbbTestRun *run)
 {
@@ -294,6 +581,116 @@ gbb_test_run_get_max_battery_life(GbbTestRun *run)
     return run->max_life;
 }
 
+/**
+ * gbb_test_run_get_power_fit:
+ * @run: a #GbbTestRun
+ * @power: (out): location to store the power (W)
+ * @error: (out): location to store the standard error of @power (W)
+ *
+ * Gets the slope of a line fitted through the battery's energy over the
+ * run, or the part since the power supplies last changed. Unlike the
+ * difference between the first and last readings, this has an error
+ * bar, which shrinks as the run goes on.
+ *
+ * Return value: %TRUE if there were enough updates of the energy
+ *   to fit a line.
+ */
+gboolean
+gbb_test_run_get_power_fit(GbbTestRun *run,
+                           double     *power,
+                           double     *error)
+{
+    return gbb_power_fit_get_power(run->power_fit, power, error);
+}
+
+/* How late the events of the test loop were played */
+void
+gbb_test_run_set_playback_timing(GbbTestRun              *run,
+                                 const GbbPlaybackTiming *timing)
+{
+    if (!run->playback_timing)
+        run->playback_timing = g_slice_new(GbbPlaybackTiming);
+
+    *run->playback_timing = *timing;
+}
+
+/* Return value: the timing, or %NULL if it hasn't been set */
+const GbbPlaybackTiming *
+gbb_test_run_get_playback_timing(GbbTestRun *run)
+{
+    return run->playback_timing;
+}
+
+/**
+ * gbb_test_run_add_playback_progress:
+ * @run: a #GbbTestRun
+ * @progress: progress reported by the player of the test loop
+ *
+ * Records where the loop was at a point in time, so that the power
+ * readings can be matched with what was being played when they were
+ * taken.
+ */
+void
+gbb_test_run_add_playback_progress(GbbTestRun                *run,
+                                   const GbbPlaybackProgress *progress)
+{
+    ProgressPoint point;
+    point.time_us = progress->time_us;
+    point.iteration = progress->iteration;
+    point.position_ms = progress->position_ms;
+    g_array_append_val(run->progress, point);
+}
+
+/* Where in the test loop to start playing, in milliseconds; used to
+ * resume from where an earlier run stopped */
+void
+gbb_test_run_set_loop_start(GbbTestRun *run,
+                            guint       position)
+{
+    run->loop_start = position;
+}
+
+guint
+gbb_test_run_get_loop_start(GbbTestRun *run)
+{
+    return run->loop_start;
+}
+
+/* Called as each iteration of the loop finishes, with the number
+ * finished since playback started */
+void
+gbb_test_run_set_iterations(GbbTestRun *run,
+                            guint       n_iterations)
+{
+    run->n_iterations = n_iterations;
+}
+
+guint
+gbb_test_run_get_iterations(GbbTestRun *run)
+{
+    return run->n_iterations;
+}
+
+void
+gbb_test_run_set_loop_stop(GbbTestRun *run,
+                           guint       position)
+{
+    run->loop_stop = position;
+    run->have_loop_stop = TRUE;
+}
+
+/* Return value: %TRUE if the loop was played and @position was set to
+ * where it stopped */
+gboolean
+gbb_test_run_get_loop_stop(GbbTestRun *run,
+                           guint      *position)
+{
+    if (run->have_loop_stop)
+        *position = run->loop_stop;
+
+    return run->have_loop_stop;
+}
+
 static void
 add_int_value_1e6(JsonBuilder *builder,
                   double       value)
@@ -301,6 +698,54 @@ add_int_value_1e6(JsonBuilder *builder,
     json_builder_add_int_value(builder, (gint64)(0.5 + 1e6 * value));
 }
 
+/* Times are written relative to @start_time_us */
+static void
+add_battery_state(JsonBuilder           *builder,
+                  const GbbBatteryState *battery,
+                  gint64                 start_time_us)
+{
+    json_builder_begin_object(builder);
+    json_builder_set_member_name(builder, "name");
+    json_builder_add_string_value(builder, battery->name);
+    if (battery->have_energy_time) {
+        json_builder_set_member_name(builder, "energy-time-ms");
+        json_builder_add_int_value(builder, (battery->energy_time_us - start_time_us) / 1000);
+    }
+    if (battery->energy_now >= 0) {
+        json_builder_set_member_name(builder, "energy");
+        add_int_value_1e6(builder, battery->energy_now);
+        json_builder_set_member_name(builder, "energy-full");
+        add_int_value_1e6(builder, battery->energy_full);
+    }
+    if (battery->charge_now >= 0) {
+        json_builder_set_member_name(builder, "charge");
+        add_int_value_1e6(builder, battery->charge_now);
+        json_builder_set_member_name(builder, "charge-full");
+        add_int_value_1e6(builder, battery->charge_full);
+    }
+    if (battery->capacity_now >= 0) {
+        json_builder_set_member_name(builder, "capacity");
+        add_int_value_1e6(builder, battery->capacity_now);
+    }
+    if (battery->voltage_now >= 0) {
+        json_builder_set_member_name(builder, "voltage");
+        add_int_value_1e6(builder, battery->voltage_now);
+    }
+    if (battery->power_now >= 0) {
+        json_builder_set_member_name(builder, "power-now");
+        add_int_value_1e6(builder, battery->power_now);
+    }
+    if (battery->status != GBB_BATTERY_STATUS_UNKNOWN) {
+        json_builder_set_member_name(builder, "status");
+        json_builder_add_string_value(builder, gbb_battery_status_get_name(battery->status));
+    }
+    if (battery->cycle_count >= 0) {
+        json_builder_set_member_name(builder, "cycle-count");
+        json_builder_add_int_value(builder, battery->cycle_count);
+    }
+    json_builder_end_object(builder);
+}
+
 gboolean
 gbb_test_run_write_to_file(GbbTestRun *run,
                            const char *filename,
@@ -320,12 +765,48 @@ gbb_test_run_write_to_file(GbbTestRun *run,
     if (run->duration_type == GBB_DURATION_TIME) {
         json_builder_set_member_name(builder, "duration-seconds");
         json_builder_add_double_value(builder, run->duration.seconds);
+    } else if (run->duration_type == GBB_DURATION_CONVERGED) {
+        json_builder_set_member_name(builder, "until-relative-error");
+        json_builder_add_double_value(builder, run->duration.converged.relative_error);
+        json_builder_set_member_name(builder, "min-iterations");
+        json_builder_add_int_value(builder, run->duration.converged.min_iterations);
+        if (run->duration.converged.max_seconds > 0) {
+            json_builder_set_member_name(builder, "max-duration-seconds");
+            json_builder_add_double_value(builder, run->duration.converged.max_seconds);
+        }
     } else  {
         json_builder_set_member_name(builder, "until-percent");
         json_builder_add_double_value(builder, run->duration.percent);
     }
+    if (run->test && run->test->loop_log && !gbb_event_transform_is_identity(&run->test->transform)) {
+        const GbbEventTransform *transform = &run->test->transform;
+
+        json_builder_set_member_name(builder, "transform");
+        json_builder_begin_object(builder);
+        json_builder_set_member_name(builder, "speed");
+        json_builder_add_double_value(builder, transform->speed);
+        if (transform->motion_rate > 0) {
+            json_builder_set_member_name(builder, "motion-rate");
+            json_builder_add_double_value(builder, transform->motion_rate);
+        }
+        if (transform->max_idle > 0) {
+            json_builder_set_member_name(builder, "max-idle-seconds");
+            json_builder_add_double_value(builder, transform->max_idle / 1000.);
+        }
+        json_builder_end_object(builder);
+    }
+    if (run->loop_start != 0) {
+        json_builder_set_member_name(builder, "loop-start-seconds");
+        json_builder_add_double_value(builder, run->loop_start / 1000.);
+    }
+    if (run->have_loop_stop) {
+        json_builder_set_member_name(builder, "loop-stop-seconds");
+        json_builder_add_double_value(builder, run->loop_stop / 1000.);
+    }
     json_builder_set_member_name(builder, "screen-brightness");
     json_builder_add_int_value(builder, run->screen_brightness);
+    json_builder_set_member_name(builder, "power-estimator");
+    json_builder_add_string_value(builder, gbb_power_estimator_get_name(run->estimator));
 
     if (run->start_time != 0) {
         GDateTime *start = g_date_time_new_from_unix_utc(run->start_time);
@@ -338,12 +819,16 @@ gbb_test_run_write_to_file(GbbTestRun *run,
 
     const GbbPowerState *start_state = gbb_test_run_get_start_state(run);
     const GbbPowerState *end_state = gbb_test_run_get_last_state(run);
-    if (end_state != start_state) {
+    if (end_state && end_state->update_period_us != 0) {
+        json_builder_set_member_name(builder, "update-period");
+        json_builder_add_double_value(builder, end_state->update_period_us / 1000000.);
+    }
+    GbbPowerStatistics *statistics = gbb_test_run_compute_statistics(run);
+    if (statistics) {
         /* The statistics aren't needed for reading the data back into the UI,
          * but are useful if the ouput files are going to be read by some other
          * consumer.
          */
-        GbbPowerStatistics *statistics = gbb_power_statistics_compute(start_state, end_state);
         if (statistics->power > 0) {
             json_builder_set_member_name(builder, "power");
             json_builder_add_double_value(builder, statistics->power);
@@ -352,6 +837,10 @@ gbb_test_run_write_to_file(GbbTestRun *run,
             json_builder_set_member_name(builder, "current");
             json_builder_add_double_value(builder, statistics->current);
         }
+        if (statistics->power_integrated > 0) {
+            json_builder_set_member_name(builder, "power-integrated");
+            json_builder_add_double_value(builder, statistics->power_integrated);
+        }
         if (statistics->battery_life > 0) {
             json_builder_set_member_name(builder, "estimated-life");
             json_builder_add_double_value(builder, statistics->battery_life);
@@ -361,24 +850,166 @@ gbb_test_run_write_to_file(GbbTestRun *run,
             json_builder_add_double_value(builder, statistics->battery_life_design);
         }
 
+        int i;
+        if (start_state->n_batteries > 1) {
+            json_builder_set_member_name(builder, "battery-power");
+            json_builder_begin_object(builder);
+            for (i = 0; i < start_state->n_batteries; i++) {
+                if (statistics->battery_power[i] >= 0) {
+                    json_builder_set_member_name(builder, start_state->batteries[i].name);
+                    json_builder_add_double_value(builder, statistics->battery_power[i]);
+                }
+            }
+            json_builder_end_object(builder);
+        }
+
+        for (i = 0; i < GBB_RAPL_N_DOMAINS; i++) {
+            if (statistics->rapl_power[i] >= 0) {
+                char *member_name = g_strconcat("rapl-power-", gbb_rapl_domain_get_name(i), NULL);
+                json_builder_set_member_name(builder, member_name);
+                json_builder_add_double_value(builder, statistics->rapl_power[i]);
+                g_free(member_name);
+            }
+        }
+
         gbb_power_statistics_free(statistics);
     }
 
+    double fit_power, fit_error;
+    if (gbb_test_run_get_power_fit(run, &fit_power, &fit_error)) {
+        json_builder_set_member_name(builder, "power-fit");
+        json_builder_add_double_value(builder, fit_power);
+        json_builder_set_member_name(builder, "power-fit-error");
+        json_builder_add_double_value(builder, fit_error);
+    }
+
+    guint i;
+    if (run->duration_type == GBB_DURATION_CONVERGED && run->convergence->len > 0 && start_state) {
+        json_builder_set_member_name(builder, "convergence");
+        json_builder_begin_array(builder);
+        for (i = 0; i < run->convergence->len; i++) {
+            ConvergencePoint *point = &g_array_index(run->convergence, ConvergencePoint, i);
+            json_builder_begin_object(builder);
+            json_builder_set_member_name(builder, "time-ms");
+            json_builder_add_int_value(builder, (point->time_us - start_state->time_us) / 1000);
+            json_builder_set_member_name(builder, "power");
+            json_builder_add_double_value(builder, point->power);
+            json_builder_set_member_name(builder, "relative-error");
+            json_builder_add_double_value(builder, point->relative_error);
+            json_builder_end_object(builder);
+        }
+        json_builder_end_array(builder);
+    }
+
+    if (run->playback_timing) {
+        const GbbPlaybackTiming *timing = run->playback_timing;
+
+        json_builder_set_member_name(builder, "playback-timing");
+        json_builder_begin_object(builder);
+        json_builder_set_member_name(builder, "events");
+        json_builder_add_int_value(builder, timing->n_events);
+        if (timing->n_events > 0) {
+            json_builder_set_member_name(builder, "lateness-p50-us");
+            json_builder_add_int_value(builder, gbb_playback_timing_get_percentile(timing, 0.5));
+            json_builder_set_member_name(builder, "lateness-p99-us");
+            json_builder_add_int_value(builder, gbb_playback_timing_get_percentile(timing, 0.99));
+            json_builder_set_member_name(builder, "lateness-max-us");
+            json_builder_add_int_value(builder, timing->max_lateness_us);
+        }
+        json_builder_set_member_name(builder, "wakeups");
+        json_builder_add_int_value(builder, timing->n_wakeups);
+        json_builder_set_member_name(builder, "write-syscalls");
+        json_builder_add_int_value(builder, timing->n_writes);
+        json_builder_set_member_name(builder, "elapsed-ms");
+        json_builder_add_int_value(builder, timing->elapsed_us / 1000);
+        json_builder_set_member_name(builder, "late-1ms");
+        json_builder_add_int_value(builder, timing->n_late_1ms);
+        json_builder_set_member_name(builder, "late-5ms");
+        json_builder_add_int_value(builder, timing->n_late_5ms);
+        json_builder_set_member_name(builder, "late-20ms");
+        json_builder_add_int_value(builder, timing->n_late_20ms);
+
+        /* Only the buckets that have events, by the lateness they start at */
+        json_builder_set_member_name(builder, "histogram");
+        json_builder_begin_array(builder);
+        for (i = 0; i < GBB_PLAYBACK_TIMING_N_BUCKETS; i++) {
+            if (timing->buckets[i] == 0)
+                continue;
+            json_builder_begin_object(builder);
+            json_builder_set_member_name(builder, "from-us");
+            json_builder_add_int_value(builder, gbb_playback_timing_get_bucket_start(i));
+            json_builder_set_member_name(builder, "count");
+            json_builder_add_int_value(builder, timing->buckets[i]);
+            json_builder_end_object(builder);
+        }
+        json_builder_end_array(builder);
+        json_builder_end_object(builder);
+    }
+
+    GList *l;
+    if (run->events->head && start_state) {
+        json_builder_set_member_name(builder, "events");
+        json_builder_begin_array(builder);
+        for (l = run->events->head; l; l = l->next) {
+            GbbTestEvent *event = l->data;
+            json_builder_begin_object(builder);
+            json_builder_set_member_name(builder, "time-ms");
+            json_builder_add_int_value(builder, (event->time_us - start_state->time_us) / 1000);
+            json_builder_set_member_name(builder, "description");
+            json_builder_add_string_value(builder, event->description);
+            json_builder_end_object(builder);
+        }
+        json_builder_end_array(builder);
+    }
+
     json_builder_set_member_name(builder, "log");
     json_builder_begin_array(builder);
-    GList *l;
+
+    /* The fit as it stood at each point of the run */
+    GbbPowerFit *fit = gbb_power_fit_new(0);
+
+    /* The loop plays on one continuous timeline, so the position at
+     * any time follows from the last progress reported before it */
+    guint loop_period = 0;
+    if (run->test && run->test->loop_log)
+        loop_period = MAX(gbb_event_log_get_duration(run->test->loop_log), 1);
+    guint progress_index = 0;
 
     const GbbPowerState *last_state = NULL;
     for (l = run->history->head; l; l = l->next) {
         const GbbPowerState *state = l->data;
+        gbb_power_fit_add_state(fit, state);
 
         json_builder_begin_object(builder);
         json_builder_set_member_name(builder, "time-ms");
         json_builder_add_int_value(builder, (500 + state->time_us - start_state->time_us) / 1000);
+
+        while (progress_index + 1 < run->progress->len &&
+               g_array_index(run->progress, ProgressPoint, progress_index + 1).time_us <= state->time_us)
+            progress_index++;
+        if (loop_period > 0 && progress_index < run->progress->len) {
+            const ProgressPoint *point = &g_array_index(run->progress, ProgressPoint, progress_index);
+            if (point->time_us <= state->time_us) {
+                guint64 position = point->position_ms + (state->time_us - point->time_us) / 1000;
+                json_builder_set_member_name(builder, "loop-iteration");
+                json_builder_add_int_value(builder, point->iteration + position / loop_period);
+                json_builder_set_member_name(builder, "loop-position-ms");
+                json_builder_add_int_value(builder, position % loop_period);
+            }
+        }
+        if (last_state && state->supplies_serial != last_state->supplies_serial) {
+            json_builder_set_member_name(builder, "supplies-serial");
+            json_builder_add_int_value(builder, state->supplies_serial);
+        }
         if (!last_state || state->online != last_state->online) {
             json_builder_set_member_name(builder, "online");
             json_builder_add_boolean_value(builder, state->online);
         }
+        if (state->have_energy_time &&
+            (!last_state || !last_state->have_energy_time || state->energy_time_us != last_state->energy_time_us)) {
+            json_builder_set_member_name(builder, "energy-time-ms");
+            json_builder_add_int_value(builder, (state->energy_time_us - start_state->time_us) / 1000);
+        }
         if (state->energy_now >= 0) {
             json_builder_set_member_name(builder, "energy");
             add_int_value_1e6(builder, state->energy_now);
@@ -407,11 +1038,50 @@ gbb_test_run_write_to_file(GbbTestRun *run,
             json_builder_set_member_name(builder, "capacity");
             add_int_value_1e6(builder, state->capacity_now);
         }
+        if (state->power_now >= 0) {
+            json_builder_set_member_name(builder, "power-now");
+            add_int_value_1e6(builder, state->power_now);
+        }
+        if (state->energy_integrated >= 0) {
+            json_builder_set_member_name(builder, "energy-integrated");
+            add_int_value_1e6(builder, state->energy_integrated);
+        }
+        if (gbb_power_fit_get_power(fit, &fit_power, &fit_error)) {
+            json_builder_set_member_name(builder, "power-fit");
+            json_builder_add_double_value(builder, fit_power);
+            json_builder_set_member_name(builder, "power-fit-error");
+            json_builder_add_double_value(builder, fit_error);
+        }
+
+        int i;
+        /* With a single battery, the combined figures say it all,
+         * unless we also know the status and cycle count */
+        if (state->n_batteries > 1 ||
+            (state->n_batteries == 1 &&
+             (state->batteries[0].status != GBB_BATTERY_STATUS_UNKNOWN ||
+              state->batteries[0].cycle_count >= 0))) {
+            json_builder_set_member_name(builder, "batteries");
+            json_builder_begin_array(builder);
+            for (i = 0; i < state->n_batteries; i++)
+                add_battery_state(builder, &state->batteries[i], start_state->time_us);
+            json_builder_end_array(builder);
+        }
+
+        for (i = 0; i < GBB_RAPL_N_DOMAINS; i++) {
+            if (state->rapl_energy[i] >= 0) {
+                char *member_name = g_strconcat("rapl-energy-", gbb_rapl_domain_get_name(i), NULL);
+                json_builder_set_member_name(builder, member_name);
+                add_int_value_1e6(builder, state->rapl_energy[i]);
+                g_free(member_name);
+            }
+        }
 
         json_builder_end_object(builder);
         last_state = state;
     }
 
+    gbb_power_fit_free(fit);
+
     json_builder_end_array(builder);
 
     json_builder_end_object(builder);
@@ -590,6 +1260,76 @@ get_array(JsonObject  *object,
     }
 }
 
+static gboolean
+read_battery_state(JsonNode        *node,
+                   GbbBatteryState *battery,
+                   GError         **error)
+{
+    const char *v_string;
+
+    if (!JSON_NODE_HOLDS_OBJECT(node)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                    "Battery element isn't an object");
+        return FALSE;
+    }
+
+    JsonObject *object = json_node_get_object(node);
+
+    battery->name[0] = '\0';
+    battery->energy_now = -1;
+    battery->energy_full = -1;
+    battery->energy_full_design = -1;
+    battery->charge_now = -1;
+    battery->charge_full = -1;
+    battery->charge_full_design = -1;
+    battery->capacity_now = -1;
+    battery->voltage_now = -1;
+    battery->power_now = -1;
+    battery->energy_time_us = 0;
+    battery->have_energy_time = FALSE;
+    battery->cycle_count = -1;
+    battery->status = GBB_BATTERY_STATUS_UNKNOWN;
+
+    switch (get_string(object, "name", &v_string, error)) {
+    case MISSING: break;
+    case ERROR: return FALSE;
+    case OK: g_strlcpy(battery->name, v_string, sizeof(battery->name)); break;
+    }
+
+    switch (get_string(object, "status", &v_string, error)) {
+    case MISSING: break;
+    case ERROR: return FALSE;
+    case OK: battery->status = gbb_battery_status_from_string(v_string, strlen(v_string)); break;
+    }
+
+    gint64 v_int;
+    switch (get_int(object, "cycle-count", &v_int, error)) {
+    case MISSING: break;
+    case ERROR: return FALSE;
+    case OK: battery->cycle_count = v_int; break;
+    }
+
+    switch (get_int(object, "energy-time-ms", &v_int, error)) {
+    case MISSING: break;
+    case ERROR: return FALSE;
+    case OK:
+        battery->energy_time_us = v_int * 1000;
+        battery->have_energy_time = TRUE;
+        break;
+    }
+
+    if (get_int_1e6(object, "energy", &battery->energy_now, error) == ERROR ||
+        get_int_1e6(object, "energy-full", &battery->energy_full, error) == ERROR ||
+        get_int_1e6(object, "charge", &battery->charge_now, error) == ERROR ||
+        get_int_1e6(object, "charge-full", &battery->charge_full, error) == ERROR ||
+        get_int_1e6(object, "capacity", &battery->capacity_now, error) == ERROR ||
+        get_int_1e6(object, "voltage", &battery->voltage_now, error) == ERROR ||
+        get_int_1e6(object, "power-now", &battery->power_now, error) == ERROR)
+        return FALSE;
+
+    return TRUE;
+}
+
 static gboolean
 read_from_file(GbbTestRun *run,
                const char *filename,
@@ -643,12 +1383,59 @@ read_from_file(GbbTestRun *run,
     case OK: gbb_test_run_set_duration_percent(run, v_double); break;
     }
 
+    /* The convergence trace is recomputed as the log is read */
+    switch (get_double(root_object, "until-relative-error", &v_double, error)) {
+    case MISSING: break;
+    case ERROR: goto out;
+    case OK:
+    {
+        gint64 min_iterations = 0;
+        double max_seconds = 0;
+        if (get_int(root_object, "min-iterations", &min_iterations, error) == ERROR ||
+            get_double(root_object, "max-duration-seconds", &max_seconds, error) == ERROR)
+            goto out;
+        gbb_test_run_set_duration_converged(run, v_double, min_iterations, max_seconds);
+        break;
+    }
+    }
+
+    switch (get_double(root_object, "loop-start-seconds", &v_double, error)) {
+    case MISSING: break;
+    case ERROR: goto out;
+    case OK: gbb_test_run_set_loop_start(run, lround(MAX(v_double, 0) * 1000)); break;
+    }
+
+    switch (get_double(root_object, "loop-stop-seconds", &v_double, error)) {
+    case MISSING: break;
+    case ERROR: goto out;
+    case OK: gbb_test_run_set_loop_stop(run, lround(MAX(v_double, 0) * 1000)); break;
+    }
+
     switch (get_int(root_object, "screen-brightness", &v_int, error)) {
     case MISSING: break;
     case ERROR: goto out;
     case OK: gbb_test_run_set_screen_brightness(run, v_int); break;
     }
 
+    gint64 update_period_us = 0;
+    switch (get_double(root_object, "update-period", &v_double, error)) {
+    case MISSING: break;
+    case ERROR: goto out;
+    case OK: update_period_us = v_double * 1000000.; break;
+    }
+
+    switch (get_string(root_object, "power-estimator", &v_string, error)) {
+    case MISSING: break;
+    case ERROR: goto out;
+    case OK:
+        if (!gbb_power_estimator_from_name(v_string, &run->estimator)) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                        "Unknown power-estimator '%s'", v_string);
+            goto out;
+        }
+        break;
+    }
+
     switch (get_string(root_object, "start-time", &v_string, error)) {
     case MISSING: break;
     case ERROR: goto out;
@@ -677,6 +1464,37 @@ read_from_file(GbbTestRun *run,
         g_date_time_unref(datetime);
     }}
 
+    switch (get_array(root_object, "events", &v_array, error)) {
+    case MISSING: break;
+    case ERROR: goto out;
+    case OK: {
+        int count = json_array_get_length(v_array);
+        int i;
+        for (i = 0; i < count; i++) {
+            JsonNode *node = json_array_get_element(v_array, i);
+            if (!JSON_NODE_HOLDS_OBJECT(node)) {
+                g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                            "Event element isn't an object");
+                goto out;
+            }
+
+            JsonObject *node_object = json_node_get_object(node);
+            gint64 time_ms = 0;
+
+            switch (get_int(node_object, "time-ms", &v_int, error)) {
+            case MISSING: break;
+            case ERROR: goto out;
+            case OK: time_ms = v_int; break;
+            }
+
+            switch (get_string(node_object, "description", &v_string, error)) {
+            case MISSING: break;
+            case ERROR: goto out;
+            case OK: gbb_test_run_add_event(run, time_ms * 1000, v_string); break;
+            }
+        }
+    }}
+
     switch (get_array(root_object, "log", &v_array, error)) {
     case MISSING: break;
     case ERROR: goto out;
@@ -699,12 +1517,29 @@ read_from_file(GbbTestRun *run,
 
             JsonObject *node_object = json_node_get_object(node);
 
+            state->update_period_us = update_period_us;
+
             switch (get_int(node_object, "time-ms", &v_int, error)) {
             case MISSING: break;
             case ERROR: goto out;
             case OK: state->time_us = v_int * 1000; break;
             }
 
+            switch (get_int(node_object, "energy-time-ms", &v_int, error)) {
+            case MISSING: break;
+            case ERROR: goto out;
+            case OK:
+                state->energy_time_us = v_int * 1000;
+                state->have_energy_time = TRUE;
+                break;
+            }
+
+            switch (get_int(node_object, "supplies-serial", &v_int, error)) {
+            case MISSING: break;
+            case ERROR: goto out;
+            case OK: state->supplies_serial = v_int; break;
+            }
+
             switch (get_boolean(node_object, "online", &v_boolean, error)) {
             case MISSING: break;
             case ERROR: goto out;
@@ -725,9 +1560,36 @@ read_from_file(GbbTestRun *run,
                 goto out;
             if (get_int_1e6(node_object, "capacity", &state->capacity_now, error) == ERROR)
                 goto out;
+            if (get_int_1e6(node_object, "power-now", &state->power_now, error) == ERROR)
+                goto out;
+            if (get_int_1e6(node_object, "energy-integrated", &state->energy_integrated, error) == ERROR)
+                goto out;
+
+            int j;
+            JsonArray *batteries_array;
+            switch (get_array(node_object, "batteries", &batteries_array, error)) {
+            case MISSING: break;
+            case ERROR: goto out;
+            case OK:
+                state->n_batteries = MIN(json_array_get_length(batteries_array), GBB_MAX_BATTERIES);
+                for (j = 0; j < state->n_batteries; j++) {
+                    if (!read_battery_state(json_array_get_element(batteries_array, j),
+                                            &state->batteries[j], error))
+                        goto out;
+                }
+                break;
+            }
+
+            for (j = 0; j < GBB_RAPL_N_DOMAINS; j++) {
+                char *member_name = g_strconcat("rapl-energy-", gbb_rapl_domain_get_name(j), NULL);
+                GetResult result = get_int_1e6(node_object, member_name, &state->rapl_energy[j], error);
+                g_free(member_name);
+                if (result == ERROR)
+                    goto out;
+            }
 
-            test_run_add_internal(run, state);
-            last_state = state;
+            if (test_run_add_internal(run, state, FALSE))
+                last_state = state;
 
             state = NULL;
         }
@@ -6,6 +6,7 @@
 #include <gio/gio.h>
 
 #include "battery-test.h"
+#include "playback-timing.h"
 #include "power-monitor.h"
 
 typedef struct _GbbTestRun GbbTestRun;
@@ -20,9 +21,16 @@ typedef struct _GbbTestRunClass GbbTestRunClass;
 
 typedef enum {
     GBB_DURATION_TIME,
-    GBB_DURATION_PERCENT
+    GBB_DURATION_PERCENT,
+    GBB_DURATION_CONVERGED
 } GbbDurationType;
 
+/* Something noteworthy that happened during a run */
+typedef struct {
+    gint64 time_us;
+    char *description;
+} GbbTestEvent;
+
 GType gbb_test_run_get_type(void);
 
 GbbTestRun *gbb_test_run_new(GbbBatteryTest *test);
@@ -40,10 +48,17 @@ void            gbb_test_run_set_duration_time    (GbbTestRun *run,
                                                    double      duration_seconds);
 void            gbb_test_run_set_duration_percent (GbbTestRun *run,
                                                    double      percent);
+void            gbb_test_run_set_duration_converged (GbbTestRun *run,
+                                                     double      relative_error,
+                                                     int         min_iterations,
+                                                     double      max_seconds);
 
 GbbDurationType gbb_test_run_get_duration_type    (GbbTestRun *run);
 double          gbb_test_run_get_duration_time    (GbbTestRun *run);
 double          gbb_test_run_get_duration_percent (GbbTestRun *run);
+double          gbb_test_run_get_duration_relative_error (GbbTestRun *run);
+int             gbb_test_run_get_duration_min_iterations (GbbTestRun *run);
+double          gbb_test_run_get_duration_max_time       (GbbTestRun *run);
 
 gboolean        gbb_test_run_is_done              (GbbTestRun *run);
 
@@ -51,6 +66,10 @@ void            gbb_test_run_set_screen_brightness (GbbTestRun *run,
                                                     int         screen_brightness);
 int             gbb_test_run_get_screen_brightness (GbbTestRun *run);
 
+void              gbb_test_run_set_estimator (GbbTestRun        *run,
+                                              GbbPowerEstimator  estimator);
+GbbPowerEstimator gbb_test_run_get_estimator (GbbTestRun        *run);
+
 void gbb_test_run_add(GbbTestRun          *run,
                       const GbbPowerState *state);
 
@@ -62,11 +81,40 @@ const char     *gbb_test_run_get_description (GbbTestRun *run);
 
 GQueue         *gbb_test_run_get_history(GbbTestRun *run);
 
+void            gbb_test_run_add_event (GbbTestRun *run,
+                                        gint64      time_us,
+                                        const char *description);
+GQueue         *gbb_test_run_get_events(GbbTestRun *run);
+
+GbbPowerStatistics *gbb_test_run_compute_statistics(GbbTestRun *run);
+
 const GbbPowerState *gbb_test_run_get_start_state (GbbTestRun *run);
 const GbbPowerState *gbb_test_run_get_last_state  (GbbTestRun *run);
 
 double          gbb_test_run_get_max_power        (GbbTestRun *run);
 double          gbb_test_run_get_max_battery_life (GbbTestRun *run);
+gboolean        gbb_test_run_get_power_fit        (GbbTestRun *run,
+                                                   double     *power,
+                                                   double     *error);
+double          gbb_test_run_get_relative_error   (GbbTestRun *run);
+
+void                     gbb_test_run_set_playback_timing (GbbTestRun              *run,
+                                                           const GbbPlaybackTiming *timing);
+const GbbPlaybackTiming *gbb_test_run_get_playback_timing (GbbTestRun              *run);
+
+void gbb_test_run_add_playback_progress (GbbTestRun                *run,
+                                         const GbbPlaybackProgress *progress);
+
+void     gbb_test_run_set_loop_start (GbbTestRun *run,
+                                      guint       position);
+guint    gbb_test_run_get_loop_start (GbbTestRun *run);
+void     gbb_test_run_set_iterations (GbbTestRun *run,
+                                      guint       n_iterations);
+guint    gbb_test_run_get_iterations (GbbTestRun *run);
+void     gbb_test_run_set_loop_stop  (GbbTestRun *run,
+                                      guint       position);
+gboolean gbb_test_run_get_loop_stop  (GbbTestRun *run,
+                                      guint      *position);
 
 char *gbb_test_run_get_default_path(GbbTestRun *run,
                                     GFile      *folder);
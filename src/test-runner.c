@@ -16,6 +16,12 @@ struct _GbbTestRunner {
 
     GbbTestPhase phase;
     gboolean stop_requested;
+
+    /* While waiting: since when we've been off AC, and the fuel gauge
+     * update that was current then */
+    gint64 offline_time_us;
+    gboolean offline_have_energy_time;
+    gint64 offline_energy_time_us;
 };
 
 struct _GbbTestRunnerClass {
@@ -29,6 +35,13 @@ enum {
 
 static guint signals[LAST_SIGNAL];
 
+/* Often enough to place power readings in the loop; whole seconds let
+ * the wakeups be batched with others */
+#define DEFAULT_PROGRESS_INTERVAL 1000 /* ms */
+
+/* How long to wait for a fuel gauge update to start on (s) */
+#define EDGE_WAIT_TIMEOUT 120
+
 G_DEFINE_TYPE(GbbTestRunner, gbb_test_runner, G_TYPE_OBJECT)
 
 static void
@@ -53,9 +66,9 @@ runner_set_stopped(GbbTestRunner *runner)
 static void
 runner_set_epilogue(GbbTestRunner *runner)
 {
-    if (runner->test->epilogue_file) {
-        gbb_event_player_play_file(runner->player, runner->test->epilogue_file);
+    if (runner->test->epilogue_log) {
         runner_set_phase(runner, GBB_TEST_PHASE_EPILOGUE);
+        gbb_event_player_play_log(runner->player, runner->test->epilogue_log);
     } else {
         runner_set_stopped(runner);
     }
@@ -72,18 +85,76 @@ on_player_finished(GbbEventPlayer *player,
             runner->stop_requested = FALSE;
             gbb_test_runner_stop(runner);
         }
-    } else if (runner->phase == GBB_TEST_PHASE_RUNNING) {
-        if (gbb_test_run_is_done(runner->run))
-            runner_set_epilogue(runner);
-        else
-            gbb_event_player_play_file(player, runner->test->loop_file);
-    } else if (runner->phase == GBB_TEST_PHASE_STOPPING) {
+    } else if (runner->phase == GBB_TEST_PHASE_RUNNING ||
+               runner->phase == GBB_TEST_PHASE_STOPPING) {
+        GbbPlaybackTiming timing;
+        gbb_event_player_get_timing(player, &timing);
+        gbb_test_run_set_playback_timing(runner->run, &timing);
+        gbb_test_run_set_loop_stop(runner->run, timing.position_ms);
+
         runner_set_epilogue(runner);
     } else if (runner->phase == GBB_TEST_PHASE_EPILOGUE) {
         runner_set_stopped(runner);
     }
 }
 
+/* The loop plays back-to-back until we stop it, so there is no idle
+ * gap between iterations to bias the measurement */
+static void
+on_player_iteration_finished(GbbEventPlayer *player,
+                             guint           n_iterations,
+                             GbbTestRunner  *runner)
+{
+    if (runner->phase != GBB_TEST_PHASE_RUNNING)
+        return;
+
+    gbb_test_run_set_iterations(runner->run, n_iterations);
+
+    /* A local player finishes inside stop(), and the finished handler
+     * moves on from STOPPING, so the phase must be set first */
+    if (gbb_test_run_is_done(runner->run)) {
+        runner_set_phase(runner, GBB_TEST_PHASE_STOPPING);
+        gbb_event_player_stop(runner->player);
+    }
+}
+
+static void
+on_player_progress(GbbEventPlayer            *player,
+                   const GbbPlaybackProgress *progress,
+                   GbbTestRunner             *runner)
+{
+    if (runner->phase == GBB_TEST_PHASE_RUNNING)
+        gbb_test_run_add_playback_progress(runner->run, progress);
+}
+
+/* The run starts on the first fuel gauge update after we go off AC,
+ * so that the counters are measured edge to edge from the start. A
+ * gauge that only reports a coarse capacity may take a long time to
+ * update, so after a while we start anyway.
+ */
+static gboolean
+runner_can_start(GbbTestRunner       *runner,
+                 const GbbPowerState *state)
+{
+    if (state->online) {
+        runner->offline_time_us = 0;
+        return FALSE;
+    }
+
+    if (runner->offline_time_us == 0) {
+        runner->offline_time_us = state->time_us;
+        runner->offline_have_energy_time = state->have_energy_time;
+        runner->offline_energy_time_us = state->energy_time_us;
+        return FALSE;
+    }
+
+    if (state->have_energy_time &&
+        (!runner->offline_have_energy_time || state->energy_time_us != runner->offline_energy_time_us))
+        return TRUE;
+
+    return state->time_us - runner->offline_time_us > EDGE_WAIT_TIMEOUT * G_USEC_PER_SEC;
+}
+
 static void
 on_power_monitor_changed(GbbPowerMonitor *monitor,
                          GbbTestRunner   *runner)
@@ -91,17 +162,30 @@ on_power_monitor_changed(GbbPowerMonitor *monitor,
     const GbbPowerState *current_state = gbb_power_monitor_get_state(monitor);
 
     if (runner->phase == GBB_TEST_PHASE_WAITING) {
-        if (!current_state->online) {
+        if (runner_can_start(runner, current_state)) {
             gbb_test_run_set_start_time(runner->run, time(NULL));
             gbb_test_run_add(runner->run, current_state);
             runner_set_phase(runner, GBB_TEST_PHASE_RUNNING);
-            gbb_event_player_play_file(runner->player, runner->test->loop_file);
+            gbb_event_player_play_loop(runner->player, runner->test->loop_log,
+                                       gbb_test_run_get_loop_start(runner->run), 0, 0);
         }
     } else if (runner->phase == GBB_TEST_PHASE_RUNNING) {
         gbb_test_run_add(runner->run, current_state);
     }
 }
 
+/* Power supplies coming and going make the surrounding interval
+ * meaningless; the run leaves it out of its statistics */
+static void
+on_power_supplies_changed(GbbPowerMonitor *monitor,
+                          gint64           time_us,
+                          const char      *description,
+                          GbbTestRunner   *runner)
+{
+    if (runner->phase == GBB_TEST_PHASE_RUNNING)
+        gbb_test_run_add_event(runner->run, time_us, description);
+}
+
 static void
 gbb_test_runner_finalize(GObject *object)
 {
@@ -119,10 +203,18 @@ gbb_test_runner_init(GbbTestRunner *runner)
     g_signal_connect(runner->monitor, "changed",
                      G_CALLBACK(on_power_monitor_changed),
                      runner);
+    g_signal_connect(runner->monitor, "supplies-changed",
+                     G_CALLBACK(on_power_supplies_changed),
+                     runner);
 
     runner->system_state = gbb_system_state_new();
 
     runner->player = GBB_EVENT_PLAYER(gbb_remote_player_new("GNOME Battery Bench"));
+    gbb_event_player_set_progress_interval(runner->player, DEFAULT_PROGRESS_INTERVAL);
+    g_signal_connect(runner->player, "iteration-finished",
+                     G_CALLBACK(on_player_iteration_finished), runner);
+    g_signal_connect(runner->player, "progress",
+                     G_CALLBACK(on_player_progress), runner);
     g_signal_connect(runner->player, "finished",
                      G_CALLBACK(on_player_finished), runner);
 }
@@ -199,14 +291,16 @@ gbb_test_runner_start(GbbTestRunner *runner)
     g_return_if_fail(runner->phase == GBB_TEST_PHASE_STOPPED);
     g_return_if_fail(runner->run != NULL);
 
+    runner->offline_time_us = 0;
+
     gbb_system_state_save(runner->system_state);
     gbb_system_state_set_brightnesses(runner->system_state,
                                       gbb_test_run_get_screen_brightness(runner->run),
                                       0);
 
-    if (runner->test->prologue_file) {
-        gbb_event_player_play_file(runner->player, runner->test->prologue_file);
+    if (runner->test->prologue_log) {
         runner_set_phase(runner, GBB_TEST_PHASE_PROLOGUE);
+        gbb_event_player_play_log(runner->player, runner->test->prologue_log);
     } else {
         runner_set_phase(runner, GBB_TEST_PHASE_WAITING);
     }
@@ -217,8 +311,8 @@ gbb_test_runner_stop(GbbTestRunner *runner)
 {
     if ((runner->phase == GBB_TEST_PHASE_WAITING || runner->phase == GBB_TEST_PHASE_RUNNING)) {
         if (runner->phase == GBB_TEST_PHASE_RUNNING) {
-            gbb_event_player_stop(runner->player);
             runner_set_phase(runner, GBB_TEST_PHASE_STOPPING);
+            gbb_event_player_stop(runner->player);
         } else {
             runner_set_epilogue(runner);
         }